@@ -0,0 +1,232 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "mkl.h"
+#include "mkl_spblas.h"
+#include "mkl_types.h"
+#include "bench_stats.hpp"
+
+// Dense-vs-sparse crossover autotuner.
+//
+// For C = A * B with A sparse (zero-based CSR, row-major operands) it times
+// cblas_sgemm, mkl_scsrmm and the inspector-executor mkl_sparse_s_mm once per
+// problem class and remembers the winner. A problem class is the shape
+// rounded to powers of two, the sparsity in 5% steps, the spread of the row
+// lengths, the thread count and the CPU model. Decisions are appended to a
+// plain text cache file, so later runs dispatch without timing anything:
+//   $SPMM_TUNE_CACHE, else $HOME/.cache/spmm_autotune.txt
+enum spmm_path
+{
+    SPMM_PATH_SGEMM,
+    SPMM_PATH_SCSRMM,
+    SPMM_PATH_SPARSE_MM,
+    SPMM_PATH_COUNT
+};
+
+inline const char *spmm_path_name(spmm_path p)
+{
+    static const char *names[SPMM_PATH_COUNT] = {"sgemm", "scsrmm", "sparse_mm"};
+    return names[p];
+}
+
+// CPU brand string without spaces, "unknown" when /proc/cpuinfo is unavailable.
+inline std::string cpu_model()
+{
+    std::string model = "unknown";
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f == NULL)
+        return model;
+    char line[512];
+    while (fgets(line, sizeof(line), f))
+    {
+        if (strncmp(line, "model name", 10) == 0)
+        {
+            const char *colon = strchr(line, ':');
+            if (colon == NULL)
+                break;
+            model.clear();
+            for (const char *c = colon + 1; *c && *c != '\n'; c++)
+                if (*c != ' ' || (!model.empty() && model.back() != '_'))
+                    model.push_back(*c == ' ' ? '_' : *c);
+            break;
+        }
+    }
+    fclose(f);
+    return model;
+}
+
+inline int ceil_log2(long long v)
+{
+    int l = 0;
+    while ((1LL << l) < v)
+        l++;
+    return l;
+}
+
+// Bucketed problem class, rendered as a single whitespace-free token.
+inline std::string spmm_tune_key(MKL_INT M, MKL_INT N, MKL_INT K, MKL_INT nnz, const MKL_INT *rowIndex, int threads)
+{
+    // coefficient of variation of the row lengths, in quarter steps up to 2
+    double mean = (double)nnz / (M ? M : 1), var = 0;
+    for (MKL_INT i = 0; i < M; i++)
+    {
+        double d = (rowIndex[i + 1] - rowIndex[i]) - mean;
+        var += d * d;
+    }
+    double cv = mean > 0 ? sqrt(var / (M ? M : 1)) / mean : 0;
+    int cv_bucket = (int)fmin(8.0, floor(cv * 4));
+    int sparsity_pct = (int)floor((1.0 - (double)nnz / ((double)M * K)) * 20) * 5;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "m%d_n%d_k%d_s%d_cv%d_t%d_", ceil_log2(M), ceil_log2(N), ceil_log2(K), sparsity_pct, cv_bucket, threads);
+    static const std::string cpu = cpu_model();
+    return buf + cpu;
+}
+
+struct SpmmDecision
+{
+    spmm_path path;
+    double ms[SPMM_PATH_COUNT];
+};
+
+class SpmmAutotuner
+{
+public:
+    explicit SpmmAutotuner(const std::string &cache_path = default_cache_path()) : path_(cache_path) { load(); }
+
+    static std::string default_cache_path()
+    {
+        const char *env = getenv("SPMM_TUNE_CACHE");
+        if (env != NULL && *env)
+            return env;
+        const char *home = getenv("HOME");
+        return std::string(home ? home : ".") + "/.cache/spmm_autotune.txt";
+    }
+
+    // Cached decision for the problem, timing all paths on a miss. B and C
+    // must be valid K x N and M x N row-major buffers; C is overwritten.
+    // dense_A may be NULL, in which case a dense copy is built for timing only.
+    spmm_path choose(MKL_INT M, MKL_INT N, MKL_INT K, float *values, MKL_INT *rowIndex, MKL_INT *columns,
+                     const float *dense_A, const float *B, float *C, bool *tuned = NULL)
+    {
+        std::string key = spmm_tune_key(M, N, K, rowIndex[M], rowIndex, mkl_get_max_threads());
+        std::map<std::string, SpmmDecision>::const_iterator it = decisions_.find(key);
+        if (tuned != NULL)
+            *tuned = (it == decisions_.end());
+        if (it != decisions_.end())
+            return it->second.path;
+        SpmmDecision d = tune(M, N, K, values, rowIndex, columns, dense_A, B, C);
+        decisions_[key] = d;
+        append(key, d);
+        return d.path;
+    }
+
+    size_t size() const { return decisions_.size(); }
+
+private:
+    std::string path_;
+    std::map<std::string, SpmmDecision> decisions_;
+
+    void load()
+    {
+        FILE *f = fopen(path_.c_str(), "r");
+        if (f == NULL)
+            return;
+        char key[512], name[64];
+        SpmmDecision d;
+        while (fscanf(f, "%511s %63s %lf %lf %lf", key, name, &d.ms[0], &d.ms[1], &d.ms[2]) == 5)
+        {
+            for (int p = 0; p < SPMM_PATH_COUNT; p++)
+                if (strcmp(name, spmm_path_name((spmm_path)p)) == 0)
+                {
+                    d.path = (spmm_path)p;
+                    decisions_[key] = d; // later lines win
+                }
+        }
+        fclose(f);
+    }
+
+    // One write() per line on an O_APPEND descriptor, so concurrent tuners
+    // never interleave partial lines.
+    void append(const std::string &key, const SpmmDecision &d)
+    {
+        std::string dir = path_.substr(0, path_.find_last_of('/'));
+        if (dir != path_)
+            mkdir(dir.c_str(), 0755);
+        int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+            return;
+        char line[768];
+        int len = snprintf(line, sizeof(line), "%s %s %.6g %.6g %.6g\n", key.c_str(), spmm_path_name(d.path), d.ms[0], d.ms[1], d.ms[2]);
+        if (write(fd, line, len) != len)
+            fprintf(stderr, "Could not update %s\n", path_.c_str());
+        close(fd);
+    }
+
+    SpmmDecision tune(MKL_INT M, MKL_INT N, MKL_INT K, float *values, MKL_INT *rowIndex, MKL_INT *columns,
+                      const float *dense_A, const float *B, float *C)
+    {
+        const int warmup = 2, iters = 7;
+        const float alpha = 1.0f, beta = 0.0f;
+        SpmmDecision d;
+        LatencyStats lat;
+        for (int p = 0; p < SPMM_PATH_COUNT; p++)
+            d.ms[p] = INFINITY;
+
+        float *A = (float *)dense_A;
+        if (A == NULL)
+        {
+            A = (float *)mkl_calloc((size_t)M * K, sizeof(float), 64);
+            if (A != NULL)
+                for (MKL_INT i = 0; i < M; i++)
+                    for (MKL_INT j = rowIndex[i]; j < rowIndex[i + 1]; j++)
+                        A[(size_t)i * K + columns[j]] = values[j];
+        }
+        if (A != NULL && time_kernel([&]() {
+                cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, M, N, K, alpha, A, K, B, N, beta, C, N);
+                return true;
+            }, warmup, iters, lat))
+            d.ms[SPMM_PATH_SGEMM] = lat.median;
+        if (A != dense_A)
+            mkl_free(A);
+
+        char transa = 'n';
+        char matdescra[6] = {'g', 'l', 'n', 'c', 0, 0};
+        if (time_kernel([&]() {
+                mkl_scsrmm(&transa, &M, &N, &K, &alpha, matdescra, values, columns, rowIndex, &(rowIndex[1]), B, &N, &beta, C, &N);
+                return true;
+            }, warmup, iters, lat))
+            d.ms[SPMM_PATH_SCSRMM] = lat.median;
+
+        sparse_matrix_t SA;
+        matrix_descr descr;
+        descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+        descr.mode = SPARSE_FILL_MODE_LOWER;
+        descr.diag = SPARSE_DIAG_NON_UNIT;
+        if (mkl_sparse_s_create_csr(&SA, SPARSE_INDEX_BASE_ZERO, M, K, rowIndex, &(rowIndex[1]), columns, values) == SPARSE_STATUS_SUCCESS)
+        {
+            mkl_sparse_set_mm_hint(SA, SPARSE_OPERATION_NON_TRANSPOSE, descr, SPARSE_LAYOUT_ROW_MAJOR, N, 1000);
+            mkl_sparse_optimize(SA);
+            if (time_kernel([&]() {
+                    return mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, alpha, SA, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                           B, N, N, beta, C, N) == SPARSE_STATUS_SUCCESS;
+                }, warmup, iters, lat))
+                d.ms[SPMM_PATH_SPARSE_MM] = lat.median;
+            mkl_sparse_destroy(SA);
+        }
+
+        d.path = SPMM_PATH_SPARSE_MM;
+        for (int p = 0; p < SPMM_PATH_COUNT; p++)
+            if (d.ms[p] < d.ms[d.path])
+                d.path = (spmm_path)p;
+        return d;
+    }
+};
@@ -0,0 +1,1193 @@
+// Unified SpMM/GEMM benchmark driver.
+//
+// Sweeps every combination of --m/--n/--k/--sparsity and runs each kernel of
+// --kernels on it, timing every call with a monotonic wall clock after a
+// warmup. Kernel "auto" dispatches through the autotuner (autotune.hpp),
+// tuning on first sight of a problem class and reusing the cached decision
+// afterwards. One record per (shape, sparsity, kernel) is written as CSV or JSON:
+// median/p5/p95 latency, effective GFLOP/s (2*nnz*N useful flops), dense
+// equivalent GFLOP/s (2*M*N*K) and GB/s from a simple traffic model.
+//
+//   bench --m 1024,4096 --n 256 --k 1024 --sparsity 0.5,0.8,0.9
+//         --kernels sgemm,scsrmm,sparse_mm,sparse_mm_hint,native
+//         --warmup 3 --iters 20 --format csv|json --out results.csv
+//
+// Scaling mode (--scaling) reruns every kernel for each count in --threads
+// (default: powers of two up to the machine) and adds speedup over the
+// smallest count, parallel efficiency and the thread count at which
+// throughput saturates (reaches 95% of its best). --affinity runs the sweep
+// once per placement policy (compact, scatter, socket, none), each in a
+// child process started with the matching OMP_PLACES/OMP_PROC_BIND, since
+// the OpenMP runtime only reads its binding at start-up.
+//
+// Batch mode (--batch count) builds count independent M x K matrices per
+// sweep point, each with its own B and C, and compares one batched call
+// (spmm_batch.hpp) against looping spmm_csr or mkl_sparse_s_mm over them;
+// max_rel_err is the worst item against its own mkl_sparse_s_mm reference.
+//
+// Kernels native_bf16/native_fp16/native_int8 store A's values in reduced
+// precision (csr_lowp.hpp), native_idx16/native_varint store its columns as
+// uint16_t or delta varints (csr_index.hpp); bytes_per_nnz reports the cost
+// of A's storage per nonzero. Every plain A * B kernel also reports
+// max_rel_err against an fp32 mkl_sparse_s_mm result.
+//
+// Kernels fused, unfused_native and unfused_sparse_mm add a per-row bias and
+// the --activation (default gelu) to C, either inside the native kernel's
+// stores or as a second pass after the SpMM. Their max_rel_err is against
+// the MKL reference with the epilogue applied as a separate pass.
+//
+// --pattern n:m (e.g. 2:4, 4:8) generates A with exactly n nonzeros in every
+// group of m consecutive columns instead of uniformly random zeros; the
+// sparsity list is then ignored (sparsity is 1 - n/m). Kernel native_nm runs
+// the structured N:M kernel (nm_sparse.hpp) on such an A, next to the CSR
+// and dense kernels on the same matrix; it needs n = 1, 2, 4 or 8.
+//
+// --pattern blockB (e.g. block8) keeps whole B x B tiles of A, each with
+// probability 1 - sparsity, the structure of block-pruned weights. Kernel
+// bsrB runs mkl_sparse_s_mm on a BSR copy of A with B x B blocks
+// (bsr_sparse.hpp); kernel bsr picks the block size (or plain CSR) with
+// choose_bsr_block during setup and reports it in its name.
+//
+// --numa naive,interleave,local re-places A, its CSR arrays, B and C
+// (numa.hpp) before every kernel: all on the main thread's node, pages
+// interleaved over the nodes, or first-touched by the threads that use them
+// under the row partition of native_static. The default, inherit, keeps the
+// buffers as allocated. Kernel native_static runs spmm_csr on that fixed
+// partition; native_socket splits A into one row slice per NUMA node with a
+// B replica each (NumaSocketSpmm) and needs pinned threads (--affinity).
+// native_views runs the same partition as zero-copy CsrView row panels
+// (csr_view.hpp), one spmm_csr call per panel.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_spblas.h"
+#include "mkl_types.h"
+#include "csr_convert.hpp"
+#include "bench_stats.hpp"
+#include "autotune.hpp"
+#include "spmm_kernel.hpp"
+#include "spmm_batch.hpp"
+#include "sparse_handle.hpp"
+#include "sparse_linear.hpp"
+#include "csr_lowp.hpp"
+#include "csr_index.hpp"
+#include "nm_sparse.hpp"
+#include "bsr_sparse.hpp"
+#include "csr_view.hpp"
+#include "numa.hpp"
+
+using namespace std;
+
+void random_init(float *ptr, size_t size, float sparsity)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        float pro = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
+        if (pro < sparsity)
+        {
+            ptr[i] = 0.0;
+        }
+        else
+        {
+            ptr[i] = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
+        }
+    }
+}
+
+// rows x cols with n nonzeros at random positions of every group of m
+// columns (fewer in a trailing partial group).
+void random_init_nm(float *ptr, size_t rows, size_t cols, int n, int m)
+{
+    vector<int> pos(m);
+    for (size_t i = 0; i < rows; i++)
+    {
+        for (size_t g = 0; g < cols; g += m)
+        {
+            int len = cols - g < (size_t)m ? (int)(cols - g) : m;
+            for (int j = 0; j < len; j++)
+            {
+                pos[j] = j;
+                ptr[i * cols + g + j] = 0.0;
+            }
+            // partial Fisher-Yates: the first n entries of pos are the kept columns
+            for (int j = 0; j < n && j < len; j++)
+            {
+                swap(pos[j], pos[j + rand() % (len - j)]);
+                // never exactly zero, so the group really holds n nonzeros
+                ptr[i * cols + g + pos[j]] = (static_cast<float>(rand()) + 1.0f) / (static_cast<float>(RAND_MAX) + 1.0f);
+            }
+        }
+    }
+}
+
+// rows x cols made of block x block tiles that are either all zero (with
+// probability sparsity) or fully dense; partial tiles at the right and
+// bottom edges are allowed.
+void random_init_blocks(float *ptr, size_t rows, size_t cols, size_t block, float sparsity)
+{
+    for (size_t bi = 0; bi < rows; bi += block)
+    {
+        for (size_t bj = 0; bj < cols; bj += block)
+        {
+            bool kept = static_cast<float>(rand()) / static_cast<float>(RAND_MAX) >= sparsity;
+            for (size_t i = bi; i < bi + block && i < rows; i++)
+                for (size_t j = bj; j < bj + block && j < cols; j++)
+                    ptr[i * cols + j] = kept ? (static_cast<float>(rand()) + 1.0f) / (static_cast<float>(RAND_MAX) + 1.0f) : 0.0f;
+        }
+    }
+}
+
+// Operands of one sweep point, shared by all kernels. A is kept both dense
+// (for sgemm) and as zero-based CSR. In batch mode items holds the
+// independent M x K products instead and nnz is their total.
+struct Problem
+{
+    MKL_INT M, N, K;
+    float sparsity;
+    float *A, *B, *C;
+    float *values;
+    MKL_INT *rowIndex, *columns;
+    MKL_INT nnz;
+    float *ref; // fp32 mkl_sparse_s_mm result for B
+    vector<SpmmBatchItem> items;
+    vector<float *> item_ref; // the same reference per item in batch mode
+    SpmmEpilogue epi; // row bias + activation for the fused/unfused kernels
+    int nm_n, nm_m;   // A's N:M pattern, 0 when unstructured
+    int block;        // A's tile size for --pattern blockB, 0 otherwise
+    string numa;      // placement of the operands (--numa)
+};
+
+// A prepared kernel: run() is what gets timed, cleanup() releases whatever
+// the setup created, bytes is the modelled memory traffic of one call and
+// sparse_bytes the part of it spent on A. label, when set, replaces the
+// kernel name in the output. check marks kernels whose C should match the
+// fp32 reference.
+struct KernelRun
+{
+    function<bool()> run;
+    function<void()> cleanup;
+    double bytes, sparse_bytes;
+    string label;
+    bool check;
+    float *ref; // what check compares C against, p.ref when NULL
+};
+
+double csr_bytes(const Problem &p)
+{
+    return (double)p.nnz * (sizeof(float) + sizeof(MKL_INT)) + (double)(p.M + 1) * sizeof(MKL_INT);
+}
+
+double dense_operand_bytes(const Problem &p)
+{
+    return ((double)p.K * p.N + (double)p.M * p.N) * sizeof(float);
+}
+
+double batch_bytes(const Problem &p)
+{
+    return (double)p.nnz * (sizeof(float) + sizeof(MKL_INT)) + p.items.size() * ((double)(p.M + 1) * sizeof(MKL_INT) + dense_operand_bytes(p));
+}
+
+// Kernels of --batch mode: the whole batch in one call against one call per matrix.
+bool make_batch_kernel(const string &name, Problem &p, KernelRun &k)
+{
+    k.cleanup = []() {};
+    k.bytes = batch_bytes(p);
+    k.sparse_bytes = k.bytes - p.items.size() * dense_operand_bytes(p);
+    k.check = true;
+    k.ref = NULL;
+    if (name == "batch")
+    {
+        // planned once, like a model would per layer
+        SpmmBatchPlan plan;
+        spmm_batch_plan(p.items.data(), p.items.size(), omp_get_max_threads(), plan);
+        k.run = [&p, plan]() {
+            spmm_batch_run(p.items.data(), plan);
+            return true;
+        };
+        return true;
+    }
+    if (name == "loop_native")
+    {
+        k.run = [&p]() {
+            for (size_t b = 0; b < p.items.size(); b++)
+            {
+                const SpmmBatchItem &it = p.items[b];
+                spmm_csr(it.M, it.N, it.alpha, it.values, it.columns, it.pointerB, it.pointerE, it.B, it.ldb, it.beta, it.C, it.ldc, it.epilogue);
+            }
+            return true;
+        };
+        return true;
+    }
+    if (name == "loop_sparse_mm")
+    {
+        SparseHandleCache *handles = new SparseHandleCache();
+        vector<SparseHandle *> h(p.items.size());
+        for (size_t b = 0; b < p.items.size(); b++)
+        {
+            SpmmBatchItem &it = p.items[b];
+            MKL_INT *rowIndex = (MKL_INT *)it.pointerB;
+            h[b] = handles->acquire(csr_pattern_hash(it.M, p.K, rowIndex, it.columns), it.M, p.K, rowIndex, (MKL_INT *)it.columns,
+                                    (float *)it.values, SPARSE_OPERATION_NON_TRANSPOSE, SPARSE_LAYOUT_ROW_MAJOR, it.N);
+            if (h[b] == NULL)
+            {
+                delete handles;
+                return false;
+            }
+        }
+        k.run = [&p, h]() {
+            for (size_t b = 0; b < p.items.size(); b++)
+            {
+                const SpmmBatchItem &it = p.items[b];
+                if (mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, it.alpha, h[b]->handle, h[b]->descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                    it.B, it.ldb, it.N, it.beta, it.C, it.ldc) != SPARSE_STATUS_SUCCESS)
+                    return false;
+            }
+            return true;
+        };
+        k.cleanup = [handles]() { delete handles; };
+        return true;
+    }
+    return false;
+}
+
+// k.ref = the MKL reference with p.epi applied by the separate pass, freed in cleanup.
+bool epilogue_reference(const Problem &p, KernelRun &k)
+{
+    float *ref = (float *)mkl_malloc(sizeof(float) * p.M * p.N, 64);
+    if (ref == NULL)
+        return false;
+    memcpy(ref, p.ref, sizeof(float) * p.M * p.N);
+    spmm_apply_epilogue(p.M, p.N, ref, p.N, p.epi);
+    function<void()> cleanup = k.cleanup;
+    k.ref = ref;
+    k.cleanup = [cleanup, ref]() {
+        cleanup();
+        mkl_free(ref);
+    };
+    return true;
+}
+
+bool make_kernel(const string &name, Problem &p, KernelRun &k)
+{
+    if (!p.items.empty())
+        return make_batch_kernel(name, p, k);
+    const float alpha = 1.0f, beta = 0.0f;
+    k.cleanup = []() {};
+    k.sparse_bytes = csr_bytes(p);
+    k.bytes = k.sparse_bytes + dense_operand_bytes(p);
+    k.check = true;
+    k.ref = NULL;
+    if (name == "sgemm")
+    {
+        k.sparse_bytes = (double)p.M * p.K * sizeof(float);
+        k.bytes = k.sparse_bytes + dense_operand_bytes(p);
+        k.run = [&p, alpha, beta]() {
+            cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, p.M, p.N, p.K, alpha, p.A, p.K, p.B, p.N, beta, p.C, p.N);
+            return true;
+        };
+        return true;
+    }
+    if (name == "scsrmm")
+    {
+        k.run = [&p, alpha, beta]() {
+            char transa = 'n';
+            char matdescra[6] = {'g', 'l', 'n', 'c', 0, 0};
+            mkl_scsrmm(&transa, &p.M, &p.N, &p.K, &alpha, matdescra, p.values, p.columns, p.rowIndex, &(p.rowIndex[1]),
+                       p.B, &p.N, &beta, p.C, &p.N);
+            return true;
+        };
+        return true;
+    }
+    if (name == "native")
+    {
+        k.run = [&p, alpha, beta]() {
+            spmm_csr(p.M, p.N, alpha, p.values, p.columns, p.rowIndex, &(p.rowIndex[1]), p.B, p.N, beta, p.C, p.N);
+            return true;
+        };
+        k.label = string("native:") + select_spmm_kernels().isa;
+        return true;
+    }
+    // fixed rows + nnz balanced partition, the one --numa local first-touches with
+    if (name == "native_static")
+    {
+        int parts = omp_get_max_threads();
+        vector<MKL_INT> bounds;
+        numa_row_partition(p.rowIndex, p.M, parts, bounds);
+        k.run = [&p, bounds, parts, alpha, beta]() {
+            spmm_csr_static(bounds.data(), parts, p.N, alpha, p.values, p.columns, p.rowIndex, &(p.rowIndex[1]), p.B, p.N, beta, p.C, p.N);
+            return true;
+        };
+        return true;
+    }
+    // the native_static partition as views, each panel its own spmm_csr call
+    if (name == "native_views")
+    {
+        int parts = omp_get_max_threads();
+        vector<MKL_INT> bounds;
+        numa_row_partition(p.rowIndex, p.M, parts, bounds);
+        vector<CsrView<float>> *views = new vector<CsrView<float>>(parts);
+        bool ok = true;
+        for (int t = 0; t < parts; t++)
+            ok = ok && csr_view(p.values, p.columns, p.rowIndex, p.M, p.K, bounds[t], bounds[t + 1], 0, p.K, views->at(t));
+        k.cleanup = [views]() {
+            for (size_t t = 0; t < views->size(); t++)
+                views->at(t).release();
+            delete views;
+        };
+        if (!ok)
+        {
+            k.cleanup();
+            return false;
+        }
+        k.run = [&p, views, alpha, beta]() {
+            for (size_t t = 0; t < views->size(); t++)
+            {
+                const CsrView<float> &v = views->at(t);
+                spmm_csr(v, p.N, alpha, p.B, p.N, beta, p.C + (size_t)v.row_begin * p.N, p.N);
+            }
+            return true;
+        };
+        return true;
+    }
+    // per-node CSR slices and B replicas, built here, untimed
+    if (name == "native_socket")
+    {
+        NumaSocketSpmm *s;
+        try
+        {
+            s = new NumaSocketSpmm(p.values, p.rowIndex, p.columns, p.M, p.K, p.N, omp_get_max_threads());
+        }
+        catch (const char *msg)
+        {
+            fprintf(stderr, "%s\n", msg);
+            return false;
+        }
+        k.run = [&p, s, alpha, beta]() {
+            s->multiply(alpha, p.B, p.N, beta, p.C, p.N);
+            return true;
+        };
+        k.label = "native_socket:" + to_string(s->nodes());
+        k.cleanup = [s]() { delete s; };
+        return true;
+    }
+    // bias + activation in the SpMM stores, against SpMM followed by a separate pass
+    if (name == "fused")
+    {
+        if (!epilogue_reference(p, k))
+            return false;
+        k.run = [&p, alpha, beta]() {
+            spmm_csr(p.M, p.N, alpha, p.values, p.columns, p.rowIndex, &(p.rowIndex[1]), p.B, p.N, beta, p.C, p.N, &p.epi);
+            return true;
+        };
+        return true;
+    }
+    if (name == "unfused_native")
+    {
+        if (!epilogue_reference(p, k))
+            return false;
+        k.bytes += 2.0 * p.M * p.N * sizeof(float);
+        k.run = [&p, alpha, beta]() {
+            spmm_csr(p.M, p.N, alpha, p.values, p.columns, p.rowIndex, &(p.rowIndex[1]), p.B, p.N, beta, p.C, p.N);
+            spmm_apply_epilogue(p.M, p.N, p.C, p.N, p.epi);
+            return true;
+        };
+        return true;
+    }
+    if (name == "unfused_sparse_mm")
+    {
+        KernelRun mm;
+        if (!make_kernel("sparse_mm_hint", p, mm))
+            return false;
+        k.bytes += 2.0 * p.M * p.N * sizeof(float);
+        k.cleanup = mm.cleanup;
+        if (!epilogue_reference(p, k))
+        {
+            k.cleanup();
+            return false;
+        }
+        k.run = [&p, mm]() {
+            if (!mm.run())
+                return false;
+            spmm_apply_epilogue(p.M, p.N, p.C, p.N, p.epi);
+            return true;
+        };
+        return true;
+    }
+    // reduced-precision values, fp32 accumulation
+    if (name == "native_bf16" || name == "native_fp16" || name == "native_int8")
+    {
+        csr_value_type type = name == "native_bf16" ? CSR_VALUE_BF16 : name == "native_fp16" ? CSR_VALUE_FP16 : CSR_VALUE_INT8;
+        CsrLowp a;
+        if (!make_csr_lowp(p.values, p.rowIndex, p.M, type, a))
+            return false;
+        k.sparse_bytes = csr_lowp_bytes(a);
+        k.bytes = k.sparse_bytes + dense_operand_bytes(p);
+        k.run = [&p, a, alpha, beta]() {
+            spmm_csr_lowp(p.M, p.N, alpha, a, p.columns, p.rowIndex, &(p.rowIndex[1]), p.B, p.N, beta, p.C, p.N);
+            return true;
+        };
+        k.cleanup = [a]() mutable { a.release(); };
+        return true;
+    }
+    // compact column indices, fp32 values
+    if (name == "native_idx16" || name == "native_varint")
+    {
+        CsrCompactIndex idx;
+        if (!make_csr_index(p.rowIndex, p.columns, p.M, p.K, name == "native_idx16" ? CSR_INDEX_U16 : CSR_INDEX_VARINT, idx))
+            return false;
+        k.sparse_bytes = csr_index_bytes(idx) + (double)p.nnz * sizeof(float);
+        k.bytes = k.sparse_bytes + dense_operand_bytes(p);
+        k.run = [&p, idx, alpha, beta]() {
+            spmm_csr_index(p.M, p.N, alpha, p.values, idx, p.rowIndex, p.B, p.N, beta, p.C, p.N);
+            return true;
+        };
+        k.cleanup = [idx]() mutable { idx.release(); };
+        return true;
+    }
+    // structured N:M storage, only for an A generated with --pattern n:m
+    if (name == "native_nm")
+    {
+        NmMatrix a;
+        if (p.nm_m == 0 || !dense_to_nm(p.A, p.M, p.K, p.nm_n, p.nm_m, a))
+            return false;
+        k.sparse_bytes = nm_bytes(a);
+        k.bytes = k.sparse_bytes + dense_operand_bytes(p);
+        k.run = [&p, a, alpha, beta]() {
+            return spmm_nm(a, p.N, alpha, p.B, p.N, beta, p.C, p.N);
+        };
+        k.label = "native_nm:" + to_string(p.nm_n) + ":" + to_string(p.nm_m);
+        k.cleanup = [a]() mutable { a.release(); };
+        return true;
+    }
+    // MKL BSR handle; with "bsr" the block size is chosen here, untimed
+    if (name.compare(0, 3, "bsr") == 0)
+    {
+        MKL_INT block = atol(name.c_str() + 3);
+        if (name == "bsr")
+            block = choose_bsr_block(p.values, p.rowIndex, p.columns, p.M, p.K, p.B, p.C, p.N);
+        if (block == 1)
+        {
+            if (!make_kernel("sparse_mm_hint", p, k))
+                return false;
+            k.label = "bsr:csr";
+            return true;
+        }
+        BsrMatrix *a = new BsrMatrix;
+        sparse_matrix_t SA;
+        matrix_descr descr;
+        if (!csr_to_bsr(p.values, p.rowIndex, p.columns, p.M, p.K, block, *a))
+        {
+            delete a;
+            return false;
+        }
+        if (!bsr_create_handle(*a, p.N, 1000, SA, descr))
+        {
+            a->release();
+            delete a;
+            return false;
+        }
+        k.sparse_bytes = bsr_bytes(*a);
+        k.bytes = k.sparse_bytes + dense_operand_bytes(p);
+        k.run = [&p, SA, descr, alpha, beta]() {
+            return mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, alpha, SA, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                   p.B, p.N, p.N, beta, p.C, p.N) == SPARSE_STATUS_SUCCESS;
+        };
+        k.cleanup = [SA, a]() {
+            mkl_sparse_destroy(SA);
+            a->release();
+            delete a;
+        };
+        k.label = "bsr:" + to_string(block);
+        return true;
+    }
+    // prepacked layer object; packing and analysis happen here, untimed.
+    // layer_st is the threads == 1 path a serving thread calls inline, whose
+    // per-call p95 is the tail latency that matters there.
+    if (name == "layer" || name == "layer_st" || name == "layer_mkl")
+    {
+        SparseLinear *layer;
+        try
+        {
+            layer = new SparseLinear(p.values, p.rowIndex, p.columns, p.M, p.K, p.N,
+                                     name == "layer_mkl" ? SparseLinear::MKL : SparseLinear::NATIVE, NULL, SPMM_ACT_NONE,
+                                     name == "layer_st" ? 1 : 0);
+        }
+        catch (const char *msg)
+        {
+            fprintf(stderr, "%s\n", msg);
+            return false;
+        }
+        k.run = [&p, layer]() {
+            return layer->forward(p.B, p.C);
+        };
+        k.cleanup = [layer]() { delete layer; };
+        return true;
+    }
+    if (name == "auto")
+    {
+        // tuning (on a cache miss) happens here, outside the timed region
+        static SpmmAutotuner tuner;
+        bool tuned = false;
+        spmm_path path = tuner.choose(p.M, p.N, p.K, p.values, p.rowIndex, p.columns, p.A, p.B, p.C, &tuned);
+        string chosen = path == SPMM_PATH_SPARSE_MM ? "sparse_mm_hint" : spmm_path_name(path);
+        if (!make_kernel(chosen, p, k))
+            return false;
+        k.label = string("auto:") + spmm_path_name(path) + (tuned ? ":tuned" : ":cached");
+        return true;
+    }
+    if (name == "sparse_mm" || name == "sparse_mm_hint")
+    {
+        sparse_matrix_t SA;
+        if (mkl_sparse_s_create_csr(&SA, SPARSE_INDEX_BASE_ZERO, p.M, p.K, p.rowIndex, &(p.rowIndex[1]), p.columns, p.values) != SPARSE_STATUS_SUCCESS)
+            return false;
+        matrix_descr descr;
+        descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+        descr.mode = SPARSE_FILL_MODE_LOWER;
+        descr.diag = SPARSE_DIAG_NON_UNIT;
+        if (name == "sparse_mm_hint")
+        {
+            // a hint only takes effect once mkl_sparse_optimize runs the analysis
+            if (mkl_sparse_set_mm_hint(SA, SPARSE_OPERATION_NON_TRANSPOSE, descr, SPARSE_LAYOUT_ROW_MAJOR, p.N, 1000) != SPARSE_STATUS_SUCCESS ||
+                mkl_sparse_optimize(SA) != SPARSE_STATUS_SUCCESS)
+            {
+                mkl_sparse_destroy(SA);
+                return false;
+            }
+        }
+        k.run = [&p, SA, descr, alpha, beta]() {
+            return mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, alpha, SA, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                   p.B, p.N, p.N, beta, p.C, p.N) == SPARSE_STATUS_SUCCESS;
+        };
+        k.cleanup = [SA]() { mkl_sparse_destroy(SA); };
+        return true;
+    }
+    return false;
+}
+
+// Operand buffers of one --numa placement and the originals they replace.
+struct NumaPlacement
+{
+    float *A, *values, *B, *C;
+    MKL_INT *rowIndex, *columns;
+    vector<pair<void *, size_t>> maps;
+
+    template <typename T>
+    T *alloc(size_t count)
+    {
+        T *ptr = (T *)numa_alloc(sizeof(T) * count);
+        if (ptr != NULL)
+            maps.push_back(make_pair((void *)ptr, sizeof(T) * count));
+        return ptr;
+    }
+};
+
+// Copies p's operands into buffers placed by mode and points p at them.
+bool numa_place(Problem &p, const string &mode, int threads, NumaPlacement &pl)
+{
+    p.numa = mode;
+    pl.maps.clear();
+    if (mode == "inherit")
+        return true;
+    if (!p.items.empty() || (mode != "naive" && mode != "interleave" && mode != "local"))
+        return false;
+    const size_t nnz = p.nnz;
+    float *A = pl.alloc<float>((size_t)p.M * p.K), *values = pl.alloc<float>(nnz);
+    float *B = pl.alloc<float>((size_t)p.K * p.N), *C = pl.alloc<float>((size_t)p.M * p.N);
+    MKL_INT *rowIndex = pl.alloc<MKL_INT>(p.M + 1), *columns = pl.alloc<MKL_INT>(nnz);
+    if (pl.maps.size() != 6)
+        return false;
+    pl.A = p.A;
+    pl.values = p.values;
+    pl.B = p.B;
+    pl.C = p.C;
+    pl.rowIndex = p.rowIndex;
+    pl.columns = p.columns;
+    if (mode == "local")
+    {
+        vector<MKL_INT> rows, nz(threads + 1), krows(threads + 1);
+        numa_row_partition(p.rowIndex, p.M, threads, rows);
+        for (int t = 0; t <= threads; t++)
+        {
+            nz[t] = p.rowIndex[rows[t]];
+            krows[t] = (MKL_INT)((int64_t)p.K * t / threads);
+        }
+        numa_copy_rows(A, p.A, rows.data(), threads, p.K);
+        numa_copy_rows(C, p.C, rows.data(), threads, p.N);
+        numa_copy_rows(rowIndex, p.rowIndex, rows.data(), threads, 1);
+        rowIndex[p.M] = p.rowIndex[p.M];
+        numa_copy_rows(values, p.values, nz.data(), threads, 1);
+        numa_copy_rows(columns, p.columns, nz.data(), threads, 1);
+        // every thread reads all of B; spread its rows evenly
+        numa_copy_rows(B, p.B, krows.data(), threads, p.N);
+    }
+    else
+    {
+        int node = numa_current_node(), nodes = numa_nodes();
+        for (size_t i = 0; i < pl.maps.size(); i++)
+        {
+            if (mode == "naive")
+                numa_bind(pl.maps[i].first, pl.maps[i].second, node);
+            else
+                numa_interleave(pl.maps[i].first, pl.maps[i].second, nodes);
+        }
+        memcpy(A, p.A, sizeof(float) * p.M * p.K);
+        memcpy(values, p.values, sizeof(float) * nnz);
+        memcpy(B, p.B, sizeof(float) * p.K * p.N);
+        memcpy(C, p.C, sizeof(float) * p.M * p.N);
+        memcpy(rowIndex, p.rowIndex, sizeof(MKL_INT) * (p.M + 1));
+        memcpy(columns, p.columns, sizeof(MKL_INT) * nnz);
+    }
+    p.A = A;
+    p.values = values;
+    p.B = B;
+    p.C = C;
+    p.rowIndex = rowIndex;
+    p.columns = columns;
+    return true;
+}
+
+// Points p back at its original operands and frees the placed copies.
+void numa_restore(Problem &p, NumaPlacement &pl)
+{
+    if (pl.maps.size() == 6)
+    {
+        p.A = pl.A;
+        p.values = pl.values;
+        p.B = pl.B;
+        p.C = pl.C;
+        p.rowIndex = pl.rowIndex;
+        p.columns = pl.columns;
+    }
+    for (size_t i = 0; i < pl.maps.size(); i++)
+        numa_free(pl.maps[i].first, pl.maps[i].second);
+    pl.maps.clear();
+}
+
+struct Options
+{
+    vector<string> m, n, k, sparsity, kernels, threads, affinity, numa;
+    int warmup, iters, batch;
+    bool json, scaling;
+    string out, activation, pattern;
+    int nm_n, nm_m, block;
+};
+
+bool parse_options(int argc, char **argv, Options &o)
+{
+    o.m = o.n = o.k = split_list("1024");
+    o.sparsity = split_list("0.5,0.8,0.9");
+    o.kernels = split_list("sgemm,scsrmm,sparse_mm,sparse_mm_hint,native");
+    o.warmup = 3;
+    o.iters = 20;
+    o.batch = 0;
+    o.activation = "gelu";
+    o.pattern = "random";
+    o.numa = split_list("inherit");
+    o.nm_n = o.nm_m = o.block = 0;
+    o.json = false;
+    o.scaling = false;
+    bool kernels_given = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--scaling")
+        {
+            o.scaling = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+        string val = argv[++i];
+        if (arg == "--threads")
+            o.threads = split_list(val);
+        else if (arg == "--affinity")
+            o.affinity = split_list(val);
+        else if (arg == "--m")
+            o.m = split_list(val);
+        else if (arg == "--n")
+            o.n = split_list(val);
+        else if (arg == "--k")
+            o.k = split_list(val);
+        else if (arg == "--sparsity")
+            o.sparsity = split_list(val);
+        else if (arg == "--kernels")
+        {
+            o.kernels = split_list(val);
+            kernels_given = true;
+        }
+        else if (arg == "--batch")
+            o.batch = atoi(val.c_str());
+        else if (arg == "--activation")
+            o.activation = val;
+        else if (arg == "--pattern")
+            o.pattern = val;
+        else if (arg == "--numa")
+            o.numa = split_list(val);
+        else if (arg == "--warmup")
+            o.warmup = atoi(val.c_str());
+        else if (arg == "--iters")
+            o.iters = atoi(val.c_str());
+        else if (arg == "--format")
+            o.json = (val == "json");
+        else if (arg == "--out")
+            o.out = val;
+        else
+            return false;
+    }
+    if (o.pattern.compare(0, 5, "block") == 0)
+    {
+        o.block = atoi(o.pattern.c_str() + 5);
+        if (o.block < 1)
+            return false;
+    }
+    else if (o.pattern != "random")
+    {
+        if (sscanf(o.pattern.c_str(), "%d:%d", &o.nm_n, &o.nm_m) != 2 || o.nm_n < 1 || o.nm_n > o.nm_m || o.nm_m > 32)
+            return false;
+        o.sparsity = split_list(to_string(1.0 - (double)o.nm_n / o.nm_m));
+        if (!spmm_nm_supported(o.nm_n) && find(o.kernels.begin(), o.kernels.end(), "native_nm") != o.kernels.end())
+        {
+            fprintf(stderr, "native_nm supports n = 1, 2, 4 or 8, not %d\n", o.nm_n);
+            return false;
+        }
+    }
+    if (o.batch > 0 && !kernels_given)
+        o.kernels = split_list("batch,loop_native,loop_sparse_mm");
+    if (o.threads.empty())
+    {
+        int max_threads = mkl_get_max_threads();
+        for (int t = 1; o.scaling && t < max_threads; t *= 2)
+            o.threads.push_back(to_string(t));
+        o.threads.push_back(to_string(max_threads));
+    }
+    return o.iters > 0 && o.warmup >= 0 && (o.activation == "none" || o.activation == "relu" || o.activation == "gelu");
+}
+
+// Environment for one placement policy; false for an unknown policy.
+bool affinity_env(const string &policy, vector<string> &env)
+{
+    env.clear();
+    env.push_back("MKL_DYNAMIC=FALSE");
+    if (policy == "compact")
+    {
+        env.push_back("OMP_PROC_BIND=close");
+        env.push_back("OMP_PLACES=cores");
+    }
+    else if (policy == "scatter")
+    {
+        env.push_back("OMP_PROC_BIND=spread");
+        env.push_back("OMP_PLACES=cores");
+    }
+    else if (policy == "socket")
+    {
+        // one place spanning the first socket: every thread stays on it
+        env.push_back("OMP_PROC_BIND=close");
+        env.push_back("OMP_PLACES=sockets(1)");
+    }
+    else if (policy != "none")
+        return false;
+    env.push_back("BENCH_AFFINITY_CHILD=" + policy);
+    return true;
+}
+
+// Reads back the CSV written by a child run.
+bool read_csv_records(const char *path, vector<BenchRecord> &records)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+    vector<string> header;
+    char line[4096];
+    while (fgets(line, sizeof(line), f))
+    {
+        string l(line);
+        while (!l.empty() && (l.back() == '\n' || l.back() == '\r'))
+            l.pop_back();
+        vector<string> cells = split_list(l);
+        if (header.empty())
+        {
+            header = cells;
+            continue;
+        }
+        BenchRecord r;
+        for (size_t i = 0; i < cells.size() && i < header.size(); i++)
+            r.add(header[i], cells[i], false);
+        records.push_back(r);
+    }
+    fclose(f);
+    return true;
+}
+
+// Runs the sweep once per policy in a child process and forwards its records.
+int run_affinity_children(int argc, char **argv, const Options &opt, BenchWriter &writer)
+{
+    for (size_t ip = 0; ip < opt.affinity.size(); ip++)
+    {
+        const string &policy = opt.affinity[ip];
+        vector<string> extra;
+        if (!affinity_env(policy, extra))
+        {
+            fprintf(stderr, "Unknown affinity policy %s\n", policy.c_str());
+            return -1;
+        }
+        char tmp[] = "/tmp/bench_affinity_XXXXXX";
+        int fd = mkstemp(tmp);
+        if (fd < 0)
+            return -1;
+        close(fd);
+
+        vector<string> args;
+        for (int i = 0; i < argc; i++)
+        {
+            string a = argv[i];
+            if (a == "--affinity" || a == "--out" || a == "--format")
+            {
+                i++;
+                continue;
+            }
+            args.push_back(a);
+        }
+        args.insert(args.end(), {"--affinity", policy, "--out", tmp, "--format", "csv"});
+        vector<string> env;
+        for (char **e = environ; *e; e++)
+        {
+            string kv = *e;
+            bool overridden = false;
+            for (size_t i = 0; i < extra.size(); i++)
+                overridden |= kv.compare(0, extra[i].find('=') + 1, extra[i], 0, extra[i].find('=') + 1) == 0;
+            if (!overridden)
+                env.push_back(kv);
+        }
+        env.insert(env.end(), extra.begin(), extra.end());
+        vector<char *> cargs, cenv;
+        for (size_t i = 0; i < args.size(); i++)
+            cargs.push_back(&args[i][0]);
+        for (size_t i = 0; i < env.size(); i++)
+            cenv.push_back(&env[i][0]);
+        cargs.push_back(NULL);
+        cenv.push_back(NULL);
+
+        pid_t pid;
+        int status = 0;
+        if (posix_spawn(&pid, "/proc/self/exe", NULL, NULL, cargs.data(), cenv.data()) != 0 ||
+            waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "Benchmark run with affinity %s failed\n", policy.c_str());
+            unlink(tmp);
+            return -1;
+        }
+        vector<BenchRecord> records;
+        read_csv_records(tmp, records);
+        unlink(tmp);
+        for (size_t i = 0; i < records.size(); i++)
+            writer.write(records[i]);
+    }
+    return 0;
+}
+
+// ref = A * B for an M x K zero-based CSR A through a plain fp32 mkl_sparse_s_mm.
+bool reference_csr_mm(MKL_INT M, MKL_INT K, MKL_INT N, const float *values, const MKL_INT *rowIndex, const MKL_INT *columns,
+                      const float *B, float *ref)
+{
+    sparse_matrix_t SA;
+    if (mkl_sparse_s_create_csr(&SA, SPARSE_INDEX_BASE_ZERO, M, K, (MKL_INT *)rowIndex, (MKL_INT *)&(rowIndex[1]), (MKL_INT *)columns,
+                                (float *)values) != SPARSE_STATUS_SUCCESS)
+        return false;
+    matrix_descr descr;
+    descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+    descr.mode = SPARSE_FILL_MODE_LOWER;
+    descr.diag = SPARSE_DIAG_NON_UNIT;
+    sparse_status_t status = mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0f, SA, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                             B, N, N, 0.0f, ref, N);
+    mkl_sparse_destroy(SA);
+    return status == SPARSE_STATUS_SUCCESS;
+}
+
+// p.ref = A * B.
+bool reference_mm(Problem &p)
+{
+    return reference_csr_mm(p.M, p.K, p.N, p.values, p.rowIndex, p.columns, p.B, p.ref);
+}
+
+// max |C - ref| / max |ref| over count entries.
+double rel_err(const float *C, const float *ref, size_t count)
+{
+    double err = 0, scale = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        err = max(err, (double)fabsf(C[i] - ref[i]));
+        scale = max(scale, (double)fabsf(ref[i]));
+    }
+    return scale > 0 ? err / scale : err;
+}
+
+// rel_err of the M x N result against ref (default p.ref); in batch mode
+// the largest rel_err of any item against its own reference.
+double max_rel_err(const Problem &p, const float *ref = NULL)
+{
+    if (!p.items.empty())
+    {
+        double err = 0;
+        for (size_t b = 0; b < p.items.size(); b++)
+            err = max(err, rel_err(p.items[b].C, p.item_ref[b], (size_t)p.M * p.N));
+        return err;
+    }
+    return rel_err(p.C, ref != NULL ? ref : p.ref, (size_t)p.M * p.N);
+}
+
+BenchRecord make_record(const string &name, const Problem &p, int threads, const LatencyStats &lat, const KernelRun &k, double err)
+{
+    double bytes = k.bytes;
+    double sec = lat.median * 1e-3;
+    BenchRecord r;
+    r.add("kernel", name);
+    r.add("M", (long long)p.M);
+    r.add("N", (long long)p.N);
+    r.add("K", (long long)p.K);
+    r.add("sparsity", (double)p.sparsity);
+    r.add("pattern", p.nm_m ? to_string(p.nm_n) + ":" + to_string(p.nm_m) : p.block ? "block" + to_string(p.block) : string("random"));
+    r.add("batch", (long long)(p.items.empty() ? 1 : p.items.size()));
+    r.add("nnz", (long long)p.nnz);
+    r.add("threads", (long long)threads);
+    r.add("numa", p.numa);
+    r.add_latency(lat);
+    r.add("gflops_eff", 2.0 * p.nnz * p.N / sec * 1e-9);
+    r.add("gflops_dense", 2.0 * p.M * p.N * p.K * (p.items.empty() ? 1 : p.items.size()) / sec * 1e-9);
+    r.add("gbs", bytes / sec * 1e-9);
+    r.add("bytes_per_nnz", k.sparse_bytes / (p.nnz ? p.nnz : 1));
+    if (err >= 0)
+        r.add("max_rel_err", err);
+    else
+        r.add("max_rel_err", "n/a");
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!parse_options(argc, argv, opt))
+    {
+        fprintf(stderr, "Usage: %s [--m list] [--n list] [--k list] [--sparsity list] [--kernels list]\n"
+                        "          [--warmup n] [--iters n] [--format csv|json] [--out file]\n"
+                        "          [--scaling] [--threads list] [--affinity compact,scatter,socket,none]\n"
+                        "          [--batch count] [--activation none|relu|gelu] \n"
+                        "          [--pattern random|n:m|blockB] [--numa inherit,naive,interleave,local]\n"
+                        "kernels: sgemm, scsrmm, sparse_mm, sparse_mm_hint, native, auto,\n"
+                        "         fused, unfused_native, unfused_sparse_mm, layer, layer_st, layer_mkl,\n"
+                        "         native_bf16, native_fp16, native_int8, native_idx16, native_varint,\n"
+                        "         native_nm (with --pattern n:m), bsr, bsr2, bsr4, bsr8, bsr16,\n"
+                        "         native_static, native_views, native_socket\n"
+                        "batch kernels: batch, loop_native, loop_sparse_mm\n",
+                argv[0]);
+        return -1;
+    }
+    const char *child = getenv("BENCH_AFFINITY_CHILD");
+    bool is_child = child != NULL && opt.affinity.size() == 1 && opt.affinity[0] == child;
+    FILE *out = opt.out.empty() ? stdout : fopen(opt.out.c_str(), "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Cannot open %s\n", opt.out.c_str());
+        return -1;
+    }
+    BenchWriter writer(out, opt.json);
+    if (!opt.affinity.empty() && !is_child)
+    {
+        int rc = run_affinity_children(argc, argv, opt, writer);
+        writer.finish();
+        if (out != stdout)
+            fclose(out);
+        return rc;
+    }
+    bool scaling = opt.scaling || is_child;
+    string policy = is_child ? opt.affinity[0] : "inherit";
+
+    for (size_t im = 0; im < opt.m.size(); im++)
+    for (size_t ik = 0; ik < opt.k.size(); ik++)
+    for (size_t is = 0; is < opt.sparsity.size(); is++)
+    {
+        Problem p;
+        p.M = atol(opt.m[im].c_str());
+        p.K = atol(opt.k[ik].c_str());
+        p.sparsity = atof(opt.sparsity[is].c_str());
+        p.nm_n = opt.nm_n;
+        p.nm_m = opt.nm_m;
+        p.block = opt.block;
+        p.A = (float *)mkl_malloc(sizeof(float) * p.M * p.K, 64);
+        if (p.A == NULL)
+        {
+            fprintf(stderr, "Host memory allocation failed!\n");
+            return -1;
+        }
+        if (p.nm_m)
+            random_init_nm(p.A, p.M, p.K, p.nm_n, p.nm_m);
+        else if (p.block)
+            random_init_blocks(p.A, p.M, p.K, p.block, p.sparsity);
+        else
+            random_init(p.A, (size_t)p.M * p.K, p.sparsity);
+        pair<vector<void *>, vector<unsigned long>> csr = convert_csr(p.A, p.M, p.K);
+        p.values = (float *)csr.first[0];
+        p.rowIndex = (MKL_INT *)csr.first[1];
+        p.columns = (MKL_INT *)csr.first[2];
+        p.nnz = csr.second[0];
+        vector<float> bias(p.M);
+        for (MKL_INT i = 0; i < p.M; i++)
+            bias[i] = static_cast<float>(rand()) / static_cast<float>(RAND_MAX) - 0.5f;
+        p.epi.row_bias = bias.data();
+        p.epi.col_bias = NULL;
+        p.epi.act = opt.activation == "relu" ? SPMM_ACT_RELU : opt.activation == "gelu" ? SPMM_ACT_GELU : SPMM_ACT_NONE;
+        vector<pair<vector<void *>, vector<unsigned long>>> batch_csr;
+        for (int b = 0; b < opt.batch; b++)
+        {
+            if (p.nm_m)
+                random_init_nm(p.A, p.M, p.K, p.nm_n, p.nm_m);
+            else if (p.block)
+                random_init_blocks(p.A, p.M, p.K, p.block, p.sparsity);
+            else
+                random_init(p.A, (size_t)p.M * p.K, p.sparsity);
+            batch_csr.push_back(convert_csr(p.A, p.M, p.K));
+            p.nnz = (b ? p.nnz : 0) + batch_csr[b].second[0];
+        }
+
+        for (size_t in = 0; in < opt.n.size(); in++)
+        {
+            p.N = atol(opt.n[in].c_str());
+            p.B = (float *)mkl_malloc(sizeof(float) * p.K * p.N, 64);
+            p.C = (float *)mkl_malloc(sizeof(float) * p.M * p.N, 64);
+            p.ref = (float *)mkl_malloc(sizeof(float) * p.M * p.N, 64);
+            if (p.B == NULL || p.C == NULL || p.ref == NULL)
+            {
+                fprintf(stderr, "Host memory allocation failed!\n");
+                return -1;
+            }
+            random_init(p.B, (size_t)p.K * p.N, 0);
+            if (opt.batch == 0 && !reference_mm(p))
+            {
+                fprintf(stderr, "Reference mkl_sparse_s_mm failed\n");
+                return -1;
+            }
+            vector<float *> batch_B, batch_C;
+            for (size_t b = 0; b < batch_csr.size(); b++)
+            {
+                batch_B.push_back((float *)mkl_malloc(sizeof(float) * p.K * p.N, 64));
+                batch_C.push_back((float *)mkl_malloc(sizeof(float) * p.M * p.N, 64));
+                p.item_ref.push_back((float *)mkl_malloc(sizeof(float) * p.M * p.N, 64));
+                if (batch_B[b] == NULL || batch_C[b] == NULL || p.item_ref[b] == NULL)
+                {
+                    fprintf(stderr, "Host memory allocation failed!\n");
+                    return -1;
+                }
+                random_init(batch_B[b], (size_t)p.K * p.N, 0);
+                MKL_INT *rowIndex = (MKL_INT *)batch_csr[b].first[1];
+                if (!reference_csr_mm(p.M, p.K, p.N, (float *)batch_csr[b].first[0], rowIndex, (MKL_INT *)batch_csr[b].first[2],
+                                      batch_B[b], p.item_ref[b]))
+                {
+                    fprintf(stderr, "Reference mkl_sparse_s_mm failed\n");
+                    return -1;
+                }
+                SpmmBatchItem it = {p.M, p.N, 1.0f, (float *)batch_csr[b].first[0], (MKL_INT *)batch_csr[b].first[2],
+                                    rowIndex, rowIndex + 1, batch_B[b], p.N, 0.0f, batch_C[b], p.N, NULL};
+                p.items.push_back(it);
+            }
+
+            // one scaling group per kernel and --numa placement
+            for (size_t ik2 = 0; ik2 < opt.kernels.size() * opt.numa.size(); ik2++)
+            {
+                const string &name = opt.kernels[ik2 / opt.numa.size()];
+                const string &mode = opt.numa[ik2 % opt.numa.size()];
+                vector<BenchRecord> group;
+                vector<int> group_threads;
+                vector<double> group_ms;
+                for (size_t it = 0; it < opt.threads.size(); it++)
+                {
+                    int threads = atoi(opt.threads[it].c_str());
+                    mkl_set_num_threads(threads);
+                    omp_set_num_threads(threads);
+                    KernelRun k;
+                    LatencyStats lat;
+                    NumaPlacement placed;
+                    if (!numa_place(p, mode, threads, placed))
+                    {
+                        fprintf(stderr, "Placement %s is not available here\n", mode.c_str());
+                        numa_restore(p, placed);
+                        break;
+                    }
+                    if (!make_kernel(name, p, k))
+                    {
+                        fprintf(stderr, "Kernel %s could not be set up\n", name.c_str());
+                        numa_restore(p, placed);
+                        break;
+                    }
+                    bool ok = time_kernel(k.run, opt.warmup, opt.iters, lat);
+                    double err = ok && k.check ? max_rel_err(p, k.ref) : -1;
+                    k.cleanup();
+                    numa_restore(p, placed);
+                    if (!ok)
+                    {
+                        fprintf(stderr, "Kernel %s failed\n", name.c_str());
+                        break;
+                    }
+                    group.push_back(make_record(k.label.empty() ? name : k.label, p, threads, lat, k, err));
+                    group_threads.push_back(threads);
+                    group_ms.push_back(lat.median);
+                }
+                if (scaling && !group.empty())
+                {
+                    // speedup and efficiency relative to the first thread count
+                    double best = 0;
+                    for (size_t i = 0; i < group_ms.size(); i++)
+                        best = max(best, 1.0 / group_ms[i]);
+                    int saturation = group_threads.back();
+                    for (size_t i = 0; i < group_ms.size(); i++)
+                    {
+                        if (1.0 / group_ms[i] >= 0.95 * best)
+                        {
+                            saturation = group_threads[i];
+                            break;
+                        }
+                    }
+                    for (size_t i = 0; i < group.size(); i++)
+                    {
+                        double speedup = group_ms[0] / group_ms[i];
+                        group[i].add("affinity", policy);
+                        group[i].add("speedup", speedup);
+                        group[i].add("efficiency", speedup * group_threads[0] / group_threads[i]);
+                        group[i].add("saturation_threads", (long long)saturation);
+                    }
+                }
+                for (size_t i = 0; i < group.size(); i++)
+                    writer.write(group[i]);
+            }
+            mkl_free(p.B);
+            mkl_free(p.C);
+            mkl_free(p.ref);
+            for (size_t b = 0; b < batch_B.size(); b++)
+            {
+                mkl_free(batch_B[b]);
+                mkl_free(batch_C[b]);
+                mkl_free(p.item_ref[b]);
+            }
+            p.items.clear();
+            p.item_ref.clear();
+        }
+        for (size_t b = 0; b < batch_csr.size(); b++)
+            for (size_t i = 0; i < batch_csr[b].first.size(); i++)
+                mkl_free(batch_csr[b].first[i]);
+        mkl_free(p.A);
+        mkl_free(p.values);
+        mkl_free(p.rowIndex);
+        mkl_free(p.columns);
+    }
+    writer.finish();
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdio.h>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+// Monotonic wall clock in seconds. clock() sums CPU time over all threads and
+// overstates multithreaded kernels by roughly the thread count.
+inline double wall_time()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct LatencyStats
+{
+    double median, p5, p95, min, mean; // milliseconds
+};
+
+// Nearest-rank percentile of an already sorted sample, q in [0, 1].
+inline double sorted_percentile(const std::vector<double> &sorted, double q)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t idx = (size_t)(q * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+inline LatencyStats summarize(std::vector<double> samples_ms)
+{
+    LatencyStats s = {0, 0, 0, 0, 0};
+    if (samples_ms.empty())
+        return s;
+    std::sort(samples_ms.begin(), samples_ms.end());
+    s.median = sorted_percentile(samples_ms, 0.5);
+    s.p5 = sorted_percentile(samples_ms, 0.05);
+    s.p95 = sorted_percentile(samples_ms, 0.95);
+    s.min = samples_ms.front();
+    for (size_t i = 0; i < samples_ms.size(); i++)
+        s.mean += samples_ms[i];
+    s.mean /= samples_ms.size();
+    return s;
+}
+
+// Runs f warmup times untimed, then times each of iters calls separately.
+// f returns false on failure, which aborts the measurement.
+template <typename F>
+bool time_kernel(F f, int warmup, int iters, LatencyStats &stats)
+{
+    for (int i = 0; i < warmup; i++)
+        if (!f())
+            return false;
+    std::vector<double> samples(iters);
+    for (int i = 0; i < iters; i++)
+    {
+        double t0 = wall_time();
+        if (!f())
+            return false;
+        samples[i] = (wall_time() - t0) * 1000.0;
+    }
+    stats = summarize(samples);
+    return true;
+}
+
+// One result row: ordered name/value pairs so new columns can be appended
+// without touching the writers. Every record of a run must have the same fields.
+struct BenchRecord
+{
+    std::vector<std::pair<std::string, std::string>> fields;
+
+    void add(const std::string &name, const std::string &value, bool quoted = true)
+    {
+        fields.push_back(std::make_pair(name, quoted ? "\"" + value + "\"" : value));
+    }
+    // inf/nan have no JSON literal and are written as null
+    void add(const std::string &name, double value)
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), std::isfinite(value) ? "%.6g" : "null", value);
+        fields.push_back(std::make_pair(name, std::string(buf)));
+    }
+    void add(const std::string &name, long long value)
+    {
+        fields.push_back(std::make_pair(name, std::to_string(value)));
+    }
+    void add_latency(const LatencyStats &s)
+    {
+        add("median_ms", s.median);
+        add("p5_ms", s.p5);
+        add("p95_ms", s.p95);
+    }
+};
+
+// Streams records as CSV (header before the first row) or as a JSON array.
+struct BenchWriter
+{
+    FILE *out;
+    bool json;
+    size_t count;
+
+    BenchWriter(FILE *f, bool as_json) : out(f), json(as_json), count(0) {}
+
+    void write(const BenchRecord &r)
+    {
+        if (json)
+        {
+            fprintf(out, count == 0 ? "[\n  {" : ",\n  {");
+            for (size_t i = 0; i < r.fields.size(); i++)
+                fprintf(out, "%s\"%s\": %s", i ? ", " : "", r.fields[i].first.c_str(), r.fields[i].second.c_str());
+            fprintf(out, "}");
+        }
+        else
+        {
+            if (count == 0)
+                for (size_t i = 0; i < r.fields.size(); i++)
+                    fprintf(out, "%s%s", i ? "," : "", r.fields[i].first.c_str());
+            if (count == 0)
+                fprintf(out, "\n");
+            for (size_t i = 0; i < r.fields.size(); i++)
+                fprintf(out, "%s%s", i ? "," : "", r.fields[i].second.c_str());
+            fprintf(out, "\n");
+        }
+        count++;
+        fflush(out);
+    }
+
+    void finish()
+    {
+        if (json)
+            fprintf(out, count ? "\n]\n" : "[]\n");
+        fflush(out);
+    }
+};
+
+// Splits "a,b,c" into its items.
+inline std::vector<std::string> split_list(const std::string &s)
+{
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= s.size())
+    {
+        size_t comma = s.find(',', start);
+        if (comma == std::string::npos)
+            comma = s.size();
+        if (comma > start)
+            items.push_back(s.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return items;
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "mkl.h"
+#include "mkl_spblas.h"
+#include "mkl_types.h"
+#include "bench_stats.hpp"
+
+// Block sparse row (BSR) storage for pruned weights with block structure.
+// The matrix is cut into block x block tiles and every tile holding at least
+// one nonzero is stored densely (row-major inside the tile), so MKL runs a
+// small dense GEMM per tile instead of one FMA per nonzero. The price is
+// fill-in: the explicit zeros of partially used tiles. Rows and columns must
+// be multiples of block.
+struct BsrMatrix
+{
+    MKL_INT block;
+    MKL_INT block_rows, block_cols, nnzb;
+    MKL_INT *rowIndex; // block_rows + 1, zero-based
+    MKL_INT *columns;  // nnzb block columns, ascending within a block row
+    float *values;     // nnzb * block * block
+
+    void release()
+    {
+        mkl_free(rowIndex);
+        mkl_free(columns);
+        mkl_free(values);
+        rowIndex = NULL;
+        columns = NULL;
+        values = NULL;
+    }
+};
+
+// Number of non-empty block x block tiles of a zero-based CSR matrix.
+inline MKL_INT bsr_count_blocks(const MKL_INT *rowIndex, const MKL_INT *columns, MKL_INT rows, MKL_INT cols, MKL_INT block)
+{
+    MKL_INT block_rows = (rows + block - 1) / block, block_cols = (cols + block - 1) / block;
+    MKL_INT nnzb = 0;
+#pragma omp parallel reduction(+ : nnzb)
+    {
+        std::vector<MKL_INT> seen(block_cols, -1);
+#pragma omp for schedule(static)
+        for (MKL_INT bi = 0; bi < block_rows; bi++)
+        {
+            MKL_INT r1 = (bi + 1) * block < rows ? (bi + 1) * block : rows;
+            for (MKL_INT i = bi * block; i < r1; i++)
+            {
+                for (MKL_INT k = rowIndex[i]; k < rowIndex[i + 1]; k++)
+                {
+                    MKL_INT bj = columns[k] / block;
+                    if (seen[bj] != bi)
+                    {
+                        seen[bj] = bi;
+                        nnzb++;
+                    }
+                }
+            }
+        }
+    }
+    return nnzb;
+}
+
+inline bool bsr_alloc(MKL_INT rows, MKL_INT cols, MKL_INT block, BsrMatrix &out)
+{
+    out.rowIndex = NULL;
+    out.columns = NULL;
+    out.values = NULL;
+    if (block < 1 || rows % block != 0 || cols % block != 0)
+        return false;
+    out.block = block;
+    out.block_rows = rows / block;
+    out.block_cols = cols / block;
+    out.rowIndex = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (out.block_rows + 1), 64);
+    return out.rowIndex != NULL;
+}
+
+// Turns rowIndex[1..block_rows] (blocks per block row) into offsets and
+// allocates columns and values.
+inline bool bsr_finish_alloc(BsrMatrix &out)
+{
+    out.rowIndex[0] = 0;
+    for (MKL_INT bi = 0; bi < out.block_rows; bi++)
+        out.rowIndex[bi + 1] += out.rowIndex[bi];
+    out.nnzb = out.rowIndex[out.block_rows];
+    size_t tiles = out.nnzb ? out.nnzb : 1;
+    out.columns = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * tiles, 64);
+    out.values = (float *)mkl_malloc(sizeof(float) * tiles * out.block * out.block, 64);
+    if (out.columns == NULL || out.values == NULL)
+    {
+        out.release();
+        return false;
+    }
+    return true;
+}
+
+// From zero-based CSR, e.g. convert_csr or load_mask output.
+inline bool csr_to_bsr(const float *values, const MKL_INT *rowIndex, const MKL_INT *columns, MKL_INT rows, MKL_INT cols,
+                       MKL_INT block, BsrMatrix &out)
+{
+    if (!bsr_alloc(rows, cols, block, out))
+        return false;
+    const MKL_INT bs = block;
+#pragma omp parallel
+    {
+        std::vector<MKL_INT> seen(out.block_cols, -1);
+#pragma omp for schedule(static)
+        for (MKL_INT bi = 0; bi < out.block_rows; bi++)
+        {
+            MKL_INT cnt = 0;
+            for (MKL_INT i = bi * bs; i < (bi + 1) * bs; i++)
+                for (MKL_INT k = rowIndex[i]; k < rowIndex[i + 1]; k++)
+                    if (seen[columns[k] / bs] != bi)
+                    {
+                        seen[columns[k] / bs] = bi;
+                        cnt++;
+                    }
+            out.rowIndex[bi + 1] = cnt;
+        }
+    }
+    if (!bsr_finish_alloc(out))
+        return false;
+#pragma omp parallel
+    {
+        // slot[bj]: tile of block column bj in the current block row
+        std::vector<MKL_INT> slot(out.block_cols, -1);
+#pragma omp for schedule(static)
+        for (MKL_INT bi = 0; bi < out.block_rows; bi++)
+        {
+            MKL_INT b = out.rowIndex[bi], e = out.rowIndex[bi + 1], t = b;
+            for (MKL_INT i = bi * bs; i < (bi + 1) * bs; i++)
+                for (MKL_INT k = rowIndex[i]; k < rowIndex[i + 1]; k++)
+                    if (slot[columns[k] / bs] < 0)
+                    {
+                        slot[columns[k] / bs] = 0;
+                        out.columns[t++] = columns[k] / bs;
+                    }
+            std::sort(out.columns + b, out.columns + e);
+            for (MKL_INT t2 = b; t2 < e; t2++)
+                slot[out.columns[t2]] = t2;
+            memset(out.values + (size_t)b * bs * bs, 0, sizeof(float) * (e - b) * bs * bs);
+            for (MKL_INT i = bi * bs; i < (bi + 1) * bs; i++)
+                for (MKL_INT k = rowIndex[i]; k < rowIndex[i + 1]; k++)
+                    out.values[((size_t)slot[columns[k] / bs] * bs + i % bs) * bs + columns[k] % bs] = values[k];
+            for (MKL_INT t2 = b; t2 < e; t2++)
+                slot[out.columns[t2]] = -1;
+        }
+    }
+    return true;
+}
+
+// From a dense row-major rows x cols matrix.
+inline bool dense_to_bsr(const float *A, MKL_INT rows, MKL_INT cols, MKL_INT block, BsrMatrix &out)
+{
+    if (!bsr_alloc(rows, cols, block, out))
+        return false;
+    const MKL_INT bs = block;
+    auto tile_used = [&](MKL_INT bi, MKL_INT bj) {
+        for (MKL_INT i = 0; i < bs; i++)
+            for (MKL_INT j = 0; j < bs; j++)
+                if (A[(size_t)(bi * bs + i) * cols + bj * bs + j] != 0.0f)
+                    return true;
+        return false;
+    };
+#pragma omp parallel for schedule(static)
+    for (MKL_INT bi = 0; bi < out.block_rows; bi++)
+    {
+        MKL_INT cnt = 0;
+        for (MKL_INT bj = 0; bj < out.block_cols; bj++)
+            cnt += tile_used(bi, bj);
+        out.rowIndex[bi + 1] = cnt;
+    }
+    if (!bsr_finish_alloc(out))
+        return false;
+#pragma omp parallel for schedule(static)
+    for (MKL_INT bi = 0; bi < out.block_rows; bi++)
+    {
+        MKL_INT t = out.rowIndex[bi];
+        for (MKL_INT bj = 0; bj < out.block_cols; bj++)
+        {
+            if (!tile_used(bi, bj))
+                continue;
+            out.columns[t] = bj;
+            for (MKL_INT i = 0; i < bs; i++)
+                memcpy(out.values + ((size_t)t * bs + i) * bs, A + (size_t)(bi * bs + i) * cols + bj * bs, sizeof(float) * bs);
+            t++;
+        }
+    }
+    return true;
+}
+
+// MKL handle on a, hinted and optimized for row-major SpMM with N columns.
+// The handle references a's arrays.
+inline bool bsr_create_handle(const BsrMatrix &a, MKL_INT N, MKL_INT expected_calls, sparse_matrix_t &handle, matrix_descr &descr)
+{
+    descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+    descr.mode = SPARSE_FILL_MODE_LOWER;
+    descr.diag = SPARSE_DIAG_NON_UNIT;
+    if (mkl_sparse_s_create_bsr(&handle, SPARSE_INDEX_BASE_ZERO, SPARSE_LAYOUT_ROW_MAJOR, a.block_rows, a.block_cols, a.block,
+                                a.rowIndex, a.rowIndex + 1, a.columns, a.values) != SPARSE_STATUS_SUCCESS)
+        return false;
+    if (mkl_sparse_set_mm_hint(handle, SPARSE_OPERATION_NON_TRANSPOSE, descr, SPARSE_LAYOUT_ROW_MAJOR, N, expected_calls) != SPARSE_STATUS_SUCCESS ||
+        mkl_sparse_optimize(handle) != SPARSE_STATUS_SUCCESS)
+    {
+        mkl_sparse_destroy(handle);
+        return false;
+    }
+    return true;
+}
+
+// Bytes of the sparse operand: tiles, block columns and block row pointers.
+inline double bsr_bytes(const BsrMatrix &a)
+{
+    return (double)a.nnzb * (a.block * a.block * sizeof(float) + sizeof(MKL_INT)) + (double)(a.block_rows + 1) * sizeof(MKL_INT);
+}
+
+// One block size considered by choose_bsr_block. fill is stored entries per
+// nonzero (1 for CSR); ms the median mkl_sparse_s_mm time, 0 when skipped.
+struct BsrCandidate
+{
+    MKL_INT block, nnzb;
+    double fill, ms;
+};
+
+// Picks the block size for C = A * B (A zero-based CSR, B row-major K x N,
+// C M x N used as scratch). Block sizes that do not divide M and K or whose
+// fill-in exceeds max_fill are rejected from the tile count alone; the rest,
+// and plain CSR as block 1, are timed with optimized handles and the fastest
+// wins. Returns 1 when CSR should be kept.
+inline MKL_INT choose_bsr_block(const float *values, const MKL_INT *rowIndex, const MKL_INT *columns, MKL_INT M, MKL_INT K,
+                                const float *B, float *C, MKL_INT N, double max_fill = 4.0,
+                                std::vector<BsrCandidate> *report = NULL)
+{
+    static const MKL_INT sizes[] = {1, 2, 4, 8, 16};
+    MKL_INT nnz = rowIndex[M];
+    MKL_INT best = 1;
+    double best_ms = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        BsrCandidate c = {sizes[s], 0, 0, 0};
+        if (M % c.block != 0 || K % c.block != 0)
+            continue;
+        c.nnzb = c.block == 1 ? nnz : bsr_count_blocks(rowIndex, columns, M, K, c.block);
+        c.fill = nnz ? (double)c.nnzb * c.block * c.block / nnz : 1.0;
+        if (c.fill <= max_fill)
+        {
+            BsrMatrix a;
+            sparse_matrix_t handle;
+            matrix_descr descr;
+            bool ok;
+            if (c.block == 1)
+            {
+                descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+                descr.mode = SPARSE_FILL_MODE_LOWER;
+                descr.diag = SPARSE_DIAG_NON_UNIT;
+                ok = mkl_sparse_s_create_csr(&handle, SPARSE_INDEX_BASE_ZERO, M, K, (MKL_INT *)rowIndex, (MKL_INT *)rowIndex + 1,
+                                             (MKL_INT *)columns, (float *)values) == SPARSE_STATUS_SUCCESS;
+                if (ok && (mkl_sparse_set_mm_hint(handle, SPARSE_OPERATION_NON_TRANSPOSE, descr, SPARSE_LAYOUT_ROW_MAJOR, N, 1000) != SPARSE_STATUS_SUCCESS ||
+                           mkl_sparse_optimize(handle) != SPARSE_STATUS_SUCCESS))
+                {
+                    mkl_sparse_destroy(handle);
+                    ok = false;
+                }
+            }
+            else
+            {
+                ok = csr_to_bsr(values, rowIndex, columns, M, K, c.block, a);
+                if (ok && !bsr_create_handle(a, N, 1000, handle, descr))
+                {
+                    a.release();
+                    ok = false;
+                }
+            }
+            LatencyStats lat;
+            if (ok && time_kernel([&]() {
+                    return mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0f, handle, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                           B, N, N, 0.0f, C, N) == SPARSE_STATUS_SUCCESS;
+                }, 2, 10, lat))
+            {
+                c.ms = lat.median;
+                if (best_ms == 0 || c.ms < best_ms)
+                {
+                    best = c.block;
+                    best_ms = c.ms;
+                }
+            }
+            if (ok)
+            {
+                mkl_sparse_destroy(handle);
+                if (c.block != 1)
+                    a.release();
+            }
+        }
+        if (report != NULL)
+            report->push_back(c);
+    }
+    return best;
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <limits>
+#include <sys/stat.h>
+#include "mkl_types.h"
+#include "mapped_file.hpp"
+#include "mm_parser.hpp"
+
+// Binary CSR sidecar ("<matrix>.csrbin"), written once after the first parse and
+// mapped on later runs. Layout, all little-endian:
+//   CsrCacheHeader | rowptr[rows + 1] | colidx[nnz] | values[nnz]
+// with every section starting on a page boundary, so the mapped arrays can be
+// handed to MKL as they are. The header records the index/value widths and
+// the index base the arrays were written with, plus the size and mtime of the
+// source file; a mismatch on any of these (or a bad checksum) means the cache
+// is rebuilt instead of used.
+const char CSR_CACHE_MAGIC[8] = {'C', 'S', 'R', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t CSR_CACHE_VERSION = 1;
+const uint64_t CSR_CACHE_ALIGN = 4096;
+
+struct CsrCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t index_size;
+    uint32_t value_size;
+    uint32_t index_base;
+    uint64_t rows, cols, nnz;
+    uint64_t rowptr_offset, colidx_offset, values_offset;
+    uint64_t source_size, source_mtime;
+    uint64_t checksum;
+};
+
+inline uint64_t csr_cache_align(uint64_t off)
+{
+    return (off + CSR_CACHE_ALIGN - 1) / CSR_CACHE_ALIGN * CSR_CACHE_ALIGN;
+}
+
+// 64-bit multiply-rotate hash. Blocks are hashed in parallel and combined in
+// order, so verifying a mapped cache runs at memory bandwidth.
+inline uint64_t csr_cache_checksum(const char *p, size_t n)
+{
+    const size_t block = 1 << 20;
+    const uint64_t P1 = 0x9e3779b185ebca87ULL, P2 = 0xc2b2ae3d27d4eb4fULL;
+    size_t nblocks = (n + block - 1) / block;
+    std::vector<uint64_t> partial(nblocks);
+#pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < nblocks; b++)
+    {
+        const char *q = p + b * block;
+        size_t len = (b + 1 == nblocks) ? n - b * block : block;
+        uint64_t h = P1 ^ len, w;
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            memcpy(&w, q + i, 8);
+            h ^= w * P2;
+            h = ((h << 31) | (h >> 33)) * P1;
+        }
+        for (; i < len; i++)
+            h = (h ^ (unsigned char)q[i]) * P1;
+        partial[b] = h;
+    }
+    uint64_t h = n * P2;
+    for (size_t b = 0; b < nblocks; b++)
+    {
+        h ^= partial[b];
+        h = ((h << 27) | (h >> 37)) * P2 + P1;
+    }
+    return h;
+}
+
+// Layout checks shared by the mapped and the streamed (pread) readers: the
+// rowptr, colidx and values sections must follow the header in that order,
+// each fully inside the file, with values ending exactly at its end. rows and
+// nnz are bounded by the file size first, so none of the sums can wrap.
+inline bool csr_cache_header_ok(const CsrCacheHeader &hdr, uint64_t file_size)
+{
+    const uint64_t is = sizeof(MKL_INT);
+    if (memcmp(hdr.magic, CSR_CACHE_MAGIC, 8) != 0 || hdr.version != CSR_CACHE_VERSION || hdr.index_size != is ||
+        hdr.value_size == 0 || hdr.value_size > 16)
+        return false;
+    if (hdr.rows >= file_size || hdr.nnz > file_size || hdr.rows >= (uint64_t)std::numeric_limits<MKL_INT>::max() ||
+        hdr.nnz > (uint64_t)std::numeric_limits<MKL_INT>::max())
+        return false;
+    if (hdr.rowptr_offset % is != 0 || hdr.colidx_offset % is != 0 || hdr.values_offset % hdr.value_size != 0)
+        return false;
+    return hdr.rowptr_offset >= sizeof(CsrCacheHeader) && hdr.rowptr_offset <= file_size &&
+           hdr.colidx_offset <= file_size && hdr.values_offset <= file_size &&
+           hdr.rowptr_offset + is * (hdr.rows + 1) <= hdr.colidx_offset &&
+           hdr.colidx_offset + is * hdr.nnz <= hdr.values_offset &&
+           hdr.values_offset + hdr.value_size * hdr.nnz == file_size;
+}
+
+inline bool csr_cache_source_stat(const char *source, uint64_t &size, uint64_t &mtime)
+{
+    struct stat st;
+    if (stat(source, &st) != 0)
+        return false;
+    size = st.st_size;
+    mtime = st.st_mtime;
+    return true;
+}
+
+// Writes the cache next to the source. The file is written under a temporary
+// name and renamed, so a concurrent reader never maps a half-written cache.
+template <typename T>
+bool write_csr_cache(const std::string &path, const char *source, MKL_INT rows, MKL_INT cols, MKL_INT nnz,
+                     MKL_INT index_base, const MKL_INT *rowptr, const MKL_INT *colidx, const T *values)
+{
+    CsrCacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CSR_CACHE_MAGIC, 8);
+    hdr.version = CSR_CACHE_VERSION;
+    hdr.index_size = sizeof(MKL_INT);
+    hdr.value_size = sizeof(T);
+    hdr.index_base = index_base;
+    hdr.rows = rows;
+    hdr.cols = cols;
+    hdr.nnz = nnz;
+    hdr.rowptr_offset = csr_cache_align(sizeof(hdr));
+    hdr.colidx_offset = csr_cache_align(hdr.rowptr_offset + sizeof(MKL_INT) * (rows + 1));
+    hdr.values_offset = csr_cache_align(hdr.colidx_offset + sizeof(MKL_INT) * nnz);
+    uint64_t total = hdr.values_offset + sizeof(T) * nnz;
+    if (source != NULL && !csr_cache_source_stat(source, hdr.source_size, hdr.source_mtime))
+        return false;
+
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w+b");
+    if (f == NULL)
+        return false;
+    // sections are written with zero padding up to the next offset; the
+    // checksum is then taken over the written file through a mapping, so no
+    // staging copy of the arrays is needed
+    static const char zeros[CSR_CACHE_ALIGN] = {0};
+    uint64_t pos = 0;
+    auto put = [&](const void *p, uint64_t off, uint64_t len) {
+        bool good = fwrite(zeros, 1, off - pos, f) == off - pos && fwrite(p, 1, len, f) == len;
+        pos = off + len;
+        return good;
+    };
+    bool ok = put(&hdr, 0, sizeof(hdr)) &&
+              put(rowptr, hdr.rowptr_offset, sizeof(MKL_INT) * (rows + 1)) &&
+              put(colidx, hdr.colidx_offset, sizeof(MKL_INT) * nnz) &&
+              put(values, hdr.values_offset, sizeof(T) * nnz) &&
+              fflush(f) == 0;
+    if (ok)
+    {
+        MappedFile written;
+        ok = written.open(tmp.c_str(), MADV_SEQUENTIAL) && written.size == total;
+        if (ok)
+            hdr.checksum = csr_cache_checksum(written.data + hdr.rowptr_offset, total - hdr.rowptr_offset);
+        ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// A mapped cache. The arrays point into the read-only mapping and stay valid
+// until the CsrCache is closed or destroyed; they must not be written or freed.
+struct CsrCache
+{
+    MappedFile file;
+    MKL_INT rows, cols, nnz;
+    MKL_INT *rowptr, *colidx;
+    void *values;
+
+    CsrCache() : rows(0), cols(0), nnz(0), rowptr(NULL), colidx(NULL), values(NULL) {}
+
+    // Maps path and validates it against the expected value width and index
+    // base, and (if source is given) against the current source file.
+    bool open(const std::string &path, const char *source, size_t value_size, MKL_INT index_base, bool verify = true)
+    {
+        if (!file.open(path.c_str(), MADV_WILLNEED))
+            return false;
+        CsrCacheHeader hdr;
+        uint64_t src_size, src_mtime;
+        if (file.size < sizeof(hdr))
+            return fail();
+        memcpy(&hdr, file.data, sizeof(hdr));
+        if (!csr_cache_header_ok(hdr, file.size) || hdr.value_size != value_size || hdr.index_base != (uint32_t)index_base)
+            return fail();
+        if (source != NULL && (!csr_cache_source_stat(source, src_size, src_mtime) ||
+                               src_size != hdr.source_size || src_mtime != hdr.source_mtime))
+            return fail();
+        if (verify && csr_cache_checksum(file.data + hdr.rowptr_offset, file.size - hdr.rowptr_offset) != hdr.checksum)
+            return fail();
+        rows = hdr.rows;
+        cols = hdr.cols;
+        nnz = hdr.nnz;
+        rowptr = (MKL_INT *)(file.data + hdr.rowptr_offset);
+        colidx = (MKL_INT *)(file.data + hdr.colidx_offset);
+        values = (void *)(file.data + hdr.values_offset);
+        return true;
+    }
+
+    template <typename T>
+    T *values_as() const { return (T *)values; }
+
+    bool fail()
+    {
+        file.close();
+        return false;
+    }
+};
+
+// Zero-based double CSR of a Matrix Market file, from load_csr_cached. The
+// arrays point into the mapped cache or into parsed.
+struct CsrMatrix
+{
+    std::string path;
+    MKL_INT rows, cols, nnz;
+    MKL_INT *rowptr, *colidx;
+    double *values;
+    bool cached; // arrays are the read-only cache mapping
+    CsrCache cache;
+    MmCsr parsed;
+
+    CsrMatrix() : rows(0), cols(0), nnz(0), rowptr(NULL), colidx(NULL), values(NULL), cached(false) {}
+
+    void release()
+    {
+        parsed.release();
+        cache.file.close();
+        rowptr = colidx = NULL;
+        values = NULL;
+    }
+};
+
+// Maps "<path>.csrbin" if it is valid for path, otherwise parses path and
+// writes the cache for the next run. verify = false skips the checksum pass
+// over the mapping (e.g. when the arrays are only streamed later).
+inline bool load_csr_cached(const std::string &path, CsrMatrix &m, bool verify = true)
+{
+    m.path = path;
+    std::string cache_path = path + ".csrbin";
+    m.cached = m.cache.open(cache_path, path.c_str(), sizeof(double), 0, verify);
+    if (m.cached)
+    {
+        m.rows = m.cache.rows;
+        m.cols = m.cache.cols;
+        m.nnz = m.cache.nnz;
+        m.rowptr = m.cache.rowptr;
+        m.colidx = m.cache.colidx;
+        m.values = m.cache.values_as<double>();
+        return true;
+    }
+    double parse_start = omp_get_wtime();
+    if (!read_matrix_market_csr(path.c_str(), m.parsed))
+        return false;
+    fprintf(stderr, "Parsed %s in %lf s\n", path.c_str(), omp_get_wtime() - parse_start);
+    m.rows = m.parsed.rows;
+    m.cols = m.parsed.cols;
+    m.nnz = m.parsed.nnz;
+    m.rowptr = m.parsed.rowptr;
+    m.colidx = m.parsed.colidx;
+    m.values = m.parsed.values;
+    if (!write_csr_cache(cache_path, path.c_str(), m.rows, m.cols, m.nnz, 0, m.rowptr, m.colidx, m.values))
+        fprintf(stderr, "Could not write CSR cache %s\n", cache_path.c_str());
+    return true;
+}
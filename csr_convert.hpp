@@ -0,0 +1,207 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+#include <immintrin.h>
+#include "mkl.h"
+#include "mkl_types.h"
+
+// Row compaction kernels. Each one scans a dense row of w floats and either
+// counts its nonzeros or writes them (and their column ids) contiguously to
+// values/columns, returning how many were written. Stores never touch slots
+// past the returned count, so rows owned by other threads are never clobbered.
+typedef MKL_INT (*count_row_fn)(const float *row, MKL_INT w);
+typedef MKL_INT (*compress_row_fn)(const float *row, MKL_INT w, float *values, MKL_INT *columns);
+
+inline MKL_INT count_row_scalar(const float *row, MKL_INT w)
+{
+    MKL_INT cnt = 0;
+    for (MKL_INT j = 0; j < w; j++)
+        cnt += (row[j] != 0.0f);
+    return cnt;
+}
+
+// Compacts row[j..w) after dst entries have already been written.
+inline MKL_INT compress_row_tail(const float *row, MKL_INT j, MKL_INT w, float *values, MKL_INT *columns, MKL_INT dst)
+{
+    for (; j < w; j++)
+    {
+        if (row[j] != 0.0f)
+        {
+            values[dst] = row[j];
+            columns[dst] = j;
+            dst++;
+        }
+    }
+    return dst;
+}
+
+inline MKL_INT compress_row_scalar(const float *row, MKL_INT w, float *values, MKL_INT *columns)
+{
+    return compress_row_tail(row, 0, w, values, columns, 0);
+}
+
+// _CMP_NEQ_UQ keeps NaNs, matching the scalar `!= 0.0f` test.
+__attribute__((target("avx2,popcnt"))) inline MKL_INT count_row_avx2(const float *row, MKL_INT w)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    MKL_INT cnt = 0, j = 0;
+    for (; j + 8 <= w; j += 8)
+        cnt += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(row + j), zero, _CMP_NEQ_UQ)));
+    return cnt + count_row_scalar(row + j, w - j);
+}
+
+// For every 8-bit lane mask, the lane ids of the set bits packed to the front.
+inline const int32_t (*compress_permute_table())[8]
+{
+    static const struct table_t
+    {
+        int32_t idx[256][8];
+        table_t()
+        {
+            for (int m = 0; m < 256; m++)
+            {
+                int k = 0;
+                for (int b = 0; b < 8; b++)
+                    if (m & (1 << b))
+                        idx[m][k++] = b;
+                for (; k < 8; k++)
+                    idx[m][k] = 0;
+            }
+        }
+    } table;
+    return table.idx;
+}
+
+__attribute__((target("avx2,popcnt"))) inline MKL_INT compress_row_avx2(const float *row, MKL_INT w, float *values, MKL_INT *columns)
+{
+    const int32_t(*perm)[8] = compress_permute_table();
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    MKL_INT dst = 0, j = 0;
+    for (; j + 8 <= w; j += 8)
+    {
+        __m256 v = _mm256_loadu_ps(row + j);
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(v, zero, _CMP_NEQ_UQ));
+        if (mask == 0)
+            continue;
+        int cnt = _mm_popcnt_u32(mask);
+        __m256i p = _mm256_loadu_si256((const __m256i *)perm[mask]);
+        __m256i keep = _mm256_cmpgt_epi32(_mm256_set1_epi32(cnt), lanes);
+        __m256i cols = _mm256_permutevar8x32_epi32(_mm256_add_epi32(lanes, _mm256_set1_epi32((int)j)), p);
+        _mm256_maskstore_ps(values + dst, keep, _mm256_permutevar8x32_ps(v, p));
+#ifdef MKL_ILP64
+        int32_t tmp[8];
+        _mm256_storeu_si256((__m256i *)tmp, cols);
+        for (int k = 0; k < cnt; k++)
+            columns[dst + k] = tmp[k];
+#else
+        _mm256_maskstore_epi32((int *)(columns + dst), keep, cols);
+#endif
+        dst += cnt;
+    }
+    return compress_row_tail(row, j, w, values, columns, dst);
+}
+
+__attribute__((target("avx512f,popcnt"))) inline MKL_INT count_row_avx512(const float *row, MKL_INT w)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    MKL_INT cnt = 0, j = 0;
+    for (; j + 16 <= w; j += 16)
+        cnt += _mm_popcnt_u32(_mm512_cmp_ps_mask(_mm512_loadu_ps(row + j), zero, _CMP_NEQ_UQ));
+    return cnt + count_row_scalar(row + j, w - j);
+}
+
+__attribute__((target("avx512f,popcnt"))) inline MKL_INT compress_row_avx512(const float *row, MKL_INT w, float *values, MKL_INT *columns)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    MKL_INT dst = 0, j = 0;
+    for (; j + 16 <= w; j += 16)
+    {
+        __m512 v = _mm512_loadu_ps(row + j);
+        __mmask16 mask = _mm512_cmp_ps_mask(v, zero, _CMP_NEQ_UQ);
+        if (mask == 0)
+            continue;
+        __m512i cols = _mm512_add_epi32(lanes, _mm512_set1_epi32((int)j));
+        _mm512_mask_compressstoreu_ps(values + dst, mask, v);
+#ifdef MKL_ILP64
+        __mmask8 lo = (__mmask8)(mask & 0xff), hi = (__mmask8)(mask >> 8);
+        _mm512_mask_compressstoreu_epi64(columns + dst, lo, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(cols)));
+        _mm512_mask_compressstoreu_epi64(columns + dst + _mm_popcnt_u32(lo), hi, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(cols, 1)));
+#else
+        _mm512_mask_compressstoreu_epi32(columns + dst, mask, cols);
+#endif
+        dst += _mm_popcnt_u32(mask);
+    }
+    return compress_row_tail(row, j, w, values, columns, dst);
+}
+
+// Picks the widest kernels the running CPU supports; resolved once per process.
+struct compress_kernels
+{
+    count_row_fn count;
+    compress_row_fn compress;
+    const char *isa;
+};
+
+inline const compress_kernels &select_compress_kernels()
+{
+    static const compress_kernels k = []() -> compress_kernels {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return {count_row_avx512, compress_row_avx512, "avx512"};
+        if (__builtin_cpu_supports("avx2"))
+            return {count_row_avx2, compress_row_avx2, "avx2"};
+        return {count_row_scalar, compress_row_scalar, "scalar"};
+    }();
+    return k;
+}
+
+// Dense (row-major, h x w) to zero-based CSR.
+// Pass 1 counts the nonzeros of every row in parallel and a prefix sum turns the
+// counts into rowIndex; pass 2 compacts each row straight into the final
+// 64-byte aligned buffers, so there is no intermediate growth or copy.
+// Returns {values, rowIndex, columns} and their lengths {nnz, h + 1, nnz}.
+inline std::pair<std::vector<void *>, std::vector<unsigned long>> convert_csr(const float *src, int h, int w)
+{
+    MKL_INT *ptr_r = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (h + 1), 64);
+    if (ptr_r == NULL)
+        throw "Host memory allocation failed!";
+
+    const compress_kernels &kern = select_compress_kernels();
+    ptr_r[0] = 0;
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < h; i++)
+        ptr_r[i + 1] = kern.count(src + (size_t)i * w, w);
+    for (MKL_INT i = 0; i < h; i++)
+        ptr_r[i + 1] += ptr_r[i];
+    size_t nnz = (size_t)ptr_r[h];
+
+    // mkl_malloc(0) may legally return NULL, keep at least one slot
+    float *ptr_v = (float *)mkl_malloc(sizeof(float) * (nnz ? nnz : 1), 64);
+    MKL_INT *ptr_c = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (nnz ? nnz : 1), 64);
+    if (ptr_v == NULL || ptr_c == NULL)
+    {
+        mkl_free(ptr_r);
+        mkl_free(ptr_v);
+        mkl_free(ptr_c);
+        throw "Host memory allocation failed!";
+    }
+
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < h; i++)
+        kern.compress(src + (size_t)i * w, w, ptr_v + ptr_r[i], ptr_c + ptr_r[i]);
+
+    std::vector<void *> ptrs = {(void *)ptr_v, (void *)ptr_r, (void *)ptr_c};
+    std::vector<unsigned long> sizes = {nnz, (unsigned long)h + 1, nnz};
+    return std::make_pair(ptrs, sizes);
+}
+
+// Bytes moved by convert_csr: the dense input plus the CSR arrays written.
+inline double convert_csr_bytes(int h, int w, unsigned long nnz)
+{
+    return (double)h * w * sizeof(float) + (double)nnz * (sizeof(float) + sizeof(MKL_INT)) + (double)(h + 1) * sizeof(MKL_INT);
+}
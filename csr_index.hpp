@@ -0,0 +1,206 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "spmm_kernel.hpp"
+
+// Compact column indices for zero-based CSR with sorted rows (as produced by
+// convert_csr). Next to the values, the 4/8-byte MKL_INT columns are the
+// largest stream an SpMM reads.
+//
+//   CSR_INDEX_U16     one uint16_t per nonzero, for up to 65536 columns
+//   CSR_INDEX_VARINT  per row, the gaps between consecutive columns minus one
+//                     as LEB128 varints (7 bits per byte), so a row whose
+//                     nonzeros are less than 128 columns apart costs one
+//                     byte per index; offsets[i] locates row i in stream
+//
+// rowIndex is still needed alongside, to find each row's values.
+enum csr_index_type
+{
+    CSR_INDEX_U16,
+    CSR_INDEX_VARINT
+};
+
+inline const char *csr_index_type_name(csr_index_type t)
+{
+    static const char *names[] = {"u16", "varint"};
+    return names[t];
+}
+
+struct CsrCompactIndex
+{
+    csr_index_type type;
+    MKL_INT rows, nnz;
+    uint16_t *columns16; // CSR_INDEX_U16
+    size_t *offsets;     // CSR_INDEX_VARINT, rows + 1 entries
+    uint8_t *stream;     // CSR_INDEX_VARINT, offsets[rows] bytes
+
+    void release()
+    {
+        mkl_free(columns16);
+        mkl_free(offsets);
+        mkl_free(stream);
+        columns16 = NULL;
+        offsets = NULL;
+        stream = NULL;
+    }
+};
+
+inline size_t varint_size(uint32_t v)
+{
+    size_t n = 1;
+    while (v >= 0x80)
+    {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+inline uint8_t *varint_put(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// Column following prev (-1 at the start of a row).
+inline MKL_INT varint_next_column(const uint8_t *&p, MKL_INT prev)
+{
+    uint32_t v = 0;
+    int shift = 0;
+    uint8_t byte;
+    do
+    {
+        byte = *p++;
+        v |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return prev + 1 + (MKL_INT)v;
+}
+
+// False when the matrix is too wide for CSR_INDEX_U16 or allocation fails.
+inline bool make_csr_index(const MKL_INT *rowIndex, const MKL_INT *columns, MKL_INT rows, MKL_INT cols, csr_index_type type, CsrCompactIndex &out)
+{
+    out.type = type;
+    out.rows = rows;
+    out.nnz = rowIndex[rows];
+    out.columns16 = NULL;
+    out.offsets = NULL;
+    out.stream = NULL;
+    if (type == CSR_INDEX_U16)
+    {
+        if (cols > 65536)
+            return false;
+        out.columns16 = (uint16_t *)mkl_malloc(sizeof(uint16_t) * (out.nnz ? out.nnz : 1), 64);
+        if (out.columns16 == NULL)
+            return false;
+#pragma omp parallel for schedule(static)
+        for (MKL_INT k = 0; k < out.nnz; k++)
+            out.columns16[k] = (uint16_t)columns[k];
+        return true;
+    }
+
+    out.offsets = (size_t *)mkl_malloc(sizeof(size_t) * (rows + 1), 64);
+    if (out.offsets == NULL)
+        return false;
+    out.offsets[0] = 0;
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < rows; i++)
+    {
+        size_t bytes = 0;
+        for (MKL_INT k = rowIndex[i], prev = -1; k < rowIndex[i + 1]; prev = columns[k], k++)
+            bytes += varint_size((uint32_t)(columns[k] - prev - 1));
+        out.offsets[i + 1] = bytes;
+    }
+    for (MKL_INT i = 0; i < rows; i++)
+        out.offsets[i + 1] += out.offsets[i];
+    out.stream = (uint8_t *)mkl_malloc(out.offsets[rows] ? out.offsets[rows] : 1, 64);
+    if (out.stream == NULL)
+    {
+        out.release();
+        return false;
+    }
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < rows; i++)
+    {
+        uint8_t *p = out.stream + out.offsets[i];
+        for (MKL_INT k = rowIndex[i], prev = -1; k < rowIndex[i + 1]; prev = columns[k], k++)
+            p = varint_put(p, (uint32_t)(columns[k] - prev - 1));
+    }
+    return true;
+}
+
+// Bytes of the sparse structure (compact columns plus rowIndex and offsets).
+inline double csr_index_bytes(const CsrCompactIndex &idx)
+{
+    double row_ptrs = (double)(idx.rows + 1) * sizeof(MKL_INT);
+    if (idx.type == CSR_INDEX_U16)
+        return (double)idx.nnz * sizeof(uint16_t) + row_ptrs;
+    return (double)idx.offsets[idx.rows] + (double)(idx.rows + 1) * sizeof(size_t) + row_ptrs;
+}
+
+const MKL_INT SPMM_VARINT_CHUNK = 256; // columns decoded per call into the row kernel
+
+// C = alpha * A * B + beta * C (see spmm_csr) with A's columns in compact form.
+// U16 runs the row kernels directly on the narrow indices. VARINT decodes up
+// to SPMM_VARINT_CHUNK columns of a row into a stack buffer and runs the row
+// kernel on that slice, accumulating into C after the first slice and
+// applying the epilogue with the last.
+template <typename V>
+inline void spmm_csr_index_t(MKL_INT M, MKL_INT N, float alpha, const V *values, const float *scales, const CsrCompactIndex &idx,
+                             const MKL_INT *rowIndex, const float *B, MKL_INT ldb, float beta, float *C, MKL_INT ldc,
+                             const SpmmEpilogue *epi = NULL)
+{
+    if (idx.type == CSR_INDEX_U16)
+    {
+        spmm_csr_t(M, N, alpha, values, scales, (const uint16_t *)idx.columns16, rowIndex, rowIndex + 1, B, ldb, beta, C, ldc, epi);
+        return;
+    }
+    const spmm_rows_t_fn<V, MKL_INT> rows = select_spmm_rows<V, MKL_INT>();
+    MKL_INT nblocks = (M + SPMM_ROW_BLOCK - 1) / SPMM_ROW_BLOCK;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (MKL_INT blk = 0; blk < nblocks; blk++)
+    {
+        MKL_INT cols[SPMM_VARINT_CHUNK];
+        const MKL_INT zero = 0;
+        MKL_INT r1 = (blk + 1) * SPMM_ROW_BLOCK < M ? (blk + 1) * SPMM_ROW_BLOCK : M;
+        for (MKL_INT i = blk * SPMM_ROW_BLOCK; i < r1; i++)
+        {
+            // the row kernel sees a one-row matrix, so row-indexed inputs are shifted to row i
+            SpmmEpilogue row_epi;
+            if (epi != NULL)
+            {
+                row_epi = *epi;
+                row_epi.row_bias = epi->row_bias != NULL ? epi->row_bias + i : NULL;
+            }
+            const uint8_t *p = idx.stream + idx.offsets[i];
+            MKL_INT k = rowIndex[i], ke = rowIndex[i + 1], col = -1;
+            float b = beta;
+            do
+            {
+                MKL_INT cnt = ke - k < SPMM_VARINT_CHUNK ? ke - k : SPMM_VARINT_CHUNK;
+                for (MKL_INT j = 0; j < cnt; j++)
+                    cols[j] = col = varint_next_column(p, col);
+                bool last = k + cnt == ke;
+                rows(0, 1, N, alpha, values + k, scales != NULL ? scales + i : NULL, cols, &zero, &cnt, B, ldb,
+                     b, C + (size_t)i * ldc, ldc, last && epi != NULL ? &row_epi : NULL);
+                b = 1.0f;
+                k += cnt;
+            } while (k < ke);
+        }
+    }
+}
+
+inline void spmm_csr_index(MKL_INT M, MKL_INT N, float alpha, const float *values, const CsrCompactIndex &idx,
+                           const MKL_INT *rowIndex, const float *B, MKL_INT ldb, float beta, float *C, MKL_INT ldc,
+                           const SpmmEpilogue *epi = NULL)
+{
+    spmm_csr_index_t(M, N, alpha, values, (const float *)NULL, idx, rowIndex, B, ldb, beta, C, ldc, epi);
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "spmm_kernel.hpp"
+
+// Reduced-precision CSR values. At typical pruning ratios SpMM is bound by
+// the values/columns streams, so storing values as bf16 or fp16 halves that
+// part of the traffic and int8 quarters it. The SpMM kernels widen the values
+// in registers and accumulate in fp32 (spmm_csr_t). int8 uses symmetric
+// per-row quantisation: v ~= q * scale[row], |q| <= 127.
+enum csr_value_type
+{
+    CSR_VALUE_F32,
+    CSR_VALUE_BF16,
+    CSR_VALUE_FP16,
+    CSR_VALUE_INT8
+};
+
+inline const char *csr_value_type_name(csr_value_type t)
+{
+    static const char *names[] = {"f32", "bf16", "fp16", "int8"};
+    return names[t];
+}
+
+inline size_t csr_value_size(csr_value_type t)
+{
+    static const size_t sizes[] = {4, 2, 2, 1};
+    return sizes[t];
+}
+
+// Round to nearest even; NaN stays NaN.
+inline spmm_bf16 to_bf16(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, 4);
+    spmm_bf16 h;
+    if ((u & 0x7fffffff) > 0x7f800000)
+        h.bits = (uint16_t)((u >> 16) | 0x40);
+    else
+        h.bits = (uint16_t)((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+    return h;
+}
+
+// Round to nearest even, overflow to infinity, gradual underflow.
+inline spmm_fp16 to_fp16(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, 4);
+    uint32_t sign = (u >> 16) & 0x8000;
+    u &= 0x7fffffff;
+    spmm_fp16 h;
+    if (u >= 0x7f800000)
+        h.bits = (uint16_t)(sign | 0x7c00 | (u > 0x7f800000 ? 0x200 : 0));
+    else if (u >= 0x477ff000) // rounds to 65520 or more
+        h.bits = (uint16_t)(sign | 0x7c00);
+    else if (u < 0x38800000) // below the smallest normal half, 2^-14: steps of 2^-24
+    {
+        float a;
+        memcpy(&a, &u, 4);
+        h.bits = (uint16_t)(sign | (uint32_t)nearbyintf(a * 16777216.0f));
+    }
+    else
+    {
+        uint32_t r = (((u >> 23) - 112) << 10) | ((u & 0x7fffff) >> 13);
+        uint32_t rest = u & 0x1fff;
+        if (rest > 0x1000 || (rest == 0x1000 && (r & 1)))
+            r++; // may carry into the exponent, which is still correct
+        h.bits = (uint16_t)(sign | r);
+    }
+    return h;
+}
+
+// Values of a zero-based CSR matrix re-encoded in a narrower type. rowIndex
+// and columns are not copied: use the ones of the fp32 source.
+struct CsrLowp
+{
+    csr_value_type type;
+    MKL_INT rows, nnz;
+    void *values;  // nnz entries of type
+    float *scales; // rows entries for CSR_VALUE_INT8, NULL otherwise
+
+    template <typename V>
+    const V *values_as() const { return (const V *)values; }
+
+    void release()
+    {
+        mkl_free(values);
+        mkl_free(scales);
+        values = NULL;
+        scales = NULL;
+    }
+};
+
+inline bool make_csr_lowp(const float *values, const MKL_INT *rowIndex, MKL_INT rows, csr_value_type type, CsrLowp &out)
+{
+    out.type = type;
+    out.rows = rows;
+    out.nnz = rowIndex[rows];
+    out.scales = NULL;
+    out.values = mkl_malloc(csr_value_size(type) * (out.nnz ? out.nnz : 1), 64);
+    if (type == CSR_VALUE_INT8)
+        out.scales = (float *)mkl_malloc(sizeof(float) * (rows ? rows : 1), 64);
+    if (out.values == NULL || (type == CSR_VALUE_INT8 && out.scales == NULL))
+    {
+        out.release();
+        return false;
+    }
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < rows; i++)
+    {
+        MKL_INT b = rowIndex[i], e = rowIndex[i + 1];
+        if (type == CSR_VALUE_F32)
+            memcpy((float *)out.values + b, values + b, sizeof(float) * (e - b));
+        else if (type == CSR_VALUE_BF16)
+            for (MKL_INT k = b; k < e; k++)
+                ((spmm_bf16 *)out.values)[k] = to_bf16(values[k]);
+        else if (type == CSR_VALUE_FP16)
+            for (MKL_INT k = b; k < e; k++)
+                ((spmm_fp16 *)out.values)[k] = to_fp16(values[k]);
+        else
+        {
+            float amax = 0;
+            for (MKL_INT k = b; k < e; k++)
+                amax = fmaxf(amax, fabsf(values[k]));
+            float scale = amax > 0 ? amax / 127.0f : 1.0f;
+            out.scales[i] = scale;
+            for (MKL_INT k = b; k < e; k++)
+            {
+                long q = lrintf(values[k] / scale);
+                ((int8_t *)out.values)[k] = (int8_t)(q > 127 ? 127 : q < -127 ? -127 : q);
+            }
+        }
+    }
+    return true;
+}
+
+// C = alpha * A * B + beta * C with A's values taken from a, its structure
+// from columns/pointerB/pointerE; see spmm_csr.
+inline void spmm_csr_lowp(MKL_INT M, MKL_INT N, float alpha, const CsrLowp &a, const MKL_INT *columns,
+                          const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                          float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi = NULL)
+{
+    switch (a.type)
+    {
+    case CSR_VALUE_F32:
+        spmm_csr_t(M, N, alpha, a.values_as<float>(), a.scales, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+        break;
+    case CSR_VALUE_BF16:
+        spmm_csr_t(M, N, alpha, a.values_as<spmm_bf16>(), a.scales, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+        break;
+    case CSR_VALUE_FP16:
+        spmm_csr_t(M, N, alpha, a.values_as<spmm_fp16>(), a.scales, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+        break;
+    case CSR_VALUE_INT8:
+        spmm_csr_t(M, N, alpha, a.values_as<int8_t>(), a.scales, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+        break;
+    }
+}
+
+// Bytes of the sparse operand: values, scales, columns and rowIndex.
+inline double csr_lowp_bytes(const CsrLowp &a)
+{
+    return (double)a.nnz * (csr_value_size(a.type) + sizeof(MKL_INT)) + (double)(a.rows + 1) * sizeof(MKL_INT) +
+           (a.scales != NULL ? (double)a.rows * sizeof(float) : 0.0);
+}
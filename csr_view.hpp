@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include "mkl.h"
+#include "mkl_spblas.h"
+#include "mkl_types.h"
+
+// Zero-copy sub-matrix of a zero-based CSR matrix: rows [row_begin,
+// row_begin + rows) and columns [col_begin, col_begin + cols) of the parent.
+//
+// Like the pointerE edit in Task 7 of example.cpp, the view shares the
+// parent's values/columns and only owns its pointerB/pointerE pair, which
+// point into those arrays. Row i of the view is parent row row_begin + i,
+// limited to the entries inside the column window. Column indices are
+// left as parent columns, so kernels taking a view read x/B by parent
+// column (only the window is touched) and write y/C by view row. Tiling a
+// matrix across threads or NUMA nodes, or running a block algorithm, costs
+// two MKL_INTs per row and tile instead of a copy of the nonzeros.
+//
+// A column window needs ascending columns within each row; a row range over
+// all columns does not.
+template <typename T>
+struct CsrView
+{
+    MKL_INT rows, cols;           // size of the view
+    MKL_INT row_begin, col_begin; // position in the parent
+    MKL_INT nnz;
+    const T *values;         // parent arrays, not owned
+    const MKL_INT *columns;
+    MKL_INT *pointerB, *pointerE; // owned, one per view row
+
+    CsrView() : rows(0), cols(0), row_begin(0), col_begin(0), nnz(0), values(NULL), columns(NULL), pointerB(NULL), pointerE(NULL) {}
+
+    MKL_INT col_end() const { return col_begin + cols; }
+    bool square_minor() const { return rows == cols && row_begin == col_begin; }
+
+    void release()
+    {
+        mkl_free(pointerB);
+        pointerB = pointerE = NULL;
+    }
+};
+
+// View of rows [r0, r1) x columns [c0, c1) of a parent in four-array form
+// (pointerB/pointerE relative to values/columns, e.g. rowptr and rowptr + 1,
+// or another view's arrays). False on a bad range or allocation failure.
+template <typename T>
+inline bool csr_view(const T *values, const MKL_INT *columns, const MKL_INT *pointerB, const MKL_INT *pointerE,
+                     MKL_INT parent_rows, MKL_INT parent_cols, MKL_INT r0, MKL_INT r1, MKL_INT c0, MKL_INT c1, CsrView<T> &out)
+{
+    if (r0 < 0 || r1 < r0 || r1 > parent_rows || c0 < 0 || c1 < c0 || c1 > parent_cols)
+        return false;
+    out.rows = r1 - r0;
+    out.cols = c1 - c0;
+    out.row_begin = r0;
+    out.col_begin = c0;
+    out.values = values;
+    out.columns = columns;
+    out.pointerB = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * 2 * (out.rows ? out.rows : 1), 64);
+    if (out.pointerB == NULL)
+        return false;
+    out.pointerE = out.pointerB + out.rows;
+    bool all_cols = c0 == 0 && c1 == parent_cols;
+    MKL_INT nnz = 0;
+#pragma omp parallel for schedule(static) reduction(+ : nnz)
+    for (MKL_INT i = 0; i < out.rows; i++)
+    {
+        const MKL_INT *b = columns + pointerB[r0 + i], *e = columns + pointerE[r0 + i];
+        if (!all_cols)
+        {
+            b = std::lower_bound(b, e, c0);
+            e = std::lower_bound(b, e, c1);
+        }
+        out.pointerB[i] = b - columns;
+        out.pointerE[i] = e - columns;
+        nnz += e - b;
+    }
+    out.nnz = nnz;
+    return true;
+}
+
+// View of a zero-based three-array CSR matrix.
+template <typename T>
+inline bool csr_view(const T *values, const MKL_INT *columns, const MKL_INT *rowptr, MKL_INT parent_rows, MKL_INT parent_cols,
+                     MKL_INT r0, MKL_INT r1, MKL_INT c0, MKL_INT c1, CsrView<T> &out)
+{
+    return csr_view(values, columns, rowptr, rowptr + 1, parent_rows, parent_cols, r0, r1, c0, c1, out);
+}
+
+// View of a view; offsets stay relative to the original parent.
+template <typename T>
+inline bool csr_subview(const CsrView<T> &v, MKL_INT r0, MKL_INT r1, MKL_INT c0, MKL_INT c1, CsrView<T> &out)
+{
+    if (c0 < 0 || c1 < c0 || c1 > v.cols)
+        return false;
+    if (!csr_view(v.values, v.columns, v.pointerB, v.pointerE, v.rows, v.col_end(), r0, r1, v.col_begin + c0, v.col_begin + c1, out))
+        return false;
+    out.row_begin += v.row_begin;
+    return true;
+}
+
+// MKL handle over the view's arrays, no copy. MKL sees rows x col_end()
+// (columns before the window are empty), so x/B are indexed by parent
+// column as for the native kernels. A leading minor (row_begin == col_begin
+// == 0) is square and can go to the triangular solvers.
+inline sparse_status_t csr_view_create_handle(const CsrView<double> &v, sparse_matrix_t *A)
+{
+    return mkl_sparse_d_create_csr(A, SPARSE_INDEX_BASE_ZERO, v.rows, v.col_end(), v.pointerB, v.pointerE,
+                                   (MKL_INT *)v.columns, (double *)v.values);
+}
+
+inline sparse_status_t csr_view_create_handle(const CsrView<float> &v, sparse_matrix_t *A)
+{
+    return mkl_sparse_s_create_csr(A, SPARSE_INDEX_BASE_ZERO, v.rows, v.col_end(), v.pointerB, v.pointerE,
+                                   (MKL_INT *)v.columns, (float *)v.values);
+}
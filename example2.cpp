@@ -1,29 +1,23 @@
 #include <iostream>
 #include <vector>
-#include <map>
+#include <string>
+#include <algorithm>
+#include <cmath>
 
 #include "mkl.h"
 #include "mkl_types.h"
 #include "mkl_spblas.h"
 
-#include "matrix_market.hpp"
 #include "benchmark-utils.hpp"
 #include "common.hpp"
-
-void set_1based_ind(int *rowptr, int *colidx, int n, int nnz)
-{
-    int i;
-    for(i=0; i <= n; i++)
-        rowptr[i]++;
-    for(i=0; i < nnz; i++)
-        colidx[i]++;
-}
+#include "csr_cache.hpp"
+#include "spgemm.hpp"
 
 int main(int argc, char **argv)
 {
   if (argc < 3)
   {
-    std::cerr << "Argument missing: [Matrix Market file] [flops]" << std::endl;
+    std::cerr << "Argument missing: [Matrix Market file] [flops] [sorted]" << std::endl;
     return EXIT_FAILURE;
   }
 
@@ -31,79 +25,163 @@ int main(int argc, char **argv)
   std::vector<double> timings(runs);
 
   double flops = atoi(argv[2]);
+  bool sorted = argc > 3 && std::string(argv[3]) == "sorted";
 
-  std::vector<std::map<unsigned int, double> > stl_A;
-
-  // Read matrix
-  if (!read_matrix_market_file(stl_A, argv[1]))
+  // Zero-based CSR arrays of A. They come either from the mapped
+  // "<file>.csrbin" cache (zero-copy, read-only) or from a fresh parse, after
+  // which the cache is written for the next run.
+  CsrMatrix mat;
+  if (!load_csr_cached(argv[1], mat))
   {
     std::cout << "Error reading Matrix file" << std::endl;
     return EXIT_FAILURE;
   }
+  MKL_INT N = mat.rows;
+  MKL_INT *row_handle_A = mat.rowptr, *col_handle_A = mat.colidx;
+  double *values_A = mat.values;
 
-  // convert to plain CSR arrays:
-  MKL_INT nnz = 0;
-  for (std::size_t row=0; row<stl_A.size(); ++row)
-    nnz += stl_A[row].size();
+  sparse_matrix_t A;
+  if (mkl_sparse_d_create_csr(&A, SPARSE_INDEX_BASE_ZERO, N, N, row_handle_A, row_handle_A + 1, col_handle_A, values_A) != SPARSE_STATUS_SUCCESS)
+  {
+    std::cerr << "CSR Sparse matrix created failed." << std::endl;
+    return EXIT_FAILURE;
+  }
+  matrix_descr descr;
+  descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+  descr.mode = SPARSE_FILL_MODE_LOWER;
+  descr.diag = SPARSE_DIAG_NON_UNIT;
 
+  Timer timer;
 
-  MKL_INT *row_handle_A = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (stl_A.size()+1), 128);
-  MKL_INT *row_handle_C = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (stl_A.size()+1), 128);
-  MKL_INT *col_handle_A = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * nnz, 128);
-  MKL_INT *col_handle_C;
-  double *values_A = (double *)mkl_malloc(sizeof(double) * nnz, 128);
-  double *values_C;
+  // Symbolic phase, once per sparsity pattern: NNZ_COUNT sizes C and leaves
+  // its row pointer in the handle C, FINALIZE_MULT_NO_VAL fills in C's column
+  // indices and allocates its arrays. While the pattern of A stays fixed, C
+  // (structure and buffers) is kept and only the numeric FINALIZE_MULT stage
+  // is repeated, which refills C's values in place without allocating.
+  sparse_matrix_t C = NULL;
+  timer.start();
+  sparse_status_t status = mkl_sparse_sp2m(SPARSE_OPERATION_NON_TRANSPOSE, descr, A, SPARSE_OPERATION_NON_TRANSPOSE, descr, A,
+                                           SPARSE_STAGE_NNZ_COUNT, &C);
+  if (status == SPARSE_STATUS_SUCCESS)
+    status = mkl_sparse_sp2m(SPARSE_OPERATION_NON_TRANSPOSE, descr, A, SPARSE_OPERATION_NON_TRANSPOSE, descr, A,
+                             SPARSE_STAGE_FINALIZE_MULT_NO_VAL, &C);
+  double symbolic = timer.get();
+  if (status != SPARSE_STATUS_SUCCESS)
+  {
+    std::cerr << "Symbolic SpGEMM failed" << std::endl;
+    return EXIT_FAILURE;
+  }
 
-  int current_index = 0;
-  for (std::size_t row=0; row<stl_A.size(); ++row)
+  for (std::size_t i=0; i<runs; ++i)
   {
-    row_handle_A[row] = current_index;
-    for (typename std::map<unsigned int, double>::const_iterator it = stl_A[row].begin(); it != stl_A[row].end(); ++it)
+    timer.start();
+    status = mkl_sparse_sp2m(SPARSE_OPERATION_NON_TRANSPOSE, descr, A, SPARSE_OPERATION_NON_TRANSPOSE, descr, A,
+                             SPARSE_STAGE_FINALIZE_MULT, &C);
+    timings[i] = timer.get();
+    if (status != SPARSE_STATUS_SUCCESS)
     {
-      col_handle_A[current_index] = it->first;
-      values_A[current_index] = it->second;
-      ++current_index;
+      std::cerr << "Numeric SpGEMM failed" << std::endl;
+      return EXIT_FAILURE;
     }
   }
-  row_handle_A[stl_A.size()] = current_index;
+  double numeric = get_median(timings);
 
-  set_1based_ind(row_handle_A, col_handle_A, stl_A.size(), nnz);
+  sparse_index_base_t base_C;
+  MKL_INT rows_C, cols_C;
+  MKL_INT *rows_start_C, *rows_end_C, *col_handle_C;
+  double *values_C;
+  if (mkl_sparse_d_export_csr(C, &base_C, &rows_C, &cols_C, &rows_start_C, &rows_end_C, &col_handle_C, &values_C) != SPARSE_STATUS_SUCCESS)
+  {
+    std::cerr << "Exporting C failed" << std::endl;
+    return EXIT_FAILURE;
+  }
+  MKL_INT nnz_C = rows_C > 0 ? rows_end_C[rows_C - 1] - rows_start_C[0] : 0;
 
-  Timer timer;
+  // One-shot product for comparison: symbolic + numeric + allocation of C every run
+  std::vector<double> full_timings(runs);
+  for (std::size_t i=0; i<runs; ++i)
+  {
+    sparse_matrix_t C_full = NULL;
+    timer.start();
+    status = mkl_sparse_spmm(SPARSE_OPERATION_NON_TRANSPOSE, A, A, &C_full);
+    full_timings[i] = timer.get();
+    if (status != SPARSE_STATUS_SUCCESS)
+    {
+      std::cerr << "SpGEMM failed" << std::endl;
+      return EXIT_FAILURE;
+    }
+    mkl_sparse_destroy(C_full);
+  }
 
-  MKL_INT sort = 0;
-  MKL_INT N = stl_A.size();
-  MKL_INT info = 0;
-  MKL_INT request;
-  //std::cout << "Starting benchmark... " << std::endl;
+  // In-house Gustavson SpGEMM (spgemm.hpp), same split: symbolic once, numeric repeated
+  SpgemmWorkspace<double> ws;
+  SpgemmCsr<double> G;
+  timer.start();
+  if (!spgemm_symbolic(row_handle_A, col_handle_A, N, row_handle_A, col_handle_A, N, G, ws))
+  {
+    std::cerr << "Host memory allocation failed!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  double gustavson_symbolic = timer.get();
   for (std::size_t i=0; i<runs; ++i)
   {
     timer.start();
-    request = 1;
-    mkl_dcsrmultcsr("n", &request, &sort, &N, &N, &N,
-                    values_A, col_handle_A, row_handle_A,
-                    values_A, col_handle_A, row_handle_A,
-                    values_C, col_handle_C, row_handle_C,
-                    &nnz, &info);
-    col_handle_C = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (row_handle_C[stl_A.size()]-1), 128);
-    values_C     = (double *)mkl_malloc(sizeof(double) * (row_handle_C[stl_A.size()]-1), 128);
-    request = 2;
-    mkl_dcsrmultcsr("n", &request, &sort, &N, &N, &N,
-                    values_A, col_handle_A, row_handle_A,
-                    values_A, col_handle_A, row_handle_A,
-                    values_C, col_handle_C, row_handle_C,
-                    &nnz, &info);
+    if (!spgemm_numeric(row_handle_A, col_handle_A, values_A, row_handle_A, col_handle_A, values_A, G, sorted, ws))
+    {
+      std::cerr << "Host memory allocation failed!" << std::endl;
+      return EXIT_FAILURE;
+    }
     timings[i] = timer.get();
-
-    mkl_free(values_C);
-    mkl_free(col_handle_C);
   }
-
-  mkl_free(row_handle_A);
-  mkl_free(col_handle_A);
-  mkl_free(values_A);
-
-  std::cout << stl_A.size() << " " << get_median(timings) << " " << double(flops) * 1e-3 / get_median(timings) << std::endl;
+  double gustavson_numeric = get_median(timings);
+  if (G.nnz != nnz_C)
+    std::cerr << "Gustavson nnz(C) " << G.nnz << " differs from MKL " << nnz_C << std::endl;
+  // Values against MKL's C, row by row; both rows are sorted by column first
+  // since neither side has to emit them in order.
+  double gustavson_diff = 0;
+  std::vector<std::pair<MKL_INT, double>> row_mkl, row_g;
+  for (MKL_INT i = 0; i < rows_C; ++i)
+  {
+    row_mkl.clear();
+    row_g.clear();
+    for (MKL_INT k = rows_start_C[i] - base_C; k < rows_end_C[i] - base_C; ++k)
+      row_mkl.push_back(std::make_pair(col_handle_C[k] - base_C, values_C[k]));
+    for (MKL_INT k = G.rowptr[i]; k < G.rowptr[i + 1]; ++k)
+      row_g.push_back(std::make_pair(G.colidx[k], G.values[k]));
+    std::sort(row_mkl.begin(), row_mkl.end());
+    std::sort(row_g.begin(), row_g.end());
+    if (row_mkl.size() != row_g.size())
+    {
+      std::cerr << "Gustavson row " << i << " has " << row_g.size() << " entries, MKL " << row_mkl.size() << std::endl;
+      gustavson_diff = INFINITY;
+      break;
+    }
+    for (std::size_t k = 0; k < row_g.size(); ++k)
+    {
+      if (row_g[k].first != row_mkl[k].first)
+      {
+        std::cerr << "Gustavson row " << i << " column pattern differs from MKL" << std::endl;
+        gustavson_diff = INFINITY;
+        break;
+      }
+      gustavson_diff = std::max(gustavson_diff, std::abs(row_g[k].second - row_mkl[k].second));
+    }
+    if (gustavson_diff == INFINITY)
+      break;
+  }
+  G.release();
+
+  mkl_sparse_destroy(C);
+  mkl_sparse_destroy(A);
+  mat.release();
+
+  std::cout << N << " " << numeric << " " << double(flops) * 1e-3 / numeric << std::endl;
+  std::cerr << "nnz(C) " << nnz_C << " symbolic " << symbolic << " numeric " << numeric
+            << " full " << get_median(full_timings) << std::endl;
+  std::cerr << "gustavson symbolic " << gustavson_symbolic << " numeric " << gustavson_numeric << " ("
+            << double(flops) * 1e-3 / gustavson_numeric << ") rows sort/hash/dense " << ws.rows(SPGEMM_ACC_SORT) << "/"
+            << ws.rows(SPGEMM_ACC_HASH) << "/" << ws.rows(SPGEMM_ACC_DENSE) << " max abs diff to MKL "
+            << gustavson_diff << std::endl;
 
   return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -65,17 +65,18 @@ int main()
     cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, 
                 m, n, k, alpha, A, k, B, n, beta, C, n);
     int niter = 10000;
-    clock_t t_start = clock();
+    // dsecnd is wall-clock time; clock() would add up the CPU time of all MKL threads
+    double t_start = dsecnd();
     for(int i=0;i<niter;i++){
         // printf("%d\n", i);
         cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, 
                 m, n, k, alpha, A, k, B, n, beta, C, n);
     }
+    double t_end = dsecnd();
+    double timecost = (t_end - t_start) * 1000 / niter;
     show(A, 100);
     show(B, 100);
     show(C, 100);
-    clock_t t_end = clock();
-    double timecost = (t_end - t_start) * 1.0 / CLOCKS_PER_SEC * 1000 / niter;
     printf("Time Cost: %lf \n", timecost);
 
     mkl_free(A);
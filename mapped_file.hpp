@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Read-only memory mapping of a whole file. The pages are brought in on demand
+// by the kernel, so nothing is read until it is touched.
+struct MappedFile
+{
+    const char *data;
+    size_t size;
+    int fd;
+
+    MappedFile() : data(NULL), size(0), fd(-1) {}
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // advice is passed to madvise, e.g. MADV_SEQUENTIAL for a single streaming pass
+    bool open(const char *path, int advice = MADV_NORMAL)
+    {
+        close();
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close();
+            return false;
+        }
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        data = (const char *)p;
+        size = st.st_size;
+        madvise(p, size, advice);
+        return true;
+    }
+
+    void close()
+    {
+        if (data != NULL)
+            munmap((void *)data, size);
+        if (fd >= 0)
+            ::close(fd);
+        data = NULL;
+        size = 0;
+        fd = -1;
+    }
+};
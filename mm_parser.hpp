@@ -0,0 +1,336 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <charconv>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "mapped_file.hpp"
+
+// Parallel Matrix Market (coordinate) reader producing zero-based CSR.
+//
+// The mapped file is cut into one chunk per thread at line boundaries and
+// each thread parses its chunk with from_chars into its own COO buffers.
+// The entries are then counting-sorted into CSR: a stable scatter into row
+// buckets followed by a per-bucket sort by row and column. Bucket order is
+// file order, so duplicate entries resolve exactly like the map-based reader
+// did (the last one in the file wins). Supports real/integer/pattern fields
+// and general/symmetric/skew-symmetric storage; symmetric inputs are expanded
+// to full storage unless the caller asks for the stored triangle only.
+struct MmCsr
+{
+    MKL_INT rows, cols, nnz;
+    MKL_INT *rowptr, *colidx;
+    double *values;
+    bool symmetric;
+
+    MmCsr() : rows(0), cols(0), nnz(0), rowptr(NULL), colidx(NULL), values(NULL), symmetric(false) {}
+
+    void release()
+    {
+        mkl_free(rowptr);
+        mkl_free(colidx);
+        mkl_free(values);
+        rowptr = colidx = NULL;
+        values = NULL;
+    }
+};
+
+struct MmCoo
+{
+    std::vector<MKL_INT> row, col;
+    std::vector<double> val;
+};
+
+inline const char *mm_skip_blank(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+inline const char *mm_next_line(const char *p, const char *end)
+{
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    return nl ? nl + 1 : end;
+}
+
+// Parses the data lines in [p, end). Returns false on a malformed or out-of-range entry.
+inline bool mm_parse_chunk(const char *p, const char *end, MKL_INT rows, MKL_INT cols, bool pattern,
+                           int symmetry, bool expand, MmCoo &out)
+{
+    while (p < end)
+    {
+        const char *line_end = (const char *)memchr(p, '\n', end - p);
+        if (line_end == NULL)
+            line_end = end;
+        p = mm_skip_blank(p, line_end);
+        if (p == line_end || *p == '%')
+        {
+            p = line_end + 1;
+            continue;
+        }
+        long long r, c;
+        double v = 1.0;
+        std::from_chars_result res = std::from_chars(p, line_end, r);
+        if (res.ec != std::errc())
+            return false;
+        res = std::from_chars(mm_skip_blank(res.ptr, line_end), line_end, c);
+        if (res.ec != std::errc())
+            return false;
+        if (!pattern)
+        {
+            res = std::from_chars(mm_skip_blank(res.ptr, line_end), line_end, v);
+            if (res.ec != std::errc())
+                return false;
+        }
+        if (r < 1 || r > rows || c < 1 || c > cols)
+            return false;
+        out.row.push_back(r - 1);
+        out.col.push_back(c - 1);
+        out.val.push_back(v);
+        if (symmetry != 0 && expand && r != c)
+        {
+            out.row.push_back(c - 1);
+            out.col.push_back(r - 1);
+            out.val.push_back(symmetry < 0 ? -v : v);
+        }
+        p = line_end + 1;
+    }
+    return true;
+}
+
+// expand_symmetric = false keeps only the stored triangle of symmetric inputs.
+inline bool read_matrix_market_csr(const char *path, MmCsr &out, bool expand_symmetric = true)
+{
+    MappedFile file;
+    if (!file.open(path, MADV_SEQUENTIAL))
+    {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    const char *p = file.data, *end = file.data + file.size;
+
+    // banner: %%MatrixMarket matrix coordinate <field> <symmetry>
+    const char *banner_end = mm_next_line(p, end);
+    std::string banner(p, banner_end);
+    for (size_t i = 0; i < banner.size(); i++)
+        banner[i] = tolower(banner[i]);
+    if (banner.compare(0, 14, "%%matrixmarket") != 0 || banner.find("coordinate") == std::string::npos ||
+        banner.find("complex") != std::string::npos || banner.find("hermitian") != std::string::npos)
+    {
+        fprintf(stderr, "%s: only real/integer/pattern coordinate Matrix Market files are supported\n", path);
+        return false;
+    }
+    bool pattern = banner.find("pattern") != std::string::npos;
+    int symmetry = banner.find("skew-symmetric") != std::string::npos ? -1 : banner.find("symmetric") != std::string::npos ? 1 : 0;
+
+    // comments, then the size line
+    p = banner_end;
+    for (const char *q = mm_skip_blank(p, end); q < end && (*q == '%' || *q == '\n'); q = mm_skip_blank(p, end))
+        p = mm_next_line(p, end);
+    long long rows, cols, entries;
+    const char *size_end = mm_next_line(p, end);
+    if (sscanf(std::string(p, size_end).c_str(), "%lld %lld %lld", &rows, &cols, &entries) != 3 || rows < 0 || cols < 0)
+    {
+        fprintf(stderr, "%s: bad size line\n", path);
+        return false;
+    }
+    p = size_end;
+
+    // one chunk per thread, each starting at a line boundary
+    int nthreads = omp_get_max_threads();
+    std::vector<const char *> cut(nthreads + 1);
+    cut[0] = p;
+    cut[nthreads] = end;
+    for (int t = 1; t < nthreads; t++)
+    {
+        const char *q = p + (size_t)(end - p) * t / nthreads;
+        cut[t] = std::max(cut[t - 1], q > p ? mm_next_line(q - 1, end) : p);
+    }
+    std::vector<MmCoo> coo(nthreads);
+    int bad = 0;
+#pragma omp parallel for schedule(static, 1) reduction(+ : bad)
+    for (int t = 0; t < nthreads; t++)
+    {
+        size_t guess = (cut[t + 1] - cut[t]) / 16 * (symmetry && expand_symmetric ? 2 : 1);
+        coo[t].row.reserve(guess);
+        coo[t].col.reserve(guess);
+        coo[t].val.reserve(guess);
+        bad += !mm_parse_chunk(cut[t], cut[t + 1], rows, cols, pattern, symmetry, expand_symmetric, coo[t]);
+    }
+    if (bad)
+    {
+        fprintf(stderr, "%s: malformed or out-of-range entry\n", path);
+        return false;
+    }
+    size_t total = 0;
+    for (int t = 0; t < nthreads; t++)
+        total += coo[t].row.size();
+
+    // buckets of 2^shift consecutive rows, a few hundred per thread
+    int shift = 0;
+    while (rows > 0 && ((rows - 1) >> shift) + 1 > 256LL * nthreads)
+        shift++;
+    size_t nbuckets = rows > 0 ? ((rows - 1) >> shift) + 1 : 0;
+    std::vector<size_t> hist((size_t)nthreads * nbuckets, 0);
+#pragma omp parallel for schedule(static, 1)
+    for (int t = 0; t < nthreads; t++)
+        for (size_t k = 0; k < coo[t].row.size(); k++)
+            hist[(size_t)t * nbuckets + (coo[t].row[k] >> shift)]++;
+    // bucket-major, thread-minor offsets keep entries of a bucket in file order
+    std::vector<size_t> bucket_start(nbuckets + 1, 0);
+    size_t off = 0;
+    for (size_t b = 0; b < nbuckets; b++)
+    {
+        bucket_start[b] = off;
+        for (int t = 0; t < nthreads; t++)
+        {
+            size_t cnt = hist[(size_t)t * nbuckets + b];
+            hist[(size_t)t * nbuckets + b] = off;
+            off += cnt;
+        }
+    }
+    bucket_start[nbuckets] = off;
+
+    out.rows = rows;
+    out.cols = cols;
+    out.symmetric = symmetry != 0;
+    out.rowptr = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (rows + 1), 128);
+    out.colidx = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (total ? total : 1), 128);
+    out.values = (double *)mkl_malloc(sizeof(double) * (total ? total : 1), 128);
+    MKL_INT *row_tmp = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (total ? total : 1), 128);
+    if (out.rowptr == NULL || out.colidx == NULL || out.values == NULL || row_tmp == NULL)
+    {
+        out.release();
+        mkl_free(row_tmp);
+        fprintf(stderr, "%s: host memory allocation failed\n", path);
+        return false;
+    }
+#pragma omp parallel for schedule(static, 1)
+    for (int t = 0; t < nthreads; t++)
+    {
+        size_t *pos = &hist[(size_t)t * nbuckets];
+        for (size_t k = 0; k < coo[t].row.size(); k++)
+        {
+            size_t dst = pos[coo[t].row[k] >> shift]++;
+            row_tmp[dst] = coo[t].row[k];
+            out.colidx[dst] = coo[t].col[k];
+            out.values[dst] = coo[t].val[k];
+        }
+        MmCoo().row.swap(coo[t].row);
+        MmCoo().col.swap(coo[t].col);
+        MmCoo().val.swap(coo[t].val);
+    }
+
+    // within each bucket: stable counting sort by row, then stable sort of
+    // every row by column and drop duplicates (keeping the later entry)
+    std::vector<MKL_INT> row_len(rows, 0);
+    size_t dups = 0;
+#pragma omp parallel reduction(+ : dups)
+    {
+        std::vector<MKL_INT> col_buf;
+        std::vector<double> val_buf;
+        std::vector<size_t> order;
+        std::vector<size_t> cursor;
+#pragma omp for schedule(dynamic, 1)
+        for (size_t b = 0; b < nbuckets; b++)
+        {
+            size_t bs = bucket_start[b], be = bucket_start[b + 1];
+            MKL_INT r0 = (MKL_INT)(b << shift), r1 = std::min<MKL_INT>(rows, (MKL_INT)((b + 1) << shift));
+            col_buf.assign(out.colidx + bs, out.colidx + be);
+            val_buf.assign(out.values + bs, out.values + be);
+            cursor.assign(r1 - r0 + 1, 0);
+            for (size_t k = bs; k < be; k++)
+                cursor[row_tmp[k] - r0 + 1]++;
+            for (MKL_INT r = 0; r < r1 - r0; r++)
+                cursor[r + 1] += cursor[r];
+            for (MKL_INT r = r0; r < r1; r++)
+                out.rowptr[r] = bs + cursor[r - r0];
+            for (size_t k = bs; k < be; k++)
+            {
+                size_t dst = bs + cursor[row_tmp[k] - r0]++;
+                out.colidx[dst] = col_buf[k - bs];
+                out.values[dst] = val_buf[k - bs];
+            }
+            for (MKL_INT r = r0; r < r1; r++)
+            {
+                size_t rs = out.rowptr[r], re = (r + 1 < r1) ? out.rowptr[r + 1] : be;
+                MKL_INT *c = out.colidx + rs;
+                double *v = out.values + rs;
+                size_t len = re - rs;
+                bool sorted = true;
+                for (size_t k = 1; k < len && sorted; k++)
+                    sorted = c[k - 1] < c[k];
+                if (!sorted)
+                {
+                    order.resize(len);
+                    for (size_t k = 0; k < len; k++)
+                        order[k] = k;
+                    std::stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) { return c[x] < c[y]; });
+                    col_buf.resize(std::max(col_buf.size(), len));
+                    val_buf.resize(std::max(val_buf.size(), len));
+                    for (size_t k = 0; k < len; k++)
+                    {
+                        col_buf[k] = c[order[k]];
+                        val_buf[k] = v[order[k]];
+                    }
+                    size_t w = 0;
+                    for (size_t k = 0; k < len; k++)
+                    {
+                        if (k + 1 < len && col_buf[k + 1] == col_buf[k])
+                            continue;
+                        c[w] = col_buf[k];
+                        v[w] = val_buf[k];
+                        w++;
+                    }
+                    dups += len - w;
+                    len = w;
+                }
+                row_len[r] = len;
+            }
+        }
+    }
+    mkl_free(row_tmp);
+
+    if (dups == 0)
+    {
+        out.rowptr[rows] = total;
+        out.nnz = total;
+        return true;
+    }
+    // duplicates left holes at the end of some rows: compact into fresh arrays
+    MKL_INT *rowptr = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (rows + 1), 128);
+    MKL_INT *colidx = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (total - dups ? total - dups : 1), 128);
+    double *values = (double *)mkl_malloc(sizeof(double) * (total - dups ? total - dups : 1), 128);
+    if (rowptr == NULL || colidx == NULL || values == NULL)
+    {
+        mkl_free(rowptr);
+        mkl_free(colidx);
+        mkl_free(values);
+        out.release();
+        fprintf(stderr, "%s: host memory allocation failed\n", path);
+        return false;
+    }
+    rowptr[0] = 0;
+    for (MKL_INT r = 0; r < rows; r++)
+        rowptr[r + 1] = rowptr[r] + row_len[r];
+#pragma omp parallel for schedule(static)
+    for (MKL_INT r = 0; r < rows; r++)
+    {
+        memcpy(colidx + rowptr[r], out.colidx + out.rowptr[r], sizeof(MKL_INT) * row_len[r]);
+        memcpy(values + rowptr[r], out.values + out.rowptr[r], sizeof(double) * row_len[r]);
+    }
+    out.release();
+    out.rowptr = rowptr;
+    out.colidx = colidx;
+    out.values = values;
+    out.nnz = rowptr[rows];
+    return true;
+}
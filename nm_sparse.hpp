@@ -0,0 +1,321 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <immintrin.h>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "spmm_kernel.hpp"
+
+// Structured N:M sparsity: every group of m consecutive columns of a row
+// holds at most n nonzeros (2:4, 4:8, ...). Each group stores exactly n
+// values plus the position of each value inside its group (one byte), so
+// the row of group g starts at a fixed offset and the inner SpMM loop has
+// a compile-time trip count: no row pointers, no column stream, no
+// data-dependent branches. Groups with fewer nonzeros are padded with zeros.
+struct NmMatrix
+{
+    MKL_INT rows, cols;
+    int n, m;
+    MKL_INT groups;  // cols / m per row
+    float *values;   // rows * groups * n
+    uint8_t *index;  // same layout, 0 <= index < m, ascending within a group
+
+    void release()
+    {
+        mkl_free(values);
+        mkl_free(index);
+        values = NULL;
+        index = NULL;
+    }
+};
+
+// Keeps the n largest magnitudes of every group of row (ties to the lower
+// column) and returns how many nonzeros had to be dropped.
+inline size_t nm_pack_row(const float *row, MKL_INT groups, int n, int m, float *values, uint8_t *index)
+{
+    size_t dropped = 0;
+    for (MKL_INT g = 0; g < groups; g++)
+    {
+        const float *grp = row + (size_t)g * m;
+        uint32_t taken = 0; // bitmask of kept positions, m <= 32
+        int nonzero = 0;
+        for (int j = 0; j < m; j++)
+            nonzero += grp[j] != 0.0f;
+        for (int t = 0; t < n; t++)
+        {
+            int best = -1;
+            for (int j = 0; j < m; j++)
+                if (!(taken & (1u << j)) && (best < 0 || fabsf(grp[j]) > fabsf(grp[best])))
+                    best = j;
+            taken |= 1u << best;
+        }
+        if (nonzero > n)
+            dropped += nonzero - n;
+        float *v = values + (size_t)g * n;
+        uint8_t *ix = index + (size_t)g * n;
+        for (int j = 0, t = 0; j < m; j++)
+        {
+            if (taken & (1u << j))
+            {
+                v[t] = grp[j];
+                ix[t] = (uint8_t)j;
+                t++;
+            }
+        }
+    }
+    return dropped;
+}
+
+inline bool nm_alloc(MKL_INT rows, MKL_INT cols, int n, int m, NmMatrix &out)
+{
+    if (m < 1 || m > 32 || n < 1 || n > m || cols % m != 0)
+        return false;
+    out.rows = rows;
+    out.cols = cols;
+    out.n = n;
+    out.m = m;
+    out.groups = cols / m;
+    size_t count = (size_t)rows * out.groups * n;
+    out.values = (float *)mkl_malloc(sizeof(float) * (count ? count : 1), 64);
+    out.index = (uint8_t *)mkl_malloc(count ? count : 1, 64);
+    if (out.values == NULL || out.index == NULL)
+    {
+        out.release();
+        return false;
+    }
+    return true;
+}
+
+// From a dense row-major rows x cols matrix; cols must be a multiple of m.
+// Input that is not already n:m is pruned by magnitude; *dropped counts the
+// nonzeros lost.
+inline bool dense_to_nm(const float *A, MKL_INT rows, MKL_INT cols, int n, int m, NmMatrix &out, size_t *dropped = NULL)
+{
+    if (!nm_alloc(rows, cols, n, m, out))
+        return false;
+    size_t lost = 0;
+#pragma omp parallel for schedule(static) reduction(+ : lost)
+    for (MKL_INT i = 0; i < rows; i++)
+    {
+        size_t off = (size_t)i * out.groups * n;
+        lost += nm_pack_row(A + (size_t)i * cols, out.groups, n, m, out.values + off, out.index + off);
+    }
+    if (dropped != NULL)
+        *dropped = lost;
+    return true;
+}
+
+// From zero-based CSR, same rules as dense_to_nm.
+inline bool csr_to_nm(const float *values, const MKL_INT *rowIndex, const MKL_INT *columns, MKL_INT rows, MKL_INT cols,
+                      int n, int m, NmMatrix &out, size_t *dropped = NULL)
+{
+    if (!nm_alloc(rows, cols, n, m, out))
+        return false;
+    size_t lost = 0;
+#pragma omp parallel reduction(+ : lost)
+    {
+        std::vector<float> row(cols, 0.0f);
+#pragma omp for schedule(static)
+        for (MKL_INT i = 0; i < rows; i++)
+        {
+            for (MKL_INT k = rowIndex[i]; k < rowIndex[i + 1]; k++)
+                row[columns[k]] = values[k];
+            size_t off = (size_t)i * out.groups * n;
+            lost += nm_pack_row(row.data(), out.groups, n, m, out.values + off, out.index + off);
+            for (MKL_INT k = rowIndex[i]; k < rowIndex[i + 1]; k++)
+                row[columns[k]] = 0.0f;
+        }
+    }
+    if (dropped != NULL)
+        *dropped = lost;
+    return true;
+}
+
+// Rows [r0, r1) of C = alpha * A * B + beta * C, arguments as for spmm_rows_fn.
+typedef void (*nm_rows_fn)(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const NmMatrix &A, const float *B, MKL_INT ldb,
+                           float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi);
+
+template <int NZ>
+inline void nm_rows_scalar(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const NmMatrix &A, const float *B, MKL_INT ldb,
+                           float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi)
+{
+    for (MKL_INT i = r0; i < r1; i++)
+    {
+        const float *v = A.values + (size_t)i * A.groups * NZ;
+        const uint8_t *ix = A.index + (size_t)i * A.groups * NZ;
+        float *c = C + (size_t)i * ldc;
+        for (MKL_INT n = 0; n < N; n++)
+            c[n] = beta == 0.0f ? 0.0f : beta * c[n];
+        for (MKL_INT g = 0; g < A.groups; g++)
+        {
+            for (int j = 0; j < NZ; j++)
+            {
+                const float *b = B + ((size_t)g * A.m + ix[g * NZ + j]) * ldb;
+                float a = alpha * v[g * NZ + j];
+                for (MKL_INT n = 0; n < N; n++)
+                    c[n] += a * b[n];
+            }
+        }
+        if (epi != NULL)
+        {
+            float rb = epi->row_bias != NULL ? epi->row_bias[i] : 0.0f;
+            for (MKL_INT n = 0; n < N; n++)
+                c[n] = spmm_epilogue_scalar(c[n], *epi, rb, n);
+        }
+    }
+}
+
+template <int NZ>
+__attribute__((target("avx2,fma,f16c"))) inline void nm_rows_avx2(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const NmMatrix &A, const float *B, MKL_INT ldb,
+                                                                  float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi)
+{
+    const __m256 va = _mm256_set1_ps(alpha), vb = _mm256_set1_ps(beta);
+    const __m256i all = _mm256_set1_epi32(-1);
+    const __m256i tail = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(N % 8)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    const bool accumulate = beta != 0.0f;
+    const size_t group_stride = (size_t)A.m * ldb;
+    for (MKL_INT i = r0; i < r1; i++)
+    {
+        const float *v = A.values + (size_t)i * A.groups * NZ;
+        const uint8_t *ix = A.index + (size_t)i * A.groups * NZ;
+        const __m256 rb = _mm256_set1_ps(epi != NULL && epi->row_bias != NULL ? epi->row_bias[i] : 0.0f);
+        float *c = C + (size_t)i * ldc;
+        MKL_INT n = 0;
+        for (; n + 32 <= N; n += 32)
+        {
+            __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps(), c2 = _mm256_setzero_ps(), c3 = _mm256_setzero_ps();
+            const float *bg = B + n;
+            for (MKL_INT g = 0; g < A.groups; g++, bg += group_stride)
+            {
+                for (int j = 0; j < NZ; j++)
+                {
+                    const float *b = bg + (size_t)ix[g * NZ + j] * ldb;
+                    __m256 a = _mm256_broadcast_ss(v + g * NZ + j);
+                    c0 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b), c0);
+                    c1 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b + 8), c1);
+                    c2 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b + 16), c2);
+                    c3 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b + 24), c3);
+                }
+            }
+            spmm_store_avx2(c, c0, va, vb, accumulate, all, epi, rb, n);
+            spmm_store_avx2(c, c1, va, vb, accumulate, all, epi, rb, n + 8);
+            spmm_store_avx2(c, c2, va, vb, accumulate, all, epi, rb, n + 16);
+            spmm_store_avx2(c, c3, va, vb, accumulate, all, epi, rb, n + 24);
+        }
+        for (; n < N; n += 8)
+        {
+            __m256i m = n + 8 <= N ? all : tail;
+            __m256 c0 = _mm256_setzero_ps();
+            const float *bg = B + n;
+            for (MKL_INT g = 0; g < A.groups; g++, bg += group_stride)
+                for (int j = 0; j < NZ; j++)
+                    c0 = _mm256_fmadd_ps(_mm256_broadcast_ss(v + g * NZ + j), _mm256_maskload_ps(bg + (size_t)ix[g * NZ + j] * ldb, m), c0);
+            spmm_store_avx2(c, c0, va, vb, accumulate, m, epi, rb, n);
+        }
+    }
+}
+
+template <int NZ>
+__attribute__((target("avx512f,f16c"))) inline void nm_rows_avx512(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const NmMatrix &A, const float *B, MKL_INT ldb,
+                                                                   float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi)
+{
+    const __m512 va = _mm512_set1_ps(alpha), vb = _mm512_set1_ps(beta);
+    const __mmask16 tail = (__mmask16)((1u << (N % 16)) - 1);
+    const bool accumulate = beta != 0.0f;
+    const size_t group_stride = (size_t)A.m * ldb;
+    for (MKL_INT i = r0; i < r1; i++)
+    {
+        const float *v = A.values + (size_t)i * A.groups * NZ;
+        const uint8_t *ix = A.index + (size_t)i * A.groups * NZ;
+        const __m512 rb = _mm512_set1_ps(epi != NULL && epi->row_bias != NULL ? epi->row_bias[i] : 0.0f);
+        float *c = C + (size_t)i * ldc;
+        MKL_INT n = 0;
+        for (; n + 64 <= N; n += 64)
+        {
+            __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps(), c2 = _mm512_setzero_ps(), c3 = _mm512_setzero_ps();
+            const float *bg = B + n;
+            for (MKL_INT g = 0; g < A.groups; g++, bg += group_stride)
+            {
+                for (int j = 0; j < NZ; j++)
+                {
+                    const float *b = bg + (size_t)ix[g * NZ + j] * ldb;
+                    __m512 a = _mm512_set1_ps(v[g * NZ + j]);
+                    c0 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b), c0);
+                    c1 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b + 16), c1);
+                    c2 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b + 32), c2);
+                    c3 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b + 48), c3);
+                }
+            }
+            spmm_store_avx512(c, c0, va, vb, accumulate, 0xffff, epi, rb, n);
+            spmm_store_avx512(c, c1, va, vb, accumulate, 0xffff, epi, rb, n + 16);
+            spmm_store_avx512(c, c2, va, vb, accumulate, 0xffff, epi, rb, n + 32);
+            spmm_store_avx512(c, c3, va, vb, accumulate, 0xffff, epi, rb, n + 48);
+        }
+        for (; n < N; n += 16)
+        {
+            __mmask16 m = n + 16 <= N ? (__mmask16)0xffff : tail;
+            __m512 c0 = _mm512_setzero_ps();
+            const float *bg = B + n;
+            for (MKL_INT g = 0; g < A.groups; g++, bg += group_stride)
+                for (int j = 0; j < NZ; j++)
+                    c0 = _mm512_fmadd_ps(_mm512_set1_ps(v[g * NZ + j]), _mm512_maskz_loadu_ps(m, bg + (size_t)ix[g * NZ + j] * ldb), c0);
+            spmm_store_avx512(c, c0, va, vb, accumulate, m, epi, rb, n);
+        }
+    }
+}
+
+template <int NZ>
+inline nm_rows_fn select_nm_rows()
+{
+    static const nm_rows_fn rows = spmm_has_avx512() ? nm_rows_avx512<NZ> : spmm_has_avx2() ? nm_rows_avx2<NZ> : nm_rows_scalar<NZ>;
+    return rows;
+}
+
+// n values spmm_nm has kernels for.
+inline bool spmm_nm_supported(int n)
+{
+    return n == 1 || n == 2 || n == 4 || n == 8;
+}
+
+// C (A.rows x N) = alpha * A * B + beta * C. Kernels are instantiated for
+// n = 1, 2, 4 and 8; false for any other n.
+inline bool spmm_nm(const NmMatrix &A, MKL_INT N, float alpha, const float *B, MKL_INT ldb, float beta, float *C, MKL_INT ldc,
+                    const SpmmEpilogue *epi = NULL)
+{
+    nm_rows_fn rows;
+    switch (A.n)
+    {
+    case 1:
+        rows = select_nm_rows<1>();
+        break;
+    case 2:
+        rows = select_nm_rows<2>();
+        break;
+    case 4:
+        rows = select_nm_rows<4>();
+        break;
+    case 8:
+        rows = select_nm_rows<8>();
+        break;
+    default:
+        return false;
+    }
+    MKL_INT nblocks = (A.rows + SPMM_ROW_BLOCK - 1) / SPMM_ROW_BLOCK;
+#pragma omp parallel for schedule(static)
+    for (MKL_INT blk = 0; blk < nblocks; blk++)
+    {
+        MKL_INT r0 = blk * SPMM_ROW_BLOCK;
+        MKL_INT r1 = r0 + SPMM_ROW_BLOCK < A.rows ? r0 + SPMM_ROW_BLOCK : A.rows;
+        rows(r0, r1, N, alpha, A, B, ldb, beta, C, ldc, epi);
+    }
+    return true;
+}
+
+// Bytes of the sparse operand: values and group positions.
+inline double nm_bytes(const NmMatrix &A)
+{
+    return (double)A.rows * A.groups * A.n * (sizeof(float) + sizeof(uint8_t));
+}
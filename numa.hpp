@@ -0,0 +1,281 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "spmm_kernel.hpp"
+
+// NUMA placement without libnuma: mbind and getcpu are called directly.
+//
+// Linux puts a page on the node of the thread that first writes it, so
+// operands filled by one thread (random_init, a serial copy) all land on
+// that thread's node and the other socket reads them across the
+// interconnect. The placements here are:
+//   naive       everything bound to the calling thread's node
+//   interleave  pages round-robin over all nodes (MPOL_INTERLEAVE)
+//   local       first-touched in parallel with the row partition the
+//               compute uses (numa_row_partition + spmm_csr_static)
+// and NumaSocketSpmm goes one step further: one CSR row slice and one B
+// replica per node, bound to it, computed by that node's threads. The
+// thread-to-node map is read once with getcpu, so threads must be pinned
+// (OMP_PROC_BIND, e.g. bench --affinity compact).
+//
+// On a single-node machine, or when mbind is not permitted, the bind and
+// interleave calls fail harmlessly and the first-touch paths still run.
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+const int NUMA_MAX_NODES = 64; // nodes addressable by the one-word node masks
+
+// Online nodes, from /sys ("0-1" or "0,2-3"); 1 when unknown.
+inline int numa_nodes()
+{
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (f == NULL)
+        return 1;
+    int last = 0, a, b;
+    char sep;
+    while (fscanf(f, "%d", &a) == 1)
+    {
+        b = a;
+        if (fscanf(f, "%c", &sep) == 1 && sep == '-' && fscanf(f, "%d", &b) == 1)
+            fscanf(f, "%c", &sep);
+        last = std::max(last, b);
+    }
+    fclose(f);
+    return std::min(last + 1, NUMA_MAX_NODES);
+}
+
+// Node of the CPU the calling thread runs on.
+inline int numa_current_node()
+{
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+    return (int)node;
+}
+
+// Fresh anonymous pages: nothing is placed until the first write, unlike
+// mkl_malloc, which may hand back memory an earlier buffer already touched.
+inline void *numa_alloc(size_t bytes)
+{
+    void *p = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+inline void numa_free(void *p, size_t bytes)
+{
+    if (p != NULL)
+        munmap(p, bytes ? bytes : 1);
+}
+
+inline bool numa_mbind(void *p, size_t bytes, int mode, unsigned long mask)
+{
+    if (p == NULL || bytes == 0)
+        return true;
+    return syscall(SYS_mbind, p, bytes, mode, &mask, (unsigned long)NUMA_MAX_NODES + 1, MPOL_MF_MOVE) == 0;
+}
+
+inline bool numa_interleave(void *p, size_t bytes, int nodes)
+{
+    unsigned long mask = nodes >= NUMA_MAX_NODES ? ~0UL : (1UL << nodes) - 1;
+    return numa_mbind(p, bytes, MPOL_INTERLEAVE, mask);
+}
+
+inline bool numa_bind(void *p, size_t bytes, int node)
+{
+    return numa_mbind(p, bytes, MPOL_BIND, 1UL << node);
+}
+
+// Rows split into parts with an equal share of rows + nonzeros each, the
+// partition both first touch and spmm_csr_static follow. bounds: parts + 1.
+inline void numa_row_partition(const MKL_INT *rowIndex, MKL_INT M, int parts, std::vector<MKL_INT> &bounds)
+{
+    bounds.resize(parts + 1);
+    const int64_t total = (int64_t)M + rowIndex[M] - rowIndex[0];
+    for (int t = 0; t <= parts; t++)
+    {
+        // first row r with r + nnz(rows < r) >= the target
+        int64_t target = total * t / parts;
+        MKL_INT lo = 0, hi = M;
+        while (lo < hi)
+        {
+            MKL_INT mid = lo + (hi - lo) / 2;
+            if (mid + (int64_t)(rowIndex[mid] - rowIndex[0]) < target)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        bounds[t] = lo;
+    }
+}
+
+// dst[r * row_len, ...) = src rows, thread t copying rows [bounds[t], bounds[t + 1]),
+// so each page is first touched by the thread that will use it.
+template <typename T>
+inline void numa_copy_rows(T *dst, const T *src, const MKL_INT *bounds, int parts, size_t row_len)
+{
+#pragma omp parallel num_threads(parts)
+    {
+        for (int t = omp_get_thread_num(); t < parts; t += omp_get_num_threads())
+            memcpy(dst + bounds[t] * row_len, src + bounds[t] * row_len, sizeof(T) * (bounds[t + 1] - bounds[t]) * row_len);
+    }
+}
+
+// One CSR row slice, B replica and partition per node; see the top of the file.
+class NumaSocketSpmm
+{
+public:
+    // The work is split into threads ranks, each owned by the node getcpu
+    // reports for the thread that runs it. A smaller team (OMP_DYNAMIC, a
+    // thread limit, nesting) runs several ranks per thread, like
+    // spmm_csr_static, so the result stays complete, only less local.
+    NumaSocketSpmm(const float *values, const MKL_INT *rowIndex, const MKL_INT *columns, MKL_INT M, MKL_INT K, MKL_INT N, int threads)
+        : K_(K), N_(N), threads_(threads), thread_node_(threads, 0), thread_rank_(threads, 0)
+    {
+        int nodes = numa_nodes();
+#pragma omp parallel num_threads(threads)
+        {
+            for (int t = omp_get_thread_num(); t < threads; t += omp_get_num_threads())
+                thread_node_[t] = std::min(numa_current_node(), nodes - 1);
+        }
+        // nodes with threads, in node order, each with its thread count
+        std::vector<int> count(nodes, 0), slot(nodes, -1);
+        for (int t = 0; t < threads; t++)
+            thread_rank_[t] = count[thread_node_[t]]++;
+        for (int n = 0; n < nodes; n++)
+        {
+            if (count[n] == 0)
+                continue;
+            slot[n] = parts_.size();
+            parts_.push_back(Part());
+            parts_.back().node = n;
+            parts_.back().threads = count[n];
+        }
+        for (int t = 0; t < threads; t++)
+            thread_node_[t] = slot[thread_node_[t]];
+        // rows go to nodes in proportion to their threads
+        std::vector<MKL_INT> per_thread;
+        numa_row_partition(rowIndex, M, threads, per_thread);
+        MKL_INT first = 0;
+        for (size_t s = 0; s < parts_.size(); s++)
+        {
+            Part &p = parts_[s];
+            p.r0 = per_thread[first];
+            first += p.threads;
+            p.r1 = per_thread[first];
+            if (!alloc_part(p, rowIndex))
+            {
+                release();
+                throw "NUMA partition allocation failed!";
+            }
+        }
+        // each node's threads copy their own rows of the slice
+#pragma omp parallel num_threads(threads)
+        {
+            for (int t = omp_get_thread_num(); t < threads; t += omp_get_num_threads())
+            {
+                Part &p = parts_[thread_node_[t]];
+                MKL_INT b = p.rowptr[p.bounds[thread_rank_[t]]], e = p.rowptr[p.bounds[thread_rank_[t] + 1]];
+                memcpy(p.columns + b, columns + rowIndex[p.r0] + b, sizeof(MKL_INT) * (e - b));
+                memcpy(p.values + b, values + rowIndex[p.r0] + b, sizeof(float) * (e - b));
+            }
+        }
+    }
+
+    ~NumaSocketSpmm() { release(); }
+    NumaSocketSpmm(const NumaSocketSpmm &) = delete;
+    NumaSocketSpmm &operator=(const NumaSocketSpmm &) = delete;
+
+    // C (M x N) = alpha * A * B + beta * C. B is first copied into every
+    // node's replica by that node's threads; the copy is part of the call.
+    // Every rank is run even when the team comes out smaller than asked.
+    void multiply(float alpha, const float *B, MKL_INT ldb, float beta, float *C, MKL_INT ldc)
+    {
+#pragma omp parallel num_threads(threads_)
+        {
+            const int first = omp_get_thread_num(), step = omp_get_num_threads();
+            for (int t = first; t < threads_; t += step)
+            {
+                Part &p = parts_[thread_node_[t]];
+                const int rank = thread_rank_[t];
+                for (MKL_INT k = (int64_t)K_ * rank / p.threads; k < (int64_t)K_ * (rank + 1) / p.threads; k++)
+                    memcpy(p.B + (size_t)k * N_, B + (size_t)k * ldb, sizeof(float) * N_);
+            }
+#pragma omp barrier
+            for (int t = first; t < threads_; t += step)
+            {
+                Part &p = parts_[thread_node_[t]];
+                const int rank = thread_rank_[t];
+                select_spmm_kernels().rows(p.bounds[rank], p.bounds[rank + 1], N_, alpha, p.values, p.columns, p.rowptr, p.rowptr + 1,
+                                           p.B, N_, beta, C + (size_t)p.r0 * ldc, ldc, NULL);
+            }
+        }
+    }
+
+    int nodes() const { return parts_.size(); }
+
+private:
+    struct Part
+    {
+        int node, threads;
+        MKL_INT r0, r1, nnz;
+        std::vector<MKL_INT> bounds; // threads + 1 rows, local to the slice
+        MKL_INT *rowptr, *columns;
+        float *values, *B;
+
+        Part() : node(0), threads(0), r0(0), r1(0), nnz(0), rowptr(NULL), columns(NULL), values(NULL), B(NULL) {}
+    };
+
+    // Allocates the slice and the B replica on p.node and fills the slice's rowptr.
+    bool alloc_part(Part &p, const MKL_INT *rowIndex)
+    {
+        MKL_INT rows = p.r1 - p.r0, k0 = rowIndex[p.r0];
+        p.nnz = rowIndex[p.r1] - k0;
+        p.rowptr = (MKL_INT *)numa_alloc(sizeof(MKL_INT) * (rows + 1));
+        p.columns = (MKL_INT *)numa_alloc(sizeof(MKL_INT) * p.nnz);
+        p.values = (float *)numa_alloc(sizeof(float) * p.nnz);
+        p.B = (float *)numa_alloc(sizeof(float) * (size_t)K_ * N_);
+        if (p.rowptr == NULL || p.columns == NULL || p.values == NULL || p.B == NULL)
+            return false;
+        numa_bind(p.rowptr, sizeof(MKL_INT) * (rows + 1), p.node);
+        numa_bind(p.columns, sizeof(MKL_INT) * p.nnz, p.node);
+        numa_bind(p.values, sizeof(float) * p.nnz, p.node);
+        numa_bind(p.B, sizeof(float) * (size_t)K_ * N_, p.node);
+        for (MKL_INT r = 0; r <= rows; r++)
+            p.rowptr[r] = rowIndex[p.r0 + r] - k0;
+        numa_row_partition(p.rowptr, rows, p.threads, p.bounds);
+        return true;
+    }
+
+    void release()
+    {
+        for (size_t s = 0; s < parts_.size(); s++)
+        {
+            Part &p = parts_[s];
+            numa_free(p.rowptr, sizeof(MKL_INT) * (p.r1 - p.r0 + 1));
+            numa_free(p.columns, sizeof(MKL_INT) * p.nnz);
+            numa_free(p.values, sizeof(float) * p.nnz);
+            numa_free(p.B, sizeof(float) * (size_t)K_ * N_);
+        }
+        parts_.clear();
+    }
+
+    MKL_INT K_, N_;
+    int threads_;
+    std::vector<int> thread_node_, thread_rank_; // per thread: index into parts_, rank within it
+    std::vector<Part> parts_;
+};
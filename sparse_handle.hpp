@@ -0,0 +1,180 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <map>
+#include "mkl.h"
+#include "mkl_spblas.h"
+#include "mkl_types.h"
+#include "bench_stats.hpp"
+#include "csr_cache.hpp"
+
+// Inspector-executor handle manager for zero-based float CSR matrices.
+//
+// mkl_sparse_set_mm_hint only records the expected workload; the analysis
+// and any internal reformatting happen in mkl_sparse_optimize. A handle is
+// created, hinted and optimized once per (sparsity pattern, values array,
+// op, layout, N) and reused by later calls with the same key. MKL keeps
+// pointers to the caller's CSR arrays, so they must outlive the cache (or
+// the matching release()); after updating the values in place call
+// release() so the next acquire() re-runs the analysis.
+
+// Hash of the shape and of the rowIndex/columns contents. Computed once per
+// weight matrix by the caller; O(nnz).
+inline uint64_t csr_pattern_hash(MKL_INT rows, MKL_INT cols, const MKL_INT *rowIndex, const MKL_INT *columns)
+{
+    uint64_t h = csr_cache_checksum((const char *)rowIndex, sizeof(MKL_INT) * (rows + 1));
+    h ^= csr_cache_checksum((const char *)columns, sizeof(MKL_INT) * rowIndex[rows]) * 0x9e3779b185ebca87ULL;
+    h ^= ((uint64_t)rows << 32) ^ (uint64_t)cols;
+    return h;
+}
+
+struct SparseMmKey
+{
+    uint64_t pattern;
+    const float *values;
+    sparse_operation_t op;
+    sparse_layout_t layout;
+    MKL_INT N;
+
+    bool operator<(const SparseMmKey &o) const
+    {
+        if (pattern != o.pattern)
+            return pattern < o.pattern;
+        if (values != o.values)
+            return values < o.values;
+        if (op != o.op)
+            return op < o.op;
+        if (layout != o.layout)
+            return layout < o.layout;
+        return N < o.N;
+    }
+};
+
+struct SparseHandle
+{
+    sparse_matrix_t handle;
+    matrix_descr descr;
+    double analysis_ms; // create + hint + optimize
+    long long calls;    // acquire() hits, including the first
+};
+
+class SparseHandleCache
+{
+public:
+    SparseHandleCache() : hits_(0), misses_(0) {}
+    ~SparseHandleCache() { clear(); }
+
+    // Optimized handle for C = op(A) * B with N dense columns, or NULL when
+    // MKL rejects the matrix. expected_calls is passed to the hint on a miss.
+    SparseHandle *acquire(uint64_t pattern, MKL_INT rows, MKL_INT cols, MKL_INT *rowIndex, MKL_INT *columns, float *values,
+                          sparse_operation_t op, sparse_layout_t layout, MKL_INT N, MKL_INT expected_calls = 1000)
+    {
+        SparseMmKey key = {pattern, values, op, layout, N};
+        std::map<SparseMmKey, SparseHandle>::iterator it = handles_.find(key);
+        if (it != handles_.end())
+        {
+            hits_++;
+            it->second.calls++;
+            return &it->second;
+        }
+        misses_++;
+        SparseHandle h;
+        h.descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+        h.descr.mode = SPARSE_FILL_MODE_LOWER;
+        h.descr.diag = SPARSE_DIAG_NON_UNIT;
+        h.calls = 1;
+        double start = wall_time();
+        if (mkl_sparse_s_create_csr(&h.handle, SPARSE_INDEX_BASE_ZERO, rows, cols, rowIndex, &(rowIndex[1]), columns, values) != SPARSE_STATUS_SUCCESS)
+            return NULL;
+        if (mkl_sparse_set_mm_hint(h.handle, op, h.descr, layout, N, expected_calls) != SPARSE_STATUS_SUCCESS ||
+            mkl_sparse_optimize(h.handle) != SPARSE_STATUS_SUCCESS)
+        {
+            mkl_sparse_destroy(h.handle);
+            return NULL;
+        }
+        h.analysis_ms = (wall_time() - start) * 1000.0;
+        return &(handles_[key] = h);
+    }
+
+    // Destroys every handle built for this values array.
+    void release(const float *values)
+    {
+        std::map<SparseMmKey, SparseHandle>::iterator it = handles_.begin();
+        while (it != handles_.end())
+        {
+            if (it->first.values == values)
+            {
+                mkl_sparse_destroy(it->second.handle);
+                handles_.erase(it++);
+            }
+            else
+                ++it;
+        }
+    }
+
+    void clear()
+    {
+        for (std::map<SparseMmKey, SparseHandle>::iterator it = handles_.begin(); it != handles_.end(); ++it)
+            mkl_sparse_destroy(it->second.handle);
+        handles_.clear();
+    }
+
+    size_t size() const { return handles_.size(); }
+    long long hits() const { return hits_; }
+    long long misses() const { return misses_; }
+
+private:
+    std::map<SparseMmKey, SparseHandle> handles_;
+    long long hits_, misses_;
+
+    SparseHandleCache(const SparseHandleCache &);
+    SparseHandleCache &operator=(const SparseHandleCache &);
+};
+
+// Analysis cost against per-call savings of an optimized handle.
+struct BreakEven
+{
+    double analysis_ms;  // create + hint + optimize
+    double plain_ms;     // median mkl_sparse_s_mm on an unoptimized handle
+    double optimized_ms; // median mkl_sparse_s_mm on the optimized handle
+    double calls;        // calls until the analysis pays off, INFINITY if it never does
+};
+
+// Times row-major C = A * B (B is cols x N, C is rows x N, C overwritten)
+// with a freshly created handle and with the optimized one.
+inline bool measure_break_even(const SparseHandle &opt, MKL_INT rows, MKL_INT cols, MKL_INT *rowIndex, MKL_INT *columns, float *values,
+                               const float *B, float *C, MKL_INT N, int warmup, int iters, BreakEven &be)
+{
+    sparse_matrix_t plain;
+    if (mkl_sparse_s_create_csr(&plain, SPARSE_INDEX_BASE_ZERO, rows, cols, rowIndex, &(rowIndex[1]), columns, values) != SPARSE_STATUS_SUCCESS)
+        return false;
+    LatencyStats lat;
+    bool ok = time_kernel([&]() {
+        return mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0f, plain, opt.descr, SPARSE_LAYOUT_ROW_MAJOR,
+                               B, N, N, 0.0f, C, N) == SPARSE_STATUS_SUCCESS;
+    }, warmup, iters, lat);
+    be.plain_ms = lat.median;
+    mkl_sparse_destroy(plain);
+    ok = ok && time_kernel([&]() {
+        return mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0f, opt.handle, opt.descr, SPARSE_LAYOUT_ROW_MAJOR,
+                               B, N, N, 0.0f, C, N) == SPARSE_STATUS_SUCCESS;
+    }, warmup, iters, lat);
+    if (!ok)
+        return false;
+    be.optimized_ms = lat.median;
+    be.analysis_ms = opt.analysis_ms;
+    double saving = be.plain_ms - be.optimized_ms;
+    be.calls = saving > 0 ? be.analysis_ms / saving : INFINITY;
+    return true;
+}
+
+inline void print_break_even(const BreakEven &be)
+{
+    printf("Analysis: %lf ms Plain: %lf ms/call Optimized: %lf ms/call ", be.analysis_ms, be.plain_ms, be.optimized_ms);
+    if (be.calls == INFINITY)
+        printf("Break-even: never\n");
+    else
+        printf("Break-even: %.0lf calls\n", ceil(be.calls));
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <string.h>
+#include <vector>
+#include <utility>
+#include "mkl.h"
+#include "mkl_spblas.h"
+#include "mkl_types.h"
+#include "spmm_kernel.hpp"
+
+// Long-lived sparse layer C = act(W * B + bias) for a fixed weight matrix W
+// (rows x cols) and a fixed number of dense columns N.
+//
+// All the one-off work happens in the constructor: the CSR arrays are packed
+// into one 64-byte aligned block owned by the layer (rowIndex, columns and
+// values back to back, so a forward pass streams a single allocation), the
+// bias is copied next to them, and for the MKL backend the handle is
+// created, hinted and optimized. forward() then only reads that state and
+// may be called concurrently from any number of threads on distinct B/C
+// buffers.
+//
+// threads == 1 runs the native kernel inline on the calling thread, which
+// is what a serving thread pool wants: that path does no heap allocation
+// and takes no locks. Other values enter an OpenMP region (native) or MKL's
+// threaded path, which give no such guarantee; 0 uses the OpenMP/MKL
+// defaults. The MKL backend applies threads through mkl_set_num_threads_local.
+class SparseLinear
+{
+public:
+    enum backend
+    {
+        NATIVE,
+        MKL
+    };
+
+    // From zero-based CSR arrays, e.g. convert_csr or load_mask output. The
+    // arrays are copied; the caller keeps ownership. bias (rows entries) may be NULL.
+    SparseLinear(const float *values, const MKL_INT *rowIndex, const MKL_INT *columns, MKL_INT rows, MKL_INT cols, MKL_INT N,
+                 backend b = NATIVE, const float *bias = NULL, spmm_activation act = SPMM_ACT_NONE, int threads = 0)
+        : rows_(rows), cols_(cols), N_(N), backend_(b), threads_(threads), block_(NULL), handle_(NULL)
+    {
+        pack(values, rowIndex, columns, bias);
+        epi_.row_bias = bias != NULL ? bias_ : NULL;
+        epi_.col_bias = NULL;
+        epi_.act = act;
+        fused_ = bias != NULL || act != SPMM_ACT_NONE;
+        if (backend_ == MKL)
+            optimize();
+    }
+
+    SparseLinear(const std::pair<std::vector<void *>, std::vector<unsigned long>> &csr, MKL_INT rows, MKL_INT cols, MKL_INT N,
+                 backend b = NATIVE, const float *bias = NULL, spmm_activation act = SPMM_ACT_NONE, int threads = 0)
+        : SparseLinear((const float *)csr.first[0], (const MKL_INT *)csr.first[1], (const MKL_INT *)csr.first[2], rows, cols, N, b, bias, act, threads)
+    {
+    }
+
+    ~SparseLinear()
+    {
+        if (handle_ != NULL)
+            mkl_sparse_destroy(handle_);
+        mkl_free(block_);
+    }
+
+    // C (rows x N) = act(W * B + bias), B is cols x N; both row-major with leading dimension N.
+    // False when the MKL call fails, C is then undefined.
+    bool forward(const float *B, float *C) const
+    {
+        if (backend_ == MKL)
+        {
+            // thread-local setting, restored afterwards; 0 means the global default
+            int prev = threads_ > 0 ? mkl_set_num_threads_local(threads_) : 0;
+            sparse_status_t status =
+                mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0f, handle_, descr_, SPARSE_LAYOUT_ROW_MAJOR, B, N_, N_, 0.0f, C, N_);
+            if (threads_ > 0)
+                mkl_set_num_threads_local(prev);
+            if (status != SPARSE_STATUS_SUCCESS)
+                return false;
+            if (fused_)
+                apply_epilogue(C);
+            return true;
+        }
+        const SpmmEpilogue *epi = fused_ ? &epi_ : NULL;
+        if (threads_ == 1)
+            select_spmm_kernels().rows(0, rows_, N_, 1.0f, values_, columns_, rowIndex_, rowIndex_ + 1, B, N_, 0.0f, C, N_, epi);
+        else
+            spmm_csr(rows_, N_, 1.0f, values_, columns_, rowIndex_, rowIndex_ + 1, B, N_, 0.0f, C, N_, epi);
+        return true;
+    }
+
+    MKL_INT rows() const { return rows_; }
+    MKL_INT cols() const { return cols_; }
+    MKL_INT nnz() const { return rowIndex_[rows_]; }
+    // Size of the packed block.
+    size_t bytes() const { return bytes_; }
+
+private:
+    MKL_INT rows_, cols_, N_;
+    backend backend_;
+    int threads_;
+    void *block_;
+    size_t bytes_;
+    MKL_INT *rowIndex_, *columns_;
+    float *values_, *bias_;
+    SpmmEpilogue epi_;
+    bool fused_;
+    sparse_matrix_t handle_;
+    matrix_descr descr_;
+
+    SparseLinear(const SparseLinear &);
+    SparseLinear &operator=(const SparseLinear &);
+
+    static size_t align64(size_t n) { return (n + 63) / 64 * 64; }
+
+    void pack(const float *values, const MKL_INT *rowIndex, const MKL_INT *columns, const float *bias)
+    {
+        size_t nnz = (size_t)rowIndex[rows_];
+        size_t off_columns = align64(sizeof(MKL_INT) * (rows_ + 1));
+        size_t off_values = off_columns + align64(sizeof(MKL_INT) * nnz);
+        size_t off_bias = off_values + align64(sizeof(float) * nnz);
+        bytes_ = off_bias + align64(sizeof(float) * rows_);
+        block_ = mkl_malloc(bytes_, 64);
+        if (block_ == NULL)
+            throw "Host memory allocation failed!";
+        char *base = (char *)block_;
+        rowIndex_ = (MKL_INT *)base;
+        columns_ = (MKL_INT *)(base + off_columns);
+        values_ = (float *)(base + off_values);
+        bias_ = (float *)(base + off_bias);
+        memcpy(rowIndex_, rowIndex, sizeof(MKL_INT) * (rows_ + 1));
+        // rows copied in parallel so the pages land where the threads run
+#pragma omp parallel for schedule(static)
+        for (MKL_INT i = 0; i < rows_; i++)
+        {
+            MKL_INT b = rowIndex[i], e = rowIndex[i + 1];
+            memcpy(columns_ + b, columns + b, sizeof(MKL_INT) * (e - b));
+            memcpy(values_ + b, values + b, sizeof(float) * (e - b));
+        }
+        if (bias != NULL)
+            memcpy(bias_, bias, sizeof(float) * rows_);
+    }
+
+    void optimize()
+    {
+        descr_.type = SPARSE_MATRIX_TYPE_GENERAL;
+        descr_.mode = SPARSE_FILL_MODE_LOWER;
+        descr_.diag = SPARSE_DIAG_NON_UNIT;
+        if (mkl_sparse_s_create_csr(&handle_, SPARSE_INDEX_BASE_ZERO, rows_, cols_, rowIndex_, rowIndex_ + 1, columns_, values_) != SPARSE_STATUS_SUCCESS)
+        {
+            handle_ = NULL;
+            mkl_free(block_);
+            throw "CSR Sparse matrix created failed.";
+        }
+        // a long-lived layer: tell the analysis to expect many calls
+        if (mkl_sparse_set_mm_hint(handle_, SPARSE_OPERATION_NON_TRANSPOSE, descr_, SPARSE_LAYOUT_ROW_MAJOR, N_, 1000000) != SPARSE_STATUS_SUCCESS ||
+            mkl_sparse_optimize(handle_) != SPARSE_STATUS_SUCCESS)
+        {
+            mkl_sparse_destroy(handle_);
+            handle_ = NULL;
+            mkl_free(block_);
+            throw "Analysis failed!!";
+        }
+    }
+
+    void apply_epilogue(float *C) const
+    {
+        if (threads_ == 1)
+            select_spmm_kernels().epilogue(0, rows_, N_, C, N_, epi_);
+        else
+            spmm_apply_epilogue(rows_, N_, C, N_, epi_);
+    }
+};
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_types.h"
+
+// Row-wise Gustavson SpGEMM, C = A * B, all zero-based CSR.
+//
+// Row i of C is the sum of the rows B[k] scaled by A[i, k]. Its nnz is
+// bounded by ub(i) = sum over k of nnz(B[k]), and ub picks the accumulator:
+//   ub <= SPGEMM_SORT_MAX            gather the products and sort/merge them
+//   ub >= colsB / SPGEMM_DENSE_DIV   dense array over all columns of B
+//   otherwise                        open-addressing hash table of 2 * ub slots
+// so the few huge rows of a power-law graph go to a dense accumulator while
+// the many short ones stay in cache. Scratch lives in one arena per thread
+// (SpgemmWorkspace), grown on demand and kept across rows and calls.
+//
+// spgemm_symbolic sizes C (rowptr); spgemm_numeric fills colidx/values and
+// can be repeated while the patterns of A and B stay the same. Columns of a
+// row come out ascending when sorted is set, in accumulator order otherwise.
+const MKL_INT SPGEMM_SORT_MAX = 32;
+const MKL_INT SPGEMM_DENSE_DIV = 16;
+const MKL_INT SPGEMM_ROW_CHUNK = 16; // rows per dynamic OpenMP work item
+
+enum spgemm_accumulator
+{
+    SPGEMM_ACC_SORT,
+    SPGEMM_ACC_HASH,
+    SPGEMM_ACC_DENSE,
+    SPGEMM_ACC_COUNT
+};
+
+template <typename T>
+struct SpgemmCsr
+{
+    MKL_INT rows, cols, nnz;
+    MKL_INT *rowptr, *colidx;
+    T *values;
+
+    void release()
+    {
+        mkl_free(rowptr);
+        mkl_free(colidx);
+        mkl_free(values);
+        rowptr = colidx = NULL;
+        values = NULL;
+    }
+};
+
+// Per-thread scratch. The dense accumulator is stamped rather than cleared:
+// mark[j] == stamp means column j is live in the current row.
+template <typename T>
+struct SpgemmArena
+{
+    std::vector<uint64_t> mark;
+    std::vector<T> dense;
+    std::vector<MKL_INT> touched, keys;
+    std::vector<T> vals;
+    std::vector<std::pair<MKL_INT, T>> pairs;
+    uint64_t stamp;
+    long long rows[SPGEMM_ACC_COUNT];
+
+    SpgemmArena() : stamp(0) {}
+};
+
+template <typename T>
+struct SpgemmWorkspace
+{
+    std::vector<SpgemmArena<T>> arenas;
+    std::vector<MKL_INT> ub;
+
+    // Rows handled by each accumulator in the last call.
+    long long rows(spgemm_accumulator acc) const
+    {
+        long long n = 0;
+        for (size_t t = 0; t < arenas.size(); t++)
+            n += arenas[t].rows[acc];
+        return n;
+    }
+};
+
+// Row i of A * B into (cols, vals) when Values, else only counted. Returns its nnz.
+template <bool Values, typename T>
+inline MKL_INT spgemm_row(MKL_INT i, MKL_INT ub, const MKL_INT *rowA, const MKL_INT *colA, const T *valA,
+                          const MKL_INT *rowB, const MKL_INT *colB, const T *valB, MKL_INT colsB, bool sorted,
+                          SpgemmArena<T> &ar, MKL_INT *cols, T *vals)
+{
+    MKL_INT n = 0;
+    if (ub <= SPGEMM_SORT_MAX)
+    {
+        ar.rows[SPGEMM_ACC_SORT]++;
+        std::pair<MKL_INT, T> *p = ar.pairs.data();
+        MKL_INT cnt = 0;
+        for (MKL_INT q = rowA[i]; q < rowA[i + 1]; q++)
+        {
+            MKL_INT k = colA[q];
+            for (MKL_INT r = rowB[k]; r < rowB[k + 1]; r++)
+                p[cnt++] = std::make_pair(colB[r], Values ? valA[q] * valB[r] : T(0));
+        }
+        std::sort(p, p + cnt, [](const std::pair<MKL_INT, T> &a, const std::pair<MKL_INT, T> &b) { return a.first < b.first; });
+        for (MKL_INT c = 0; c < cnt; c++)
+        {
+            if (c > 0 && p[c - 1].first == p[c].first)
+            {
+                if (Values)
+                    vals[n - 1] += p[c].second;
+                continue;
+            }
+            if (Values)
+            {
+                cols[n] = p[c].first;
+                vals[n] = p[c].second;
+            }
+            n++;
+        }
+        return n;
+    }
+
+    if ((int64_t)ub * SPGEMM_DENSE_DIV >= colsB)
+    {
+        ar.rows[SPGEMM_ACC_DENSE]++;
+        uint64_t stamp = ++ar.stamp;
+        ar.touched.clear();
+        for (MKL_INT q = rowA[i]; q < rowA[i + 1]; q++)
+        {
+            MKL_INT k = colA[q];
+            for (MKL_INT r = rowB[k]; r < rowB[k + 1]; r++)
+            {
+                MKL_INT j = colB[r];
+                if (ar.mark[j] != stamp)
+                {
+                    ar.mark[j] = stamp;
+                    ar.touched.push_back(j);
+                    if (Values)
+                        ar.dense[j] = valA[q] * valB[r];
+                }
+                else if (Values)
+                    ar.dense[j] += valA[q] * valB[r];
+            }
+        }
+        n = ar.touched.size();
+        if (Values)
+        {
+            if (sorted)
+                std::sort(ar.touched.begin(), ar.touched.end());
+            for (MKL_INT c = 0; c < n; c++)
+            {
+                cols[c] = ar.touched[c];
+                vals[c] = ar.dense[ar.touched[c]];
+            }
+        }
+        return n;
+    }
+
+    ar.rows[SPGEMM_ACC_HASH]++;
+    size_t size = 16;
+    while (size < 2 * (size_t)ub)
+        size *= 2;
+    if (ar.keys.size() < size)
+    {
+        ar.keys.resize(size);
+        ar.vals.resize(size);
+    }
+    MKL_INT *keys = ar.keys.data();
+    T *hv = ar.vals.data();
+    std::fill(keys, keys + size, (MKL_INT)-1);
+    const size_t mask = size - 1;
+    for (MKL_INT q = rowA[i]; q < rowA[i + 1]; q++)
+    {
+        MKL_INT k = colA[q];
+        for (MKL_INT r = rowB[k]; r < rowB[k + 1]; r++)
+        {
+            MKL_INT j = colB[r];
+            size_t h = ((uint64_t)j * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+            while (keys[h] != j && keys[h] != -1)
+                h = (h + 1) & mask;
+            if (keys[h] == -1)
+            {
+                keys[h] = j;
+                n++;
+                if (Values)
+                    hv[h] = valA[q] * valB[r];
+            }
+            else if (Values)
+                hv[h] += valA[q] * valB[r];
+        }
+    }
+    if (Values)
+    {
+        if (sorted)
+        {
+            std::pair<MKL_INT, T> *p = ar.pairs.data();
+            MKL_INT c = 0;
+            for (size_t h = 0; h < size; h++)
+                if (keys[h] != -1)
+                    p[c++] = std::make_pair(keys[h], hv[h]);
+            std::sort(p, p + c, [](const std::pair<MKL_INT, T> &a, const std::pair<MKL_INT, T> &b) { return a.first < b.first; });
+            for (c = 0; c < n; c++)
+            {
+                cols[c] = p[c].first;
+                vals[c] = p[c].second;
+            }
+        }
+        else
+        {
+            MKL_INT c = 0;
+            for (size_t h = 0; h < size; h++)
+                if (keys[h] != -1)
+                {
+                    cols[c] = keys[h];
+                    vals[c++] = hv[h];
+                }
+        }
+    }
+    return n;
+}
+
+// Sizes the arenas for the thread count and the widest row; ub is filled by the caller.
+template <typename T>
+inline void spgemm_prepare(SpgemmWorkspace<T> &ws, MKL_INT rowsA, MKL_INT colsB)
+{
+    int threads = omp_get_max_threads();
+    if ((int)ws.arenas.size() < threads)
+        ws.arenas.resize(threads);
+    MKL_INT max_ub = 0;
+    for (MKL_INT i = 0; i < rowsA; i++)
+        max_ub = std::max(max_ub, ws.ub[i]);
+    for (size_t t = 0; t < ws.arenas.size(); t++)
+        for (int a = 0; a < SPGEMM_ACC_COUNT; a++)
+            ws.arenas[t].rows[a] = 0;
+#pragma omp parallel num_threads(threads)
+    {
+        // each thread grows its own arena, so the pages are local to it
+        SpgemmArena<T> &ar = ws.arenas[omp_get_thread_num()];
+        if ((int64_t)max_ub * SPGEMM_DENSE_DIV >= colsB && ar.mark.size() < (size_t)colsB)
+        {
+            ar.mark.assign(colsB, 0);
+            ar.dense.resize(colsB);
+            ar.touched.reserve(colsB);
+        }
+        if (ar.pairs.size() < (size_t)max_ub)
+            ar.pairs.resize(std::max(max_ub, SPGEMM_SORT_MAX));
+    }
+}
+
+// C.rowptr for C = A * B (rowsA x colsB). Allocates C.rowptr; colidx and
+// values stay NULL until spgemm_numeric.
+template <typename T>
+inline bool spgemm_symbolic(const MKL_INT *rowA, const MKL_INT *colA, MKL_INT rowsA, const MKL_INT *rowB, const MKL_INT *colB,
+                            MKL_INT colsB, SpgemmCsr<T> &C, SpgemmWorkspace<T> &ws)
+{
+    C.rows = rowsA;
+    C.cols = colsB;
+    C.colidx = NULL;
+    C.values = NULL;
+    C.rowptr = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (rowsA + 1), 64);
+    if (C.rowptr == NULL)
+        return false;
+    ws.ub.resize(rowsA);
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < rowsA; i++)
+    {
+        MKL_INT ub = 0;
+        for (MKL_INT q = rowA[i]; q < rowA[i + 1]; q++)
+            ub += rowB[colA[q] + 1] - rowB[colA[q]];
+        ws.ub[i] = ub;
+    }
+    spgemm_prepare(ws, rowsA, colsB);
+    C.rowptr[0] = 0;
+#pragma omp parallel for schedule(dynamic, SPGEMM_ROW_CHUNK)
+    for (MKL_INT i = 0; i < rowsA; i++)
+        C.rowptr[i + 1] = spgemm_row<false, T>(i, ws.ub[i], rowA, colA, NULL, rowB, colB, NULL, colsB, false,
+                                               ws.arenas[omp_get_thread_num()], NULL, NULL);
+    for (MKL_INT i = 0; i < rowsA; i++)
+        C.rowptr[i + 1] += C.rowptr[i];
+    C.nnz = C.rowptr[rowsA];
+    return true;
+}
+
+// Fills C.colidx/C.values (allocated on the first call) for the rowptr of
+// spgemm_symbolic, which must have run on the same A and B patterns and ws.
+template <typename T>
+inline bool spgemm_numeric(const MKL_INT *rowA, const MKL_INT *colA, const T *valA, const MKL_INT *rowB, const MKL_INT *colB,
+                           const T *valB, SpgemmCsr<T> &C, bool sorted, SpgemmWorkspace<T> &ws)
+{
+    if (C.colidx == NULL)
+    {
+        C.colidx = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (C.nnz ? C.nnz : 1), 64);
+        C.values = (T *)mkl_malloc(sizeof(T) * (C.nnz ? C.nnz : 1), 64);
+        if (C.colidx == NULL || C.values == NULL)
+            return false;
+    }
+    spgemm_prepare(ws, C.rows, C.cols);
+#pragma omp parallel for schedule(dynamic, SPGEMM_ROW_CHUNK)
+    for (MKL_INT i = 0; i < C.rows; i++)
+        spgemm_row<true, T>(i, ws.ub[i], rowA, colA, valA, rowB, colB, valB, C.cols, sorted,
+                            ws.arenas[omp_get_thread_num()], C.colidx + C.rowptr[i], C.values + C.rowptr[i]);
+    return true;
+}
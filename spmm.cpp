@@ -7,9 +7,12 @@
 #include <typeinfo>
 #include <stdio.h>
 #include <iostream>
+#include <math.h>
 #include "mkl.h"
 #include "mkl_spblas.h"
 #include "mkl_types.h"
+#include "csr_convert.hpp"
+#include "spmm_kernel.hpp"
 using namespace std;
 
 void random_init(float *ptr, int size, float sparsity)
@@ -29,44 +32,6 @@ void random_init(float *ptr, int size, float sparsity)
 }
 
 
-pair<vector<void *>, vector<unsigned long>> convert_csr(float *src, int h, int w)
-{
-    vector<float> value;
-    vector<MKL_INT> row_idx;
-    vector<MKL_INT> col_idx;
-    MKL_INT pos;
-    for (MKL_INT i = 0; i < h; i++)
-    {
-        row_idx.push_back(value.size());
-        for (MKL_INT j = 0; j < w; j++)
-        {
-            pos = i * w + j;
-            if (src[pos] != 0.0)
-            {
-                value.push_back(src[pos]);
-                col_idx.push_back(j);
-            }
-        }
-    }
-    float *ptr_v = (float *)mkl_malloc(sizeof(float) * value.size(), 64);
-    MKL_INT *ptr_r = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * row_idx.size(), 64);
-    MKL_INT *ptr_c = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * col_idx.size(), 64);
-    if(ptr_v==NULL || ptr_r==NULL || ptr_c==NULL){
-        throw "Host memory allocation failed!";
-        printf("ptr_v is NULL!!!!\n");
-    }
-    // copy the data
-    for(int i=0; i<value.size(); i++) ptr_v[i] = value[i];
-    for(int i=0; i<row_idx.size(); i++) ptr_r[i] = row_idx[i];
-    for(int i=0; i<col_idx.size(); i++) ptr_c[i] = col_idx[i];
-    vector<void *> ptrs = {(void *)ptr_v, (void *)ptr_r, (void *)ptr_c};
-    // printf("ptr_v:%x\n", ptr_v);
-    // printf("ptrs[0]:%x\n",ptrs[0]);
-    // printf(" cpu value length: %ld", sizeof(float) * value.size());
-    vector<unsigned long> sizes = {value.size(), row_idx.size(), col_idx.size()};
-    return make_pair(ptrs, sizes);
-}
-
 void show(float * ptr, int size){
     for(int i=0;i<size;i++){
         printf("%f \n", ptr[i]);
@@ -94,9 +59,12 @@ int main(){
     random_init(A, m*k, sparsity);
     random_init(B, k*n, 0);
     
+    double convert_start = dsecnd();
     pair<vector<void *>, vector<unsigned long>> csr = convert_csr(A, m, k);
+    double convert_time = dsecnd() - convert_start;
     vector<void *> ptrs = csr.first;
     vector<unsigned long> sizes = csr.second;
+    printf("Convert Time: %lf ms Throughput: %lf GB/s ISA: %s\n", convert_time * 1000, convert_csr_bytes(m, k, sizes[0]) / convert_time * 1e-9, select_compress_kernels().isa);
     float * values = (float *)ptrs[0];
     MKL_INT * rowIndex = (MKL_INT *) ptrs[1];
     MKL_INT * columns = (MKL_INT *) ptrs[2];
@@ -104,19 +72,20 @@ int main(){
     char		transa, uplo, nonunit;
     char		matdescra[6];
 
-    transa = 't';
-    matdescra[0] = 't';
+    // general A * B, the product spmm_csr computes below
+    transa = 'n';
+    matdescra[0] = 'g';
     matdescra[1] = 'l';
     matdescra[2] = 'n';
     matdescra[3] = 'c';
-    mkl_scsrmm(&transa, &m, &n, &m, &alpha, matdescra, values, columns, rowIndex, &(rowIndex[1]), B, &n,  &beta, C, &n);
+    mkl_scsrmm(&transa, &m, &n, &k, &alpha, matdescra, values, columns, rowIndex, &(rowIndex[1]), B, &n,  &beta, C, &n);
     MKL_INT niter = 1;
-    clock_t t_start = clock();
+    double t_start = dsecnd();
     for(MKL_INT iter_id=0; iter_id<niter; iter_id+=1){
-        mkl_scsrmm(&transa, &m, &n, &m, &alpha, matdescra, values, columns, rowIndex, &(rowIndex[1]), B, &n,  &beta, C, &n);
+        mkl_scsrmm(&transa, &m, &n, &k, &alpha, matdescra, values, columns, rowIndex, &(rowIndex[1]), B, &n,  &beta, C, &n);
     }
-    clock_t t_end = clock();
-    double timecost = (t_end - t_start) * 1.0 / CLOCKS_PER_SEC * 1000 / niter;
+    double t_end = dsecnd();
+    double timecost = (t_end - t_start) * 1000 / niter;
 
     show(A, 100);
     show(B, 100);
@@ -124,6 +93,22 @@ int main(){
 
     printf("Time Cost: %lf Sparsity: %f \n", timecost, sparsity);
 
+    // in-house kernel, C = A * B, checked against the MKL result
+    float *C_native = (float *)mkl_malloc(m*n*sizeof(float), 64);
+    if (C_native != NULL) {
+        spmm_csr(m, n, alpha, values, columns, rowIndex, &(rowIndex[1]), B, n, beta, C_native, n);
+        t_start = dsecnd();
+        for(MKL_INT iter_id=0; iter_id<niter; iter_id+=1){
+            spmm_csr(m, n, alpha, values, columns, rowIndex, &(rowIndex[1]), B, n, beta, C_native, n);
+        }
+        t_end = dsecnd();
+        float max_err = 0;
+        for (size_t i = 0; i < (size_t)m * n; i++)
+            max_err = max(max_err, fabsf(C_native[i] - C[i]));
+        printf("Native Time Cost: %lf ISA: %s Max Abs Diff: %g\n", (t_end - t_start) * 1000 / niter, select_spmm_kernels().isa, max_err);
+        mkl_free(C_native);
+    }
+
     mkl_free(A);
     mkl_free(B);
     mkl_free(C);
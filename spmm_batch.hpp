@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "spmm_kernel.hpp"
+
+// Batched SpMM over many small CSR matrices (attention heads, experts).
+//
+// Looping over the batch with one library call per matrix pays a fork/join
+// and dispatch per matrix, and a 64-row matrix cannot keep every core busy
+// anyway. Instead the rows of the whole batch are laid end to end, weighted
+// by the work they carry (nonzeros times N, plus the C row store), and cut
+// into one contiguous range per thread, so a single parallel region covers
+// the batch and every thread gets the same amount of work. Ranges may span
+// matrices and split a matrix between threads.
+
+// One product C = alpha * A * B + beta * C, arguments as for spmm_csr;
+// epilogue may be NULL.
+struct SpmmBatchItem
+{
+    MKL_INT M, N;
+    float alpha;
+    const float *values;
+    const MKL_INT *columns, *pointerB, *pointerE;
+    const float *B;
+    MKL_INT ldb;
+    float beta;
+    float *C;
+    MKL_INT ldc;
+    const SpmmEpilogue *epilogue;
+};
+
+// Rows [r0, r1) of one item.
+struct SpmmBatchChunk
+{
+    size_t item;
+    MKL_INT r0, r1;
+};
+
+// Chunks of thread t are chunks[begin[t] .. begin[t + 1]). A plan only
+// depends on the row lengths and N of the items, so it can be reused for as
+// long as those stay the same.
+struct SpmmBatchPlan
+{
+    int threads;
+    std::vector<size_t> begin;
+    std::vector<SpmmBatchChunk> chunks;
+};
+
+inline double spmm_batch_row_cost(const SpmmBatchItem &it, MKL_INT i)
+{
+    return (double)(it.pointerE[i] - it.pointerB[i] + 1) * it.N;
+}
+
+inline void spmm_batch_plan(const SpmmBatchItem *items, size_t count, int threads, SpmmBatchPlan &plan)
+{
+    if (threads < 1)
+        threads = 1;
+    double total = 0;
+    for (size_t b = 0; b < count; b++)
+        for (MKL_INT i = 0; i < items[b].M; i++)
+            total += spmm_batch_row_cost(items[b], i);
+
+    plan.threads = threads;
+    plan.begin.assign(threads + 1, 0);
+    plan.chunks.clear();
+    double target = total / threads, acc = 0;
+    int t = 0;
+    for (size_t b = 0; b < count; b++)
+    {
+        MKL_INT r0 = 0;
+        for (MKL_INT i = 0; i < items[b].M; i++)
+        {
+            acc += spmm_batch_row_cost(items[b], i);
+            // a heavy row may cross several thresholds; the threads skipped get no rows
+            while (t + 1 < threads && acc >= target * (t + 1))
+            {
+                if (r0 <= i)
+                {
+                    SpmmBatchChunk c = {b, r0, i + 1};
+                    plan.chunks.push_back(c);
+                    r0 = i + 1;
+                }
+                plan.begin[++t] = plan.chunks.size();
+            }
+        }
+        if (r0 < items[b].M)
+        {
+            SpmmBatchChunk c = {b, r0, items[b].M};
+            plan.chunks.push_back(c);
+        }
+    }
+    for (int u = t + 1; u <= threads; u++)
+        plan.begin[u] = plan.chunks.size();
+}
+
+inline void spmm_batch_run(const SpmmBatchItem *items, const SpmmBatchPlan &plan)
+{
+    const spmm_rows_fn rows = select_spmm_kernels().rows;
+#pragma omp parallel num_threads(plan.threads)
+    {
+        // the runtime may grant fewer threads than planned; survivors take over
+        int nth = omp_get_num_threads();
+        for (int t = omp_get_thread_num(); t < plan.threads; t += nth)
+        {
+            for (size_t c = plan.begin[t]; c < plan.begin[t + 1]; c++)
+            {
+                const SpmmBatchChunk &ch = plan.chunks[c];
+                const SpmmBatchItem &it = items[ch.item];
+                rows(ch.r0, ch.r1, it.N, it.alpha, it.values, it.columns, it.pointerB, it.pointerE,
+                     it.B, it.ldb, it.beta, it.C, it.ldc, it.epilogue);
+            }
+        }
+    }
+}
+
+// Plans and runs the batch on all OpenMP threads.
+inline void spmm_batch(const SpmmBatchItem *items, size_t count)
+{
+    SpmmBatchPlan plan;
+    spmm_batch_plan(items, count, omp_get_max_threads(), plan);
+    spmm_batch_run(items, plan);
+}
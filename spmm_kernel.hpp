@@ -0,0 +1,540 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <immintrin.h>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "csr_view.hpp"
+
+// Native CSR x dense SpMM: C = alpha * A * B + beta * C with A zero-based CSR
+// (MKL's four-array form, so pointerB/pointerE may describe a sub-matrix) and
+// B, C row-major with leading dimensions ldb, ldc.
+//
+// Each row of C is produced one strip of N at a time: the strip's
+// accumulators stay in vector registers while every nonzero a(i, k) is
+// broadcast and multiplied into row k of B. B rows a few nonzeros ahead are
+// prefetched by column index, since their addresses are only known from the
+// columns array. Rows are handed to threads in blocks.
+//
+// An optional epilogue (bias, activation) is applied to each strip in
+// registers right before it is stored, saving a separate pass over C.
+//
+// When beta == 0, C is written without being read, so it may be uninitialised.
+//
+// The row kernels are templates on the stored value type (float, spmm_bf16,
+// spmm_fp16 or int8_t) and on the column index type (MKL_INT or uint16_t);
+// narrow values are widened in registers and all arithmetic is fp32. scales, when not NULL, holds one factor per row that
+// multiplies the row's accumulated sum (int8 quantisation).
+
+enum spmm_activation
+{
+    SPMM_ACT_NONE,
+    SPMM_ACT_RELU,
+    SPMM_ACT_GELU // tanh approximation
+};
+
+// c = act(alpha * A * B + beta * c + row_bias[i] + col_bias[j]); either bias may be NULL.
+struct SpmmEpilogue
+{
+    const float *row_bias; // M entries
+    const float *col_bias; // N entries
+    spmm_activation act;
+};
+
+// Raw 16-bit encodings; distinct types so the kernels can overload on them.
+struct spmm_bf16
+{
+    uint16_t bits;
+};
+
+struct spmm_fp16
+{
+    uint16_t bits;
+};
+
+inline float spmm_value(const float *v) { return *v; }
+inline float spmm_value(const int8_t *v) { return (float)*v; }
+
+inline float spmm_value(const spmm_bf16 *v)
+{
+    uint32_t u = (uint32_t)v->bits << 16;
+    float f;
+    memcpy(&f, &u, 4);
+    return f;
+}
+
+inline float spmm_value(const spmm_fp16 *v)
+{
+    uint32_t sign = (uint32_t)(v->bits & 0x8000) << 16, exp = (v->bits >> 10) & 0x1f, man = v->bits & 0x3ff, u;
+    if (exp == 0x1f)
+        u = sign | 0x7f800000 | (man << 13); // inf / nan
+    else if (exp != 0)
+        u = sign | ((exp + 112) << 23) | (man << 13);
+    else if (man == 0)
+        u = sign;
+    else
+    {
+        // subnormal half: renormalise
+        exp = 113;
+        while ((man & 0x400) == 0)
+        {
+            man <<= 1;
+            exp--;
+        }
+        u = sign | (exp << 23) | ((man & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &u, 4);
+    return f;
+}
+
+typedef void (*spmm_rows_fn)(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const float *values, const MKL_INT *columns,
+                             const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                             float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi);
+
+// Applies an epilogue to rows [r0, r1) of an existing C (the unfused path).
+typedef void (*spmm_epilogue_fn)(MKL_INT r0, MKL_INT r1, MKL_INT N, float *C, MKL_INT ldc, const SpmmEpilogue &epi);
+
+const MKL_INT SPMM_ROW_BLOCK = 16; // rows per OpenMP work item
+const MKL_INT SPMM_PREFETCH = 8;   // nonzeros of look-ahead for B row prefetch
+
+// 0.5 x (1 + tanh(u)) with u = sqrt(2/pi) (x + 0.044715 x^3), written as
+// x / (1 + e) with e = exp(-2u) so the vector versions only need exp.
+const float SPMM_GELU_K0 = -1.5957691216f; // -2 * sqrt(2/pi)
+const float SPMM_GELU_K1 = 0.044715f;
+
+inline float spmm_gelu(float x)
+{
+    float e = expf(fminf(fmaxf(SPMM_GELU_K0 * (x + SPMM_GELU_K1 * x * x * x), -88.0f), 88.0f));
+    return x / (1.0f + e);
+}
+
+inline float spmm_epilogue_scalar(float r, const SpmmEpilogue &epi, float rb, MKL_INT n)
+{
+    r += rb;
+    if (epi.col_bias != NULL)
+        r += epi.col_bias[n];
+    if (epi.act == SPMM_ACT_RELU)
+        r = r > 0.0f ? r : 0.0f;
+    else if (epi.act == SPMM_ACT_GELU)
+        r = spmm_gelu(r);
+    return r;
+}
+
+template <typename V, typename I>
+inline void spmm_rows_scalar_t(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const V *values, const float *scales, const I *columns,
+                               const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                               float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi)
+{
+    for (MKL_INT i = r0; i < r1; i++)
+    {
+        float *c = C + (size_t)i * ldc;
+        float row_alpha = scales != NULL ? alpha * scales[i] : alpha;
+        for (MKL_INT n = 0; n < N; n++)
+            c[n] = beta == 0.0f ? 0.0f : beta * c[n];
+        for (MKL_INT k = pointerB[i]; k < pointerE[i]; k++)
+        {
+            const float *b = B + (size_t)columns[k] * ldb;
+            float a = row_alpha * spmm_value(values + k);
+            for (MKL_INT n = 0; n < N; n++)
+                c[n] += a * b[n];
+        }
+        if (epi != NULL)
+        {
+            float rb = epi->row_bias != NULL ? epi->row_bias[i] : 0.0f;
+            for (MKL_INT n = 0; n < N; n++)
+                c[n] = spmm_epilogue_scalar(c[n], *epi, rb, n);
+        }
+    }
+}
+
+inline void spmm_rows_scalar(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const float *values, const MKL_INT *columns,
+                             const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                             float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi)
+{
+    spmm_rows_scalar_t<float, MKL_INT>(r0, r1, N, alpha, values, NULL, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+}
+
+inline void spmm_epilogue_rows_scalar(MKL_INT r0, MKL_INT r1, MKL_INT N, float *C, MKL_INT ldc, const SpmmEpilogue &epi)
+{
+    for (MKL_INT i = r0; i < r1; i++)
+    {
+        float rb = epi.row_bias != NULL ? epi.row_bias[i] : 0.0f;
+        for (MKL_INT n = 0; n < N; n++)
+            C[(size_t)i * ldc + n] = spmm_epilogue_scalar(C[(size_t)i * ldc + n], epi, rb, n);
+    }
+}
+
+// Cephes-style expf: 2^n * p(r), r = x - n ln2, inputs clamped to +-88.
+__attribute__((target("avx2,fma,f16c"))) inline __m256 spmm_exp_avx2(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-88.0f)), _mm256_set1_ps(88.0f));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    // 2^n by building the exponent field; n >= -127 keeps it a valid (possibly tiny) float
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx2,fma,f16c"))) inline __m256 spmm_epilogue_avx2(__m256 r, const SpmmEpilogue &epi, __m256 rb, MKL_INT n, __m256i m)
+{
+    r = _mm256_add_ps(r, rb);
+    if (epi.col_bias != NULL)
+        r = _mm256_add_ps(r, _mm256_maskload_ps(epi.col_bias + n, m));
+    if (epi.act == SPMM_ACT_RELU)
+        r = _mm256_max_ps(r, _mm256_setzero_ps());
+    else if (epi.act == SPMM_ACT_GELU)
+    {
+        __m256 x3 = _mm256_mul_ps(_mm256_mul_ps(r, r), r);
+        __m256 u = _mm256_mul_ps(_mm256_set1_ps(SPMM_GELU_K0), _mm256_fmadd_ps(_mm256_set1_ps(SPMM_GELU_K1), x3, r));
+        __m256 e = spmm_exp_avx2(u);
+        r = _mm256_div_ps(r, _mm256_add_ps(e, _mm256_set1_ps(1.0f)));
+    }
+    return r;
+}
+
+// c = epilogue(alpha * acc (+ beta * c)) on the lanes selected by m.
+__attribute__((target("avx2,fma,f16c"))) inline void spmm_store_avx2(float *c, __m256 acc, __m256 va, __m256 vb, bool accumulate, __m256i m,
+                                                                const SpmmEpilogue *epi, __m256 rb, MKL_INT n)
+{
+    __m256 r = _mm256_mul_ps(acc, va);
+    if (accumulate)
+        r = _mm256_fmadd_ps(vb, _mm256_maskload_ps(c + n, m), r);
+    if (epi != NULL)
+        r = spmm_epilogue_avx2(r, *epi, rb, n, m);
+    _mm256_maskstore_ps(c + n, m, r);
+}
+
+__attribute__((target("avx2,fma,f16c"))) inline __m256 spmm_broadcast_avx2(const float *v) { return _mm256_broadcast_ss(v); }
+__attribute__((target("avx2,fma,f16c"))) inline __m256 spmm_broadcast_avx2(const int8_t *v) { return _mm256_set1_ps((float)*v); }
+__attribute__((target("avx2,fma,f16c"))) inline __m256 spmm_broadcast_avx2(const spmm_bf16 *v) { return _mm256_castsi256_ps(_mm256_set1_epi32((int)((uint32_t)v->bits << 16))); }
+__attribute__((target("avx2,fma,f16c"))) inline __m256 spmm_broadcast_avx2(const spmm_fp16 *v) { return _mm256_set1_ps(_cvtsh_ss(v->bits)); }
+
+template <typename V, typename I>
+__attribute__((target("avx2,fma,f16c"))) inline void spmm_rows_avx2_t(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const V *values, const float *scales, const I *columns,
+                                                                      const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                                                                      float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi)
+{
+    const __m256 vb = _mm256_set1_ps(beta);
+    const __m256i all = _mm256_set1_epi32(-1);
+    const __m256i tail = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(N % 8)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    const bool accumulate = beta != 0.0f;
+    for (MKL_INT i = r0; i < r1; i++)
+    {
+        const MKL_INT kb = pointerB[i], ke = pointerE[i];
+        const __m256 va = _mm256_set1_ps(scales != NULL ? alpha * scales[i] : alpha);
+        const __m256 rb = _mm256_set1_ps(epi != NULL && epi->row_bias != NULL ? epi->row_bias[i] : 0.0f);
+        float *c = C + (size_t)i * ldc;
+        MKL_INT n = 0;
+        // 32-wide strips: four accumulators
+        for (; n + 32 <= N; n += 32)
+        {
+            __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps(), c2 = _mm256_setzero_ps(), c3 = _mm256_setzero_ps();
+            for (MKL_INT k = kb; k < ke; k++)
+            {
+                if (k + SPMM_PREFETCH < ke)
+                {
+                    const char *pf = (const char *)(B + (size_t)columns[k + SPMM_PREFETCH] * ldb + n);
+                    _mm_prefetch(pf, _MM_HINT_T0);
+                    _mm_prefetch(pf + 64, _MM_HINT_T0);
+                }
+                const float *b = B + (size_t)columns[k] * ldb + n;
+                __m256 a = spmm_broadcast_avx2(values + k);
+                c0 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b), c0);
+                c1 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b + 8), c1);
+                c2 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b + 16), c2);
+                c3 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b + 24), c3);
+            }
+            spmm_store_avx2(c, c0, va, vb, accumulate, all, epi, rb, n);
+            spmm_store_avx2(c, c1, va, vb, accumulate, all, epi, rb, n + 8);
+            spmm_store_avx2(c, c2, va, vb, accumulate, all, epi, rb, n + 16);
+            spmm_store_avx2(c, c3, va, vb, accumulate, all, epi, rb, n + 24);
+        }
+        for (; n < N; n += 8)
+        {
+            __m256i m = n + 8 <= N ? all : tail;
+            __m256 c0 = _mm256_setzero_ps();
+            for (MKL_INT k = kb; k < ke; k++)
+                c0 = _mm256_fmadd_ps(spmm_broadcast_avx2(values + k), _mm256_maskload_ps(B + (size_t)columns[k] * ldb + n, m), c0);
+            spmm_store_avx2(c, c0, va, vb, accumulate, m, epi, rb, n);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma,f16c"))) inline void spmm_rows_avx2(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const float *values, const MKL_INT *columns,
+                                                                    const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                                                                    float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi)
+{
+    spmm_rows_avx2_t<float, MKL_INT>(r0, r1, N, alpha, values, NULL, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+}
+
+__attribute__((target("avx2,fma,f16c"))) inline void spmm_epilogue_rows_avx2(MKL_INT r0, MKL_INT r1, MKL_INT N, float *C, MKL_INT ldc, const SpmmEpilogue &epi)
+{
+    const __m256i all = _mm256_set1_epi32(-1);
+    const __m256i tail = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(N % 8)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    for (MKL_INT i = r0; i < r1; i++)
+    {
+        const __m256 rb = _mm256_set1_ps(epi.row_bias != NULL ? epi.row_bias[i] : 0.0f);
+        float *c = C + (size_t)i * ldc;
+        for (MKL_INT n = 0; n < N; n += 8)
+        {
+            __m256i m = n + 8 <= N ? all : tail;
+            _mm256_maskstore_ps(c + n, m, spmm_epilogue_avx2(_mm256_maskload_ps(c + n, m), epi, rb, n, m));
+        }
+    }
+}
+
+__attribute__((target("avx512f,f16c"))) inline __m512 spmm_exp_avx512(__m512 x)
+{
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-88.0f)), _mm512_set1_ps(88.0f));
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), r);
+    __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+    p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+    return _mm512_scalef_ps(p, n);
+}
+
+__attribute__((target("avx512f,f16c"))) inline __m512 spmm_epilogue_avx512(__m512 r, const SpmmEpilogue &epi, __m512 rb, MKL_INT n, __mmask16 m)
+{
+    r = _mm512_add_ps(r, rb);
+    if (epi.col_bias != NULL)
+        r = _mm512_add_ps(r, _mm512_maskz_loadu_ps(m, epi.col_bias + n));
+    if (epi.act == SPMM_ACT_RELU)
+        r = _mm512_max_ps(r, _mm512_setzero_ps());
+    else if (epi.act == SPMM_ACT_GELU)
+    {
+        __m512 x3 = _mm512_mul_ps(_mm512_mul_ps(r, r), r);
+        __m512 u = _mm512_mul_ps(_mm512_set1_ps(SPMM_GELU_K0), _mm512_fmadd_ps(_mm512_set1_ps(SPMM_GELU_K1), x3, r));
+        __m512 e = spmm_exp_avx512(u);
+        r = _mm512_div_ps(r, _mm512_add_ps(e, _mm512_set1_ps(1.0f)));
+    }
+    return r;
+}
+
+__attribute__((target("avx512f,f16c"))) inline void spmm_store_avx512(float *c, __m512 acc, __m512 va, __m512 vb, bool accumulate, __mmask16 m,
+                                                                 const SpmmEpilogue *epi, __m512 rb, MKL_INT n)
+{
+    __m512 r = _mm512_mul_ps(acc, va);
+    if (accumulate)
+        r = _mm512_fmadd_ps(vb, _mm512_maskz_loadu_ps(m, c + n), r);
+    if (epi != NULL)
+        r = spmm_epilogue_avx512(r, *epi, rb, n, m);
+    _mm512_mask_storeu_ps(c + n, m, r);
+}
+
+__attribute__((target("avx512f,f16c"))) inline __m512 spmm_broadcast_avx512(const float *v) { return _mm512_set1_ps(*v); }
+__attribute__((target("avx512f,f16c"))) inline __m512 spmm_broadcast_avx512(const int8_t *v) { return _mm512_set1_ps((float)*v); }
+__attribute__((target("avx512f,f16c"))) inline __m512 spmm_broadcast_avx512(const spmm_bf16 *v) { return _mm512_castsi512_ps(_mm512_set1_epi32((int)((uint32_t)v->bits << 16))); }
+__attribute__((target("avx512f,f16c"))) inline __m512 spmm_broadcast_avx512(const spmm_fp16 *v) { return _mm512_set1_ps(_cvtsh_ss(v->bits)); }
+
+template <typename V, typename I>
+__attribute__((target("avx512f,f16c"))) inline void spmm_rows_avx512_t(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const V *values, const float *scales, const I *columns,
+                                                                       const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                                                                       float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi)
+{
+    const __m512 vb = _mm512_set1_ps(beta);
+    const __mmask16 tail = (__mmask16)((1u << (N % 16)) - 1);
+    const bool accumulate = beta != 0.0f;
+    for (MKL_INT i = r0; i < r1; i++)
+    {
+        const MKL_INT kb = pointerB[i], ke = pointerE[i];
+        const __m512 va = _mm512_set1_ps(scales != NULL ? alpha * scales[i] : alpha);
+        const __m512 rb = _mm512_set1_ps(epi != NULL && epi->row_bias != NULL ? epi->row_bias[i] : 0.0f);
+        float *c = C + (size_t)i * ldc;
+        MKL_INT n = 0;
+        // 64-wide strips: four accumulators, one cache line of B each
+        for (; n + 64 <= N; n += 64)
+        {
+            __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps(), c2 = _mm512_setzero_ps(), c3 = _mm512_setzero_ps();
+            for (MKL_INT k = kb; k < ke; k++)
+            {
+                if (k + SPMM_PREFETCH < ke)
+                {
+                    const char *pf = (const char *)(B + (size_t)columns[k + SPMM_PREFETCH] * ldb + n);
+                    _mm_prefetch(pf, _MM_HINT_T0);
+                    _mm_prefetch(pf + 64, _MM_HINT_T0);
+                    _mm_prefetch(pf + 128, _MM_HINT_T0);
+                    _mm_prefetch(pf + 192, _MM_HINT_T0);
+                }
+                const float *b = B + (size_t)columns[k] * ldb + n;
+                __m512 a = spmm_broadcast_avx512(values + k);
+                c0 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b), c0);
+                c1 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b + 16), c1);
+                c2 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b + 32), c2);
+                c3 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b + 48), c3);
+            }
+            spmm_store_avx512(c, c0, va, vb, accumulate, 0xffff, epi, rb, n);
+            spmm_store_avx512(c, c1, va, vb, accumulate, 0xffff, epi, rb, n + 16);
+            spmm_store_avx512(c, c2, va, vb, accumulate, 0xffff, epi, rb, n + 32);
+            spmm_store_avx512(c, c3, va, vb, accumulate, 0xffff, epi, rb, n + 48);
+        }
+        for (; n < N; n += 16)
+        {
+            __mmask16 m = n + 16 <= N ? (__mmask16)0xffff : tail;
+            __m512 c0 = _mm512_setzero_ps();
+            for (MKL_INT k = kb; k < ke; k++)
+                c0 = _mm512_fmadd_ps(spmm_broadcast_avx512(values + k), _mm512_maskz_loadu_ps(m, B + (size_t)columns[k] * ldb + n), c0);
+            spmm_store_avx512(c, c0, va, vb, accumulate, m, epi, rb, n);
+        }
+    }
+}
+
+__attribute__((target("avx512f,f16c"))) inline void spmm_rows_avx512(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const float *values, const MKL_INT *columns,
+                                                                     const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                                                                     float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi)
+{
+    spmm_rows_avx512_t<float, MKL_INT>(r0, r1, N, alpha, values, NULL, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+}
+
+__attribute__((target("avx512f,f16c"))) inline void spmm_epilogue_rows_avx512(MKL_INT r0, MKL_INT r1, MKL_INT N, float *C, MKL_INT ldc, const SpmmEpilogue &epi)
+{
+    const __mmask16 tail = (__mmask16)((1u << (N % 16)) - 1);
+    for (MKL_INT i = r0; i < r1; i++)
+    {
+        const __m512 rb = _mm512_set1_ps(epi.row_bias != NULL ? epi.row_bias[i] : 0.0f);
+        float *c = C + (size_t)i * ldc;
+        for (MKL_INT n = 0; n < N; n += 16)
+        {
+            __mmask16 m = n + 16 <= N ? (__mmask16)0xffff : tail;
+            _mm512_mask_storeu_ps(c + n, m, spmm_epilogue_avx512(_mm512_maskz_loadu_ps(m, c + n), epi, rb, n, m));
+        }
+    }
+}
+
+// The vector kernels widen fp16 with F16C, present on every AVX2/AVX-512 part
+// in practice but checked anyway.
+inline bool spmm_has_avx512()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("f16c");
+}
+
+inline bool spmm_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+}
+
+// Picks the widest row kernel the running CPU supports; resolved once per process.
+struct spmm_kernels
+{
+    spmm_rows_fn rows;
+    spmm_epilogue_fn epilogue;
+    const char *isa;
+};
+
+inline const spmm_kernels &select_spmm_kernels()
+{
+    static const spmm_kernels k = []() -> spmm_kernels {
+        if (spmm_has_avx512())
+            return {spmm_rows_avx512, spmm_epilogue_rows_avx512, "avx512"};
+        if (spmm_has_avx2())
+            return {spmm_rows_avx2, spmm_epilogue_rows_avx2, "avx2"};
+        return {spmm_rows_scalar, spmm_epilogue_rows_scalar, "scalar"};
+    }();
+    return k;
+}
+
+// C (M x N) = alpha * A * B + beta * C, rows of A split across OpenMP threads.
+// epi, when given, is fused into the stores.
+inline void spmm_csr(MKL_INT M, MKL_INT N, float alpha, const float *values, const MKL_INT *columns,
+                     const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                     float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi = NULL)
+{
+    const spmm_rows_fn rows = select_spmm_kernels().rows;
+    MKL_INT nblocks = (M + SPMM_ROW_BLOCK - 1) / SPMM_ROW_BLOCK;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (MKL_INT blk = 0; blk < nblocks; blk++)
+    {
+        MKL_INT r0 = blk * SPMM_ROW_BLOCK;
+        MKL_INT r1 = r0 + SPMM_ROW_BLOCK < M ? r0 + SPMM_ROW_BLOCK : M;
+        rows(r0, r1, N, alpha, values, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+    }
+}
+
+// spmm_csr over a fixed partition: thread t of a team of parts threads
+// computes rows [bounds[t], bounds[t + 1]). Used when operands were first
+// touched with the same partition (numa.hpp), which the dynamic schedule of
+// spmm_csr would not respect. A smaller team takes several parts per thread.
+inline void spmm_csr_static(const MKL_INT *bounds, int parts, MKL_INT N, float alpha, const float *values, const MKL_INT *columns,
+                            const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                            float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi = NULL)
+{
+    const spmm_rows_fn rows = select_spmm_kernels().rows;
+#pragma omp parallel num_threads(parts)
+    {
+        for (int t = omp_get_thread_num(); t < parts; t += omp_get_num_threads())
+            rows(bounds[t], bounds[t + 1], N, alpha, values, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+    }
+}
+
+// spmm_csr on a view: C (A.rows x N) = alpha * A * B + beta * C, with B
+// indexed by parent column.
+inline void spmm_csr(const CsrView<float> &A, MKL_INT N, float alpha, const float *B, MKL_INT ldb,
+                     float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi = NULL)
+{
+    spmm_csr(A.rows, N, alpha, A.values, A.columns, A.pointerB, A.pointerE, B, ldb, beta, C, ldc, epi);
+}
+
+// Row kernel for value type V and column index type I, chosen like select_spmm_kernels.
+template <typename V, typename I>
+using spmm_rows_t_fn = void (*)(MKL_INT r0, MKL_INT r1, MKL_INT N, float alpha, const V *values, const float *scales, const I *columns,
+                                const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                                float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi);
+
+template <typename V, typename I>
+inline spmm_rows_t_fn<V, I> select_spmm_rows()
+{
+    static const spmm_rows_t_fn<V, I> rows = spmm_has_avx512() ? spmm_rows_avx512_t<V, I> : spmm_has_avx2() ? spmm_rows_avx2_t<V, I> : spmm_rows_scalar_t<V, I>;
+    return rows;
+}
+
+// spmm_csr for reduced-precision values with optional per-row scales and
+// narrow (e.g. uint16_t) column indices.
+template <typename V, typename I>
+inline void spmm_csr_t(MKL_INT M, MKL_INT N, float alpha, const V *values, const float *scales, const I *columns,
+                       const MKL_INT *pointerB, const MKL_INT *pointerE, const float *B, MKL_INT ldb,
+                       float beta, float *C, MKL_INT ldc, const SpmmEpilogue *epi = NULL)
+{
+    const spmm_rows_t_fn<V, I> rows = select_spmm_rows<V, I>();
+    MKL_INT nblocks = (M + SPMM_ROW_BLOCK - 1) / SPMM_ROW_BLOCK;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (MKL_INT blk = 0; blk < nblocks; blk++)
+    {
+        MKL_INT r0 = blk * SPMM_ROW_BLOCK;
+        MKL_INT r1 = r0 + SPMM_ROW_BLOCK < M ? r0 + SPMM_ROW_BLOCK : M;
+        rows(r0, r1, N, alpha, values, scales, columns, pointerB, pointerE, B, ldb, beta, C, ldc, epi);
+    }
+}
+
+// Separate pass applying epi to an M x N C, e.g. after an MKL SpMM.
+inline void spmm_apply_epilogue(MKL_INT M, MKL_INT N, float *C, MKL_INT ldc, const SpmmEpilogue &epi)
+{
+    const spmm_epilogue_fn rows = select_spmm_kernels().epilogue;
+    MKL_INT nblocks = (M + SPMM_ROW_BLOCK - 1) / SPMM_ROW_BLOCK;
+#pragma omp parallel for schedule(static)
+    for (MKL_INT blk = 0; blk < nblocks; blk++)
+    {
+        MKL_INT r0 = blk * SPMM_ROW_BLOCK;
+        MKL_INT r1 = r0 + SPMM_ROW_BLOCK < M ? r0 + SPMM_ROW_BLOCK : M;
+        rows(r0, r1, N, C, ldc, epi);
+    }
+}
@@ -0,0 +1,264 @@
+// Out-of-core SpMM benchmark.
+//
+// A is streamed from a csrbin file in row panels (spmm_ooc.hpp) while the
+// dense B (cols x N, random) stays in memory and C is written panel by
+// panel to a raw float file. A .mtx input goes through its "<file>.csrbin"
+// cache like spmv_bench, so the matrix is parsed once and streamed after.
+//
+//   spmm_ooc a.mtx|a.csrbin --n 64 --panels 1000000,4000000,16000000
+//            --c /scratch/c.bin --iters 3 [--warm] --format csv|json --out results.csv
+//
+// Every streamed run starts with A's pages dropped from the page cache
+// unless --warm is given. The in-memory reference reads all of A once and
+// times spmm_csr alone; it is skipped with --no-ref, or when A, B and C
+// together would take more than half of physical memory. Records
+// carry the panel count, median/p5/p95 total time, GFLOP/s and its share of
+// the in-memory GFLOP/s, the compute time and the time compute stalled on
+// I/O, the read bandwidth, and the max abs difference of C to the in-memory C
+// ("n/a" without a reference or when reading C back fails).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "bench_stats.hpp"
+#include "csr_cache.hpp"
+#include "spmm_ooc.hpp"
+
+using namespace std;
+
+struct Options
+{
+    string matrix, c_path, out;
+    vector<string> panels;
+    MKL_INT N;
+    int iters;
+    bool warm, json, ref;
+};
+
+bool parse_options(int argc, char **argv, Options &o)
+{
+    o.N = 64;
+    o.panels = split_list("1000000,4000000,16000000");
+    o.c_path = "spmm_ooc_c.bin";
+    o.iters = 3;
+    o.warm = false;
+    o.json = false;
+    o.ref = true;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            o.matrix = arg;
+            continue;
+        }
+        if (arg == "--warm")
+        {
+            o.warm = true;
+            continue;
+        }
+        if (arg == "--no-ref")
+        {
+            o.ref = false;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+        string val = argv[++i];
+        if (arg == "--n")
+            o.N = atol(val.c_str());
+        else if (arg == "--panels")
+            o.panels = split_list(val);
+        else if (arg == "--c")
+            o.c_path = val;
+        else if (arg == "--iters")
+            o.iters = atoi(val.c_str());
+        else if (arg == "--format")
+            o.json = (val == "json");
+        else if (arg == "--out")
+            o.out = val;
+        else
+            return false;
+    }
+    return !o.matrix.empty() && o.N > 0 && o.iters > 0;
+}
+
+// Path of the csrbin to stream, building it from a .mtx when needed.
+bool prepare_csrbin(const string &matrix, string &csrbin)
+{
+    if (matrix.size() < 4 || matrix.compare(matrix.size() - 4, 4, ".mtx") != 0)
+    {
+        csrbin = matrix;
+        return true;
+    }
+    csrbin = matrix + ".csrbin";
+    // only the file is needed; it is streamed, so skip the checksum pass
+    CsrMatrix m;
+    bool ok = load_csr_cached(matrix, m, false);
+    m.release();
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!parse_options(argc, argv, opt))
+    {
+        fprintf(stderr, "Usage: %s <matrix.mtx|matrix.csrbin> [--n N] [--panels nnz list] [--c c.bin] [--iters n]\n"
+                        "          [--warm] [--no-ref] [--format csv|json] [--out file]\n",
+                argv[0]);
+        return -1;
+    }
+    string csrbin;
+    OocMatrix a;
+    if (!prepare_csrbin(opt.matrix, csrbin) || !a.open(csrbin.c_str()))
+    {
+        fprintf(stderr, "Cannot open %s as a csrbin matrix\n", opt.matrix.c_str());
+        return -1;
+    }
+    const MKL_INT M = a.hdr.rows, K = a.hdr.cols, N = opt.N, nnz = a.hdr.nnz;
+    float *B = (float *)mkl_malloc(sizeof(float) * (size_t)K * N, 64);
+    if (B == NULL)
+    {
+        fprintf(stderr, "Host memory allocation failed!\n");
+        return -1;
+    }
+    for (size_t i = 0; i < (size_t)K * N; i++)
+        B[i] = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
+    int c_fd = open(opt.c_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (c_fd < 0)
+    {
+        fprintf(stderr, "Cannot open %s\n", opt.c_path.c_str());
+        return -1;
+    }
+    const double flops = 2.0 * nnz * N;
+    const size_t c_size = (size_t)M * N;
+
+    // in-memory reference: A as one resident panel, C in memory. Allocation
+    // failure cannot be relied on under overcommit, so the footprint is
+    // checked against physical memory up front.
+    OocPanel whole = {};
+    float *C_ref = NULL;
+    double inmem_gflops = 0;
+    const double ref_bytes = (double)(M + 1 + nnz) * sizeof(MKL_INT) + (double)nnz * (sizeof(float) + a.hdr.value_size) +
+                             sizeof(float) * ((double)c_size + (double)K * N);
+    const double phys_bytes = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE);
+    if (!opt.ref)
+        fprintf(stderr, "Skipping the in-memory reference (--no-ref)\n");
+    else if (phys_bytes > 0 && ref_bytes > 0.5 * phys_bytes)
+        fprintf(stderr, "The reference needs %.3g GB, more than half of the %.3g GB of RAM; skipping the in-memory reference\n",
+                ref_bytes * 1e-9, phys_bytes * 1e-9);
+    else if (whole.alloc(M, nnz, a.hdr.value_size) &&
+             (C_ref = (float *)mkl_malloc(sizeof(float) * (c_size ? c_size : 1), 64)) != NULL)
+    {
+        double bytes = 0;
+        LatencyStats lat = {0, 0, 0, 0, 0};
+        if (ooc_load(a, 0, M, whole, bytes) &&
+            time_kernel([&]() {
+                spmm_csr(M, N, 1.0f, whole.values, whole.colidx, whole.rowptr, whole.rowptr + 1, B, N, 0.0f, C_ref, N);
+                return true;
+            }, 1, opt.iters, lat))
+        {
+            inmem_gflops = flops / (lat.median * 1e-3) * 1e-9;
+            fprintf(stderr, "In-memory SpMM: %lf ms, %lf GFLOP/s\n", lat.median, inmem_gflops);
+        }
+        else
+        {
+            fprintf(stderr, "Reading A for the in-memory reference failed\n");
+            mkl_free(C_ref);
+            C_ref = NULL;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "A or C does not fit in memory, skipping the in-memory reference\n");
+        mkl_free(C_ref);
+        C_ref = NULL;
+    }
+    whole.release();
+
+    FILE *out = opt.out.empty() ? stdout : fopen(opt.out.c_str(), "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Cannot open %s\n", opt.out.c_str());
+        return -1;
+    }
+    BenchWriter writer(out, opt.json);
+    for (size_t ip = 0; ip < opt.panels.size(); ip++)
+    {
+        MKL_INT panel_nnz = atol(opt.panels[ip].c_str());
+        vector<MKL_INT> bounds;
+        ooc_panels(a.rowptr, panel_nnz, bounds);
+        vector<double> samples;
+        OocStats st, sum;
+        memset(&sum, 0, sizeof(sum));
+        bool ok = true;
+        for (int it = 0; it < opt.iters && ok; it++)
+        {
+            if (!opt.warm)
+                a.drop_cache();
+            ok = spmm_ooc(a, bounds, N, 1.0f, B, N, c_fd, st);
+            samples.push_back(st.total_s * 1000.0);
+            sum.compute_s += st.compute_s;
+            sum.wait_s += st.wait_s;
+            sum.bytes_read += st.bytes_read;
+        }
+        if (!ok)
+        {
+            fprintf(stderr, "Streaming SpMM failed for panel size %lld\n", (long long)panel_nnz);
+            continue;
+        }
+        // check the written C against the in-memory result, one row at a time
+        double diff = 0;
+        bool checked = C_ref != NULL;
+        if (checked)
+        {
+            vector<float> row((size_t)N);
+            for (MKL_INT i = 0; i < M; i++)
+            {
+                if (!ooc_pread(c_fd, row.data(), sizeof(float) * N, sizeof(float) * (uint64_t)i * N))
+                {
+                    fprintf(stderr, "Reading back C failed for panel size %lld\n", (long long)panel_nnz);
+                    checked = false;
+                    break;
+                }
+                for (MKL_INT n = 0; n < N; n++)
+                    diff = max(diff, (double)fabs(row[n] - C_ref[(size_t)i * N + n]));
+            }
+        }
+        LatencyStats lat = summarize(samples);
+        double sec = lat.median * 1e-3;
+        BenchRecord r;
+        r.add("matrix", opt.matrix);
+        r.add("rows", (long long)M);
+        r.add("cols", (long long)K);
+        r.add("nnz", (long long)nnz);
+        r.add("N", (long long)N);
+        r.add("panel_nnz", (long long)panel_nnz);
+        r.add("panels", st.panels);
+        r.add("cold", string(opt.warm ? "no" : "yes"));
+        r.add_latency(lat);
+        r.add("gflops", flops / sec * 1e-9);
+        r.add("inmem_gflops", inmem_gflops);
+        r.add("pct_of_inmem", inmem_gflops > 0 ? 100.0 * flops / sec * 1e-9 / inmem_gflops : 0.0);
+        r.add("compute_ms", sum.compute_s / opt.iters * 1000.0);
+        r.add("io_wait_ms", sum.wait_s / opt.iters * 1000.0);
+        r.add("read_gbs", sum.bytes_read / opt.iters / sec * 1e-9);
+        if (checked)
+            r.add("max_abs_diff", diff);
+        else
+            r.add("max_abs_diff", "n/a");
+        writer.write(r);
+    }
+    writer.finish();
+    if (out != stdout)
+        fclose(out);
+    close(c_fd);
+    mkl_free(B);
+    mkl_free(C_ref);
+    return 0;
+}
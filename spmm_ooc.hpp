@@ -0,0 +1,246 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
+#include <thread>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "bench_stats.hpp"
+#include "csr_cache.hpp"
+#include "spmm_kernel.hpp"
+
+// Out-of-core SpMM, C = alpha * A * B, with A streamed from a csrbin file
+// (see csr_cache.hpp) and C streamed to a raw row-major float file.
+//
+// Only rowptr (4 bytes per row) and B stay resident. A is cut into row
+// panels of about panel_nnz nonzeros. While panel p is multiplied, an I/O
+// thread preads panel p + 1 into the other buffer and pwrites the C panel
+// of p - 1, so with enough compute per byte the disk is never waited on.
+// Double-valued files are narrowed to float by the I/O thread. The C file
+// is fdatasync'ed before returning, so the total includes getting C to disk.
+struct OocStats
+{
+    long long panels;
+    double total_s, compute_s, wait_s; // wait_s: compute stalled on I/O
+    double bytes_read, bytes_written;
+};
+
+// Whole-file pread/pwrite that retries short transfers and EINTR.
+inline bool ooc_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+    char *p = (char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+inline bool ooc_pwrite(int fd, const void *buf, size_t len, uint64_t off)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+// A csrbin opened for streaming; only the header and rowptr are read.
+struct OocMatrix
+{
+    int fd;
+    CsrCacheHeader hdr;
+    std::vector<MKL_INT> rowptr;
+
+    OocMatrix() : fd(-1) {}
+    ~OocMatrix() { close(); }
+    OocMatrix(const OocMatrix &) = delete;
+    OocMatrix &operator=(const OocMatrix &) = delete;
+
+    bool open(const char *path)
+    {
+        close();
+        fd = ::open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !ooc_pread(fd, &hdr, sizeof(hdr), 0) || !csr_cache_header_ok(hdr, st.st_size) ||
+            (hdr.value_size != sizeof(float) && hdr.value_size != sizeof(double)) || hdr.index_base > 1)
+        {
+            close();
+            return false;
+        }
+        rowptr.resize(hdr.rows + 1);
+        if (!ooc_pread(fd, rowptr.data(), sizeof(MKL_INT) * (hdr.rows + 1), hdr.rowptr_offset))
+        {
+            close();
+            return false;
+        }
+        if (hdr.index_base == 1)
+            for (size_t i = 0; i < rowptr.size(); i++)
+                rowptr[i]--;
+        return true;
+    }
+
+    // Drops the file's clean pages from the page cache, so the next pass reads from disk.
+    void drop_cache() const { posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); }
+
+    void close()
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+};
+
+// Row panels of about panel_nnz nonzeros (at least one row each) as row offsets.
+inline void ooc_panels(const std::vector<MKL_INT> &rowptr, MKL_INT panel_nnz, std::vector<MKL_INT> &bounds)
+{
+    MKL_INT rows = rowptr.size() - 1;
+    bounds.assign(1, 0);
+    for (MKL_INT r = 0; r < rows;)
+    {
+        MKL_INT end = r + 1;
+        while (end < rows && rowptr[end + 1] - rowptr[r] <= panel_nnz)
+            end++;
+        bounds.push_back(end);
+        r = end;
+    }
+}
+
+// One resident panel: zero-based local rowptr and the panel's nonzeros.
+struct OocPanel
+{
+    MKL_INT r0, r1;
+    MKL_INT *rowptr, *colidx;
+    float *values;
+    void *staging; // raw file values when they are not float
+
+    bool alloc(MKL_INT max_rows, MKL_INT max_nnz, size_t value_size)
+    {
+        rowptr = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (max_rows + 1), 64);
+        colidx = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (max_nnz ? max_nnz : 1), 64);
+        values = (float *)mkl_malloc(sizeof(float) * (max_nnz ? max_nnz : 1), 64);
+        staging = value_size == sizeof(float) ? NULL : mkl_malloc(value_size * (max_nnz ? max_nnz : 1), 64);
+        return rowptr != NULL && colidx != NULL && values != NULL && (value_size == sizeof(float) || staging != NULL);
+    }
+
+    void release()
+    {
+        mkl_free(rowptr);
+        mkl_free(colidx);
+        mkl_free(values);
+        mkl_free(staging);
+        rowptr = colidx = NULL;
+        values = NULL;
+        staging = NULL;
+    }
+};
+
+inline bool ooc_load(const OocMatrix &a, MKL_INT r0, MKL_INT r1, OocPanel &p, double &bytes)
+{
+    const MKL_INT k0 = a.rowptr[r0], nnz = a.rowptr[r1] - k0;
+    const uint64_t vs = a.hdr.value_size;
+    p.r0 = r0;
+    p.r1 = r1;
+    for (MKL_INT r = r0; r <= r1; r++)
+        p.rowptr[r - r0] = a.rowptr[r] - k0;
+    if (!ooc_pread(a.fd, p.colidx, sizeof(MKL_INT) * nnz, a.hdr.colidx_offset + sizeof(MKL_INT) * (uint64_t)k0))
+        return false;
+    if (!ooc_pread(a.fd, vs == sizeof(float) ? (void *)p.values : p.staging, vs * nnz, a.hdr.values_offset + vs * k0))
+        return false;
+    if (vs != sizeof(float))
+        for (MKL_INT k = 0; k < nnz; k++)
+            p.values[k] = (float)((const double *)p.staging)[k];
+    if (a.hdr.index_base == 1)
+        for (MKL_INT k = 0; k < nnz; k++)
+            p.colidx[k]--;
+    bytes += (double)nnz * (sizeof(MKL_INT) + vs);
+    return true;
+}
+
+// Streams C = alpha * A * B (A: a, B: rows x N row-major with ldb) into the
+// file c_fd as hdr.rows x N floats. The panels must come from ooc_panels.
+inline bool spmm_ooc(const OocMatrix &a, const std::vector<MKL_INT> &bounds, MKL_INT N, float alpha, const float *B, MKL_INT ldb,
+                     int c_fd, OocStats &st)
+{
+    memset(&st, 0, sizeof(st));
+    const size_t np = bounds.size() - 1;
+    MKL_INT max_rows = 0, max_nnz = 0;
+    for (size_t p = 0; p < np; p++)
+    {
+        max_rows = std::max(max_rows, bounds[p + 1] - bounds[p]);
+        max_nnz = std::max(max_nnz, a.rowptr[bounds[p + 1]] - a.rowptr[bounds[p]]);
+    }
+    OocPanel panel[2];
+    float *cbuf[2];
+    bool ok = true;
+    for (int b = 0; b < 2; b++)
+    {
+        ok = panel[b].alloc(max_rows, max_nnz, a.hdr.value_size) && ok;
+        cbuf[b] = (float *)mkl_malloc(sizeof(float) * (size_t)(max_rows ? max_rows : 1) * N, 64);
+        ok = ok && cbuf[b] != NULL;
+    }
+    double t0 = wall_time();
+    if (ok && np > 0)
+        ok = ooc_load(a, bounds[0], bounds[1], panel[0], st.bytes_read);
+    for (size_t p = 0; ok && p < np; p++)
+    {
+        // the I/O thread owns buffer (p + 1) % 2 of both A and C while panel p computes
+        bool io_ok = true;
+        std::thread io([&, p]() {
+            const int o = (p + 1) % 2;
+            if (p > 0)
+            {
+                const OocPanel &prev = panel[o];
+                size_t len = sizeof(float) * (size_t)(prev.r1 - prev.r0) * N;
+                io_ok = ooc_pwrite(c_fd, cbuf[o], len, sizeof(float) * (uint64_t)prev.r0 * N);
+                st.bytes_written += len;
+            }
+            if (io_ok && p + 1 < np)
+                io_ok = ooc_load(a, bounds[p + 1], bounds[p + 2], panel[o], st.bytes_read);
+        });
+        const OocPanel &cur = panel[p % 2];
+        double c0 = wall_time();
+        spmm_csr(cur.r1 - cur.r0, N, alpha, cur.values, cur.colidx, cur.rowptr, cur.rowptr + 1, B, ldb, 0.0f, cbuf[p % 2], N);
+        double c1 = wall_time();
+        io.join();
+        st.compute_s += c1 - c0;
+        st.wait_s += wall_time() - c1;
+        ok = io_ok;
+    }
+    if (ok && np > 0)
+    {
+        const OocPanel &last = panel[(np - 1) % 2];
+        size_t len = sizeof(float) * (size_t)(last.r1 - last.r0) * N;
+        ok = ooc_pwrite(c_fd, cbuf[(np - 1) % 2], len, sizeof(float) * (uint64_t)last.r0 * N);
+        st.bytes_written += len;
+    }
+    ok = ok && fdatasync(c_fd) == 0;
+    st.total_s = wall_time() - t0;
+    st.panels = np;
+    for (int b = 0; b < 2; b++)
+    {
+        panel[b].release();
+        mkl_free(cbuf[b]);
+    }
+    return ok;
+}
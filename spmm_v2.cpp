@@ -1,11 +1,20 @@
 #include "stdio.h"
 #include "time.h"
+#include <string.h>
+#include <stdint.h>
 #include <vector>
-#include <fstream>
+#include <string>
+#include <algorithm>
+#include <limits>
 #include <iostream>
 #include "mkl.h"
 #include "mkl_spblas.h"
 #include "mkl_types.h"
+#include "csr_convert.hpp"
+#include "mapped_file.hpp"
+#include "sparse_handle.hpp"
+#include "spmm_kernel.hpp"
+#include "bsr_sparse.hpp"
 
 using namespace std;
 
@@ -25,63 +34,199 @@ void random_init(float *ptr, int size, float sparsity)
     }
 }
 
-void load_mask(string fpath){
-    vector<float> data;
-    int h, w;
-    string line;
-    ifstream file(fpath);
-    if (file.is_open()){
-        while(getline(file, line)){
+// Pruning masks come in two formats:
+//   text:   one row per line, tokens separated by spaces/tabs/commas,
+//           "0" (or "0.0") is pruned and any other token is kept
+//   binary: "SPMASK01" | uint64 h | uint64 w | h rows of ceil(w/64) uint64
+//           words, bit j of a row set when column j is kept
+// The weight file is the raw row-major float32 h x w matrix. Both files are
+// mapped, and only the weights under kept bits are read, so no dense copy of
+// the matrix is ever made. Without a weight file kept entries get random values.
+const char MASK_MAGIC[8] = {'S', 'P', 'M', 'A', 'S', 'K', '0', '1'};
+const size_t MASK_HEADER = 24;
 
+// Deterministic per position, so the result does not depend on the thread count.
+inline float mask_random_value(size_t pos)
+{
+    uint64_t z = pos + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (float)(z >> 40) / (float)(1 << 24);
+}
 
-        }
+inline bool is_mask_sep(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == ',';
+}
 
+// Calls emit(j) for every kept column of the text row [p, end), returns the number of tokens.
+template <typename F>
+MKL_INT scan_mask_line(const char *p, const char *end, F emit)
+{
+    MKL_INT j = 0;
+    while (p < end)
+    {
+        while (p < end && is_mask_sep(*p))
+            p++;
+        if (p == end)
+            break;
+        bool kept = false;
+        for (; p < end && !is_mask_sep(*p); p++)
+            kept |= (*p != '0' && *p != '.' && *p != '-' && *p != '+');
+        if (kept)
+            emit(j);
+        j++;
     }
+    return j;
+}
 
+// Calls emit(j) for every set bit of a packed row of w columns.
+template <typename F>
+void scan_mask_bits(const uint64_t *row, MKL_INT w, F emit)
+{
+    size_t words = (w + 63) / 64;
+    for (size_t k = 0; k < words; k++)
+    {
+        uint64_t b = row[k];
+        if (k == words - 1 && (w & 63))
+            b &= (1ULL << (w & 63)) - 1;
+        while (b)
+        {
+            emit((MKL_INT)(k * 64 + __builtin_ctzll(b)));
+            b &= b - 1;
+        }
+    }
 }
 
-pair<vector<void *>, vector<unsigned long>> convert_csr(float *src, int h, int w)
+// Builds zero-based CSR (same layout as convert_csr) from a mask and an optional weight file.
+pair<vector<void *>, vector<unsigned long>> load_mask(string fpath, string wpath, MKL_INT &h, MKL_INT &w)
 {
-    vector<float> value;
-    vector<MKL_INT> row_idx;
-    vector<MKL_INT> col_idx;
-    MKL_INT pos;
-    for (MKL_INT i = 0; i < h; i++)
+    MappedFile mask;
+    if (!mask.open(fpath.c_str(), MADV_SEQUENTIAL))
+        throw "Cannot open the mask file!";
+    bool binary = mask.size >= MASK_HEADER && memcmp(mask.data, MASK_MAGIC, 8) == 0;
+    const uint64_t *bits = (const uint64_t *)(mask.data + MASK_HEADER);
+    vector<const char *> line_begin, line_end;
+    if (binary)
     {
-        row_idx.push_back(value.size());
-        for (MKL_INT j = 0; j < w; j++)
+        uint64_t hh, ww;
+        memcpy(&hh, mask.data + 8, 8);
+        memcpy(&ww, mask.data + 16, 8);
+        // checked by division, a hostile h * words must not wrap past the size test
+        if (hh > (uint64_t)numeric_limits<MKL_INT>::max() || ww > (uint64_t)numeric_limits<MKL_INT>::max() - 63)
+            throw "Corrupt mask header!";
+        const uint64_t words = (ww + 63) / 64;
+        if (words > 0 && (mask.size - MASK_HEADER) / 8 / words < hh)
+            throw "Truncated mask file!";
+        h = (MKL_INT)hh;
+        w = (MKL_INT)ww;
+    }
+    else
+    {
+        // a single memchr pass locates the rows, blank lines are skipped
+        const char *p = mask.data, *end = mask.data + mask.size;
+        while (p < end)
         {
-            pos = i * w + j;
-            if (src[pos] != 0.0)
+            const char *nl = (const char *)memchr(p, '\n', end - p);
+            const char *le = nl ? nl : end;
+            if (scan_mask_line(p, le, [](MKL_INT) {}) > 0)
             {
-                value.push_back(src[pos]);
-                col_idx.push_back(j);
+                line_begin.push_back(p);
+                line_end.push_back(le);
             }
+            p = le + 1;
         }
+        h = line_begin.size();
+        w = h ? scan_mask_line(line_begin[0], line_end[0], [](MKL_INT) {}) : 0;
     }
-    float *ptr_v = (float *)mkl_malloc(sizeof(float) * value.size(), 64);
-    MKL_INT *ptr_r = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * row_idx.size(), 64);
-    MKL_INT *ptr_c = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * col_idx.size(), 64);
-    if (ptr_v == NULL || ptr_r == NULL || ptr_c == NULL)
+
+    MappedFile weights;
+    const float *wdata = NULL;
+    if (!wpath.empty())
     {
+        if (!weights.open(wpath.c_str(), MADV_SEQUENTIAL))
+            throw "Cannot open the weight file!";
+        if (weights.size < (size_t)h * w * sizeof(float))
+            throw "Weight file is smaller than the mask!";
+        wdata = (const float *)weights.data;
+    }
+
+    MKL_INT *ptr_r = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (h + 1), 64);
+    if (ptr_r == NULL)
         throw "Host memory allocation failed!";
-        printf("ptr_v is NULL!!!!\n");
-    }
-    // copy the data
-    for (int i = 0; i < value.size(); i++)
-        ptr_v[i] = value[i];
-    for (int i = 0; i < row_idx.size(); i++)
-        ptr_r[i] = row_idx[i];
-    for (int i = 0; i < col_idx.size(); i++)
-        ptr_c[i] = col_idx[i];
+    size_t words = (w + 63) / 64;
+    MKL_INT ragged = 0;
+    ptr_r[0] = 0;
+#pragma omp parallel for schedule(static) reduction(+ : ragged)
+    for (MKL_INT i = 0; i < h; i++)
+    {
+        MKL_INT cnt = 0;
+        if (binary)
+            scan_mask_bits(bits + i * words, w, [&](MKL_INT) { cnt++; });
+        else
+            ragged += scan_mask_line(line_begin[i], line_end[i], [&](MKL_INT) { cnt++; }) != w;
+        ptr_r[i + 1] = cnt;
+    }
+    if (ragged)
+    {
+        mkl_free(ptr_r);
+        throw "Mask rows have different lengths!";
+    }
+    for (MKL_INT i = 0; i < h; i++)
+        ptr_r[i + 1] += ptr_r[i];
+    size_t nnz = ptr_r[h];
+
+    float *ptr_v = (float *)mkl_malloc(sizeof(float) * (nnz ? nnz : 1), 64);
+    MKL_INT *ptr_c = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (nnz ? nnz : 1), 64);
+    if (ptr_v == NULL || ptr_c == NULL)
+    {
+        mkl_free(ptr_r);
+        mkl_free(ptr_v);
+        mkl_free(ptr_c);
+        throw "Host memory allocation failed!";
+    }
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < h; i++)
+    {
+        MKL_INT dst = ptr_r[i];
+        size_t base = (size_t)i * w;
+        auto emit = [&](MKL_INT j) {
+            ptr_v[dst] = wdata ? wdata[base + j] : mask_random_value(base + j);
+            ptr_c[dst++] = j;
+        };
+        if (binary)
+            scan_mask_bits(bits + i * words, w, emit);
+        else
+            scan_mask_line(line_begin[i], line_end[i], emit);
+    }
+
     vector<void *> ptrs = {(void *)ptr_v, (void *)ptr_r, (void *)ptr_c};
-    // printf("ptr_v:%x\n", ptr_v);
-    // printf("ptrs[0]:%x\n",ptrs[0]);
-    // printf(" cpu value length: %ld", sizeof(float) * value.size());
-    vector<unsigned long> sizes = {value.size(), row_idx.size(), col_idx.size()};
+    vector<unsigned long> sizes = {nnz, (unsigned long)h + 1, nnz};
     return make_pair(ptrs, sizes);
 }
 
+// Writes the sparsity pattern of a CSR matrix as a binary mask.
+bool save_mask(string fpath, const MKL_INT *rowIndex, const MKL_INT *columns, MKL_INT h, MKL_INT w)
+{
+    FILE *f = fopen(fpath.c_str(), "wb");
+    if (f == NULL)
+        return false;
+    uint64_t hh = h, ww = w;
+    fwrite(MASK_MAGIC, 1, 8, f);
+    fwrite(&hh, 8, 1, f);
+    fwrite(&ww, 8, 1, f);
+    vector<uint64_t> row((w + 63) / 64);
+    for (MKL_INT i = 0; i < h; i++)
+    {
+        fill(row.begin(), row.end(), 0);
+        for (MKL_INT k = rowIndex[i]; k < rowIndex[i + 1]; k++)
+            row[columns[k] / 64] |= 1ULL << (columns[k] % 64);
+        fwrite(row.data(), 8, row.size(), f);
+    }
+    return fclose(f) == 0;
+}
+
 void show(float *ptr, int size)
 {
     for (int i = 0; i < size; i++)
@@ -90,71 +235,105 @@ void show(float *ptr, int size)
     }
 }
 
-int main()
+// Usage: spmm_v2                              random A with 80% sparsity
+//        spmm_v2 <mask> [weights]             A from a pruning mask (+ raw float32 weights)
+//        spmm_v2 --pack <text mask> <out>     convert a text mask to the binary format
+// A leading "--bsr <block|auto>" also runs mkl_sparse_s_mm on a BSR copy of A
+// with block x block tiles, or with the block size choose_bsr_block picks.
+int main(int argc, char **argv)
 {
+    const char *bsr_arg = NULL;
+    if (argc >= 3 && string(argv[1]) == "--bsr")
+    {
+        bsr_arg = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
     MKL_INT M, K, N;
     M = K = N = 1024;
 
-    float *A, *B, *C;
+    float *A = NULL, *B, *C;
     float sparsity = 0.8, alpha = 1.0, beta = 0.0;
-    A = (float *)mkl_malloc(sizeof(float) * M * K, 64);
+    pair<vector<void *>, vector<unsigned long>> csr;
+    bool pack = argc == 4 && string(argv[1]) == "--pack";
+    if (argc > 4 || (argc == 4 && !pack))
+    {
+        printf("Usage: %s [--bsr block|auto] [mask [weights]] | --pack <text mask> <binary mask>\n", argv[0]);
+        return -1;
+    }
+    try
+    {
+        if (argc > 1)
+        {
+            double load_start = dsecnd();
+            csr = load_mask(argv[pack ? 2 : 1], argc == 3 ? argv[2] : "", M, K);
+            printf("Mask Load Time: %lf ms (%lld x %lld, nnz %lu)\n", (dsecnd() - load_start) * 1000, (long long)M, (long long)K, csr.second[0]);
+            if (pack)
+                return save_mask(argv[3], (MKL_INT *)csr.first[1], (MKL_INT *)csr.first[2], M, K) ? 0 : -1;
+            sparsity = 1.0 - (double)csr.second[0] / ((double)M * K);
+        }
+    }
+    catch (const char *msg)
+    {
+        printf("%s\n", msg);
+        return -1;
+    }
+    if (argc == 1)
+        A = (float *)mkl_malloc(sizeof(float) * M * K, 64);
     B = (float *)mkl_malloc(sizeof(float) * K * N, 64);
     C = (float *)mkl_malloc(sizeof(float) * M * N, 64);
-    if (A == NULL || B == NULL || C == NULL)
+    if ((argc == 1 && A == NULL) || B == NULL || C == NULL)
     {
         mkl_free(A);
         mkl_free(B);
         mkl_free(C);
         return -1;
     }
-    random_init(A, M * K, sparsity);
     random_init(B, K * N, 0);
-    sparse_matrix_t SA;
     sparse_status_t status;
-    // convert to the CSR format
-    pair<vector<void *>, vector<unsigned long>> csr = convert_csr(A, M, K);
+    if (argc == 1)
+    {
+        random_init(A, M * K, sparsity);
+        // convert to the CSR format
+        double convert_start = dsecnd();
+        csr = convert_csr(A, M, K);
+        double convert_time = dsecnd() - convert_start;
+        printf("Convert Time: %lf ms Throughput: %lf GB/s ISA: %s\n", convert_time * 1000, convert_csr_bytes(M, K, csr.second[0]) / convert_time * 1e-9, select_compress_kernels().isa);
+    }
     vector<void *> ptrs = csr.first;
     vector<unsigned long> sizes = csr.second;
     float *values = (float *)ptrs[0];
     MKL_INT *rowIndex = (MKL_INT *)ptrs[1];
     MKL_INT *columns = (MKL_INT *)ptrs[2];
 
-    status = mkl_sparse_s_create_csr(&SA, SPARSE_INDEX_BASE_ZERO, M, K, rowIndex, &(rowIndex[1]), columns, values);
-    if (status != SPARSE_STATUS_SUCCESS)
-    {
-        printf("CSR Sparse matrix created failed.\n");
-        return -2;
-    }
     // Two Stage algorithms
-    // (1) inspector
-    // (2) executor
-
+    // (1) inspector: create, hint and optimize once per pattern and signature
+    // (2) executor: every call looks the optimized handle up again
     int niter = 10000;
-    matrix_descr descr;
-    descr.type = SPARSE_MATRIX_TYPE_GENERAL;
-    descr.mode = SPARSE_FILL_MODE_LOWER;
-    descr.diag = SPARSE_DIAG_NON_UNIT;
-    clock_t analysis_start = clock();
-    status = mkl_sparse_set_mm_hint(SA, SPARSE_OPERATION_NON_TRANSPOSE, descr, SPARSE_LAYOUT_ROW_MAJOR, K, niter);
-    clock_t analysis_end = clock();
-    double analysis_time = (analysis_end - analysis_start) * 1000.0 / CLOCKS_PER_SEC;
-    printf("Analysis time cost %lf ms\n", analysis_time);
-    if (status != SPARSE_STATUS_SUCCESS)
+    SparseHandleCache handles;
+    uint64_t pattern = csr_pattern_hash(M, K, rowIndex, columns);
+    SparseHandle *SA = handles.acquire(pattern, M, K, rowIndex, columns, values, SPARSE_OPERATION_NON_TRANSPOSE, SPARSE_LAYOUT_ROW_MAJOR, N, niter);
+    if (SA == NULL)
     {
         printf("Analysis failed!!\n");
         return -3;
     }
-    mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, alpha, SA, descr, SPARSE_LAYOUT_ROW_MAJOR, B, N, K, beta, C, M);
-        clock_t t_start = clock();
+    printf("Analysis time cost %lf ms\n", SA->analysis_ms);
+    BreakEven be;
+    if (measure_break_even(*SA, M, K, rowIndex, columns, values, B, C, N, 2, 20, be))
+        print_break_even(be);
+    double t_start = dsecnd();
     for(MKL_INT iter_id=0; iter_id<niter; iter_id+=1){
-        status = mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, alpha, SA, descr, SPARSE_LAYOUT_ROW_MAJOR, B, N, K, beta, C, M);   
+        SA = handles.acquire(pattern, M, K, rowIndex, columns, values, SPARSE_OPERATION_NON_TRANSPOSE, SPARSE_LAYOUT_ROW_MAJOR, N, niter);
+        status = mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, alpha, SA->handle, SA->descr, SPARSE_LAYOUT_ROW_MAJOR, B, N, N, beta, C, N);   
         if(status!=SPARSE_STATUS_SUCCESS){
             printf("Sparse MM failed!!!!\n");
             return -4;
         }
     }
-    clock_t t_end = clock();
-    double timecost = (t_end - t_start) * 1.0 / CLOCKS_PER_SEC * 1000 / niter;
+    double t_end = dsecnd();
+    double timecost = (t_end - t_start) * 1000 / niter;
 
     // show(A, 100);
     // show(B, 100);
@@ -162,6 +341,78 @@ int main()
 
     printf("Time Cost: %lf Sparsity: %f \n", timecost, sparsity);
 
+    // in-house kernel on the same operands, checked against the MKL result
+    float *C_native = (float *)mkl_malloc(sizeof(float) * M * N, 64);
+    if (C_native != NULL)
+    {
+        spmm_csr(M, N, alpha, values, columns, rowIndex, &(rowIndex[1]), B, N, beta, C_native, N);
+        t_start = dsecnd();
+        for (MKL_INT iter_id = 0; iter_id < niter; iter_id += 1)
+            spmm_csr(M, N, alpha, values, columns, rowIndex, &(rowIndex[1]), B, N, beta, C_native, N);
+        t_end = dsecnd();
+        float max_err = 0;
+        for (size_t i = 0; i < (size_t)M * N; i++)
+            max_err = max(max_err, fabsf(C_native[i] - C[i]));
+        printf("Native Time Cost: %lf ISA: %s Max Abs Diff: %g\n", (t_end - t_start) * 1000 / niter, select_spmm_kernels().isa, max_err);
+        mkl_free(C_native);
+    }
+
+    // block-sparse copy of A, checked against the CSR result
+    float *C_bsr = bsr_arg != NULL ? (float *)mkl_malloc(sizeof(float) * M * N, 64) : NULL;
+    if (C_bsr != NULL)
+    {
+        MKL_INT block = atol(bsr_arg);
+        if (string(bsr_arg) == "auto")
+        {
+            vector<BsrCandidate> report;
+            block = choose_bsr_block(values, rowIndex, columns, M, K, B, C_bsr, N, 4.0, &report);
+            for (size_t i = 0; i < report.size(); i++)
+                printf("BSR block %lld: %lld blocks, fill %.2f, %lf ms\n", (long long)report[i].block, (long long)report[i].nnzb,
+                       report[i].fill, report[i].ms);
+        }
+        BsrMatrix bsr;
+        sparse_matrix_t SB;
+        matrix_descr descr;
+        double convert_start = dsecnd();
+        if (block == 1)
+            printf("BSR: keeping CSR\n");
+        else if (!csr_to_bsr(values, rowIndex, columns, M, K, block, bsr))
+            printf("BSR block %lld does not divide %lld x %lld\n", (long long)block, (long long)M, (long long)K);
+        else if (!bsr_create_handle(bsr, N, niter, SB, descr))
+        {
+            printf("BSR analysis failed!!\n");
+            bsr.release();
+        }
+        else
+        {
+            printf("BSR Convert + Analysis Time: %lf ms Block: %lld Fill: %.2f\n", (dsecnd() - convert_start) * 1000, (long long)block,
+                   (double)bsr.nnzb * block * block / sizes[0]);
+            t_start = dsecnd();
+            status = SPARSE_STATUS_SUCCESS;
+            for (MKL_INT iter_id = 0; iter_id < niter && status == SPARSE_STATUS_SUCCESS; iter_id += 1)
+                status = mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, alpha, SB, descr, SPARSE_LAYOUT_ROW_MAJOR, B, N, N, beta, C_bsr, N);
+            t_end = dsecnd();
+            if (status != SPARSE_STATUS_SUCCESS)
+                printf("BSR Sparse MM failed!!\n");
+            else
+            {
+                float max_err = 0;
+                for (size_t i = 0; i < (size_t)M * N; i++)
+                    max_err = max(max_err, fabsf(C_bsr[i] - C[i]));
+                printf("BSR Time Cost: %lf Max Abs Diff: %g\n", (t_end - t_start) * 1000 / niter, max_err);
+            }
+            mkl_sparse_destroy(SB);
+            bsr.release();
+        }
+        mkl_free(C_bsr);
+    }
+
+    printf("Handle reuse: %lld hits %lld misses\n", handles.hits(), handles.misses());
+    // the handles reference the CSR arrays, destroy them first
+    handles.clear();
+    mkl_free(values);
+    mkl_free(rowIndex);
+    mkl_free(columns);
     mkl_free(A);
     mkl_free(B);
     mkl_free(C);
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "csr_view.hpp"
+
+// Merge-path CSR SpMV, y = alpha * A * x + beta * y, zero-based CSR.
+//
+// SpMV work is one unit per row (the store) plus one per nonzero. Splitting
+// by rows leaves the thread that owns a hub row of a power-law matrix with
+// most of the nonzeros; splitting by nonzeros leaves the one owning many
+// empty rows with most of the stores. Merge path treats the row ends and the
+// nonzeros as two sorted lists being merged and cuts the merge into equal
+// diagonals of rows + nnz, so every thread gets the same share of both,
+// with rows split across threads where needed. A thread that stops inside a
+// row hands its partial sum on as a carry, added to y after the parallel pass.
+//
+// The merge runs over a row-offset list. For plain CSR that is rowptr. A
+// CsrView's rows are not contiguous in the parent arrays, so its plan keeps
+// the prefix sum of the view's row lengths (view_ptr), and a row's entries are
+// found at pointerB[i] plus the offset into the row.
+struct SpmvPlan
+{
+    int threads;
+    std::vector<MKL_INT> row_start, nz_start; // threads + 1 merge coordinates
+    std::vector<double> carry;                // partial sum of row_start[t + 1] by thread t
+    std::vector<MKL_INT> view_ptr;            // rows + 1 merge offsets of a view, empty for plain CSR
+};
+
+// First coordinate (row, nonzero) on merge diagonal d: the number of row
+// ends consumed before nonzero index d - row.
+inline void spmv_merge_search(MKL_INT d, const MKL_INT *row_end, MKL_INT rows, MKL_INT nnz, MKL_INT &row, MKL_INT &nz)
+{
+    MKL_INT lo = d > nnz ? d - nnz : 0, hi = d < rows ? d : rows;
+    while (lo < hi)
+    {
+        MKL_INT mid = lo + (hi - lo) / 2;
+        if (row_end[mid] <= d - mid - 1)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    row = lo;
+    nz = d - lo;
+}
+
+inline void spmv_merge_plan(const MKL_INT *rowptr, MKL_INT rows, int threads, SpmvPlan &plan)
+{
+    MKL_INT nnz = rowptr[rows];
+    plan.threads = threads > 0 ? threads : 1;
+    plan.row_start.resize(plan.threads + 1);
+    plan.nz_start.resize(plan.threads + 1);
+    plan.carry.assign(plan.threads, 0.0);
+    int64_t total = (int64_t)rows + nnz;
+    for (int t = 0; t <= plan.threads; t++)
+    {
+        MKL_INT d = (MKL_INT)(total * t / plan.threads);
+        spmv_merge_search(d, rowptr + 1, rows, nnz, plan.row_start[t], plan.nz_start[t]);
+    }
+}
+
+template <typename T>
+inline void spmv_merge_plan(const CsrView<T> &A, int threads, SpmvPlan &plan)
+{
+    plan.view_ptr.resize(A.rows + 1);
+    plan.view_ptr[0] = 0;
+    for (MKL_INT i = 0; i < A.rows; i++)
+        plan.view_ptr[i + 1] = plan.view_ptr[i] + (A.pointerE[i] - A.pointerB[i]);
+    spmv_merge_plan(plan.view_ptr.data(), A.rows, threads, plan);
+}
+
+// Merge over the offsets merge_ptr; row i's entries start at pointerB[i].
+template <typename T>
+inline void spmv_merge_offsets(SpmvPlan &plan, MKL_INT rows, T alpha, const MKL_INT *merge_ptr, const MKL_INT *pointerB,
+                               const MKL_INT *colidx, const T *values, const T *x, T beta, T *y)
+{
+#pragma omp parallel num_threads(plan.threads)
+    {
+        int nthreads = omp_get_num_threads();
+        for (int t = omp_get_thread_num(); t < plan.threads; t += nthreads)
+        {
+            MKL_INT i = plan.row_start[t], k = plan.nz_start[t];
+            MKL_INT i1 = plan.row_start[t + 1], k1 = plan.nz_start[t + 1];
+            for (; i < i1; i++)
+            {
+                const MKL_INT off = pointerB[i] - merge_ptr[i];
+                const T *v = values + off;
+                const MKL_INT *c = colidx + off;
+                T sum = 0;
+                for (MKL_INT e = merge_ptr[i + 1]; k < e; k++)
+                    sum += v[k] * x[c[k]];
+                y[i] = beta == T(0) ? alpha * sum : alpha * sum + beta * y[i];
+            }
+            T sum = 0;
+            if (k < k1)
+            {
+                const MKL_INT off = pointerB[i1] - merge_ptr[i1];
+                for (; k < k1; k++)
+                    sum += values[k + off] * x[colidx[k + off]];
+            }
+            plan.carry[t] = (double)sum;
+        }
+    }
+    // the row a segment stops in is finished (and its beta term applied) by a later segment
+    for (int t = 0; t < plan.threads; t++)
+        if (plan.row_start[t + 1] < rows)
+            y[plan.row_start[t + 1]] += alpha * (T)plan.carry[t];
+}
+
+// Runs plan. The OpenMP team may be smaller than plan.threads; threads then
+// take several segments. plan.carry is scratch, so one plan serves one call at a time.
+template <typename T>
+inline void spmv_merge(SpmvPlan &plan, MKL_INT rows, T alpha, const MKL_INT *rowptr, const MKL_INT *colidx, const T *values,
+                       const T *x, T beta, T *y)
+{
+    spmv_merge_offsets(plan, rows, alpha, rowptr, rowptr, colidx, values, x, beta, y);
+}
+
+// y (A.rows) = alpha * A * x + beta * y for a plan from spmv_merge_plan(A, ...),
+// x indexed by parent column.
+template <typename T>
+inline void spmv_merge(SpmvPlan &plan, const CsrView<T> &A, T alpha, const T *x, T beta, T *y)
+{
+    spmv_merge_offsets(plan, A.rows, alpha, plan.view_ptr.data(), A.pointerB, A.columns, A.values, x, beta, y);
+}
+
+// Plain row-parallel SpMV with a static schedule, the baseline merge path is
+// measured against. Four-array form, so it also runs views.
+template <typename T>
+inline void spmv_rows(MKL_INT rows, T alpha, const MKL_INT *pointerB, const MKL_INT *pointerE, const MKL_INT *colidx, const T *values,
+                      const T *x, T beta, T *y)
+{
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < rows; i++)
+    {
+        T sum = 0;
+        for (MKL_INT k = pointerB[i]; k < pointerE[i]; k++)
+            sum += values[k] * x[colidx[k]];
+        y[i] = beta == T(0) ? alpha * sum : alpha * sum + beta * y[i];
+    }
+}
+
+template <typename T>
+inline void spmv_rows(MKL_INT rows, T alpha, const MKL_INT *rowptr, const MKL_INT *colidx, const T *values, const T *x, T beta, T *y)
+{
+    spmv_rows(rows, alpha, rowptr, rowptr + 1, colidx, values, x, beta, y);
+}
+
+template <typename T>
+inline void spmv_rows(const CsrView<T> &A, T alpha, const T *x, T beta, T *y)
+{
+    spmv_rows(A.rows, alpha, A.pointerB, A.pointerE, A.columns, A.values, x, beta, y);
+}
+
+// Symmetric SpMV/SpMM from half storage, Y = alpha * A * X + beta * Y with
+// only the lower triangle of A (diagonal included) in zero-based CSR and
+// X/Y row-major with nrhs columns.
+//
+// Entry (i, j), j < i, contributes to row i and, transposed, to row j, so a
+// thread owning rows [r0, r1) also writes rows below r0 that other threads
+// own. Rows are processed in ascending order, so transposed updates inside
+// [r0, r1) land on rows the thread has already initialised and go straight
+// to Y. Updates below r0 go to a private buffer spanning only the columns
+// the thread can reach, [smallest column of its rows, r0), and each thread
+// adds the buffer windows that overlap its rows after a barrier. No atomics
+// are needed, and the matrix bytes streamed are about half of full storage.
+struct SpmvSymPlan
+{
+    int threads;
+    std::vector<MKL_INT> row_start; // threads + 1 row boundaries
+    std::vector<MKL_INT> lo;        // first row of thread t's buffer window
+    std::vector<size_t> buf_ptr;    // threads + 1 offsets of the windows into buf
+    std::vector<double> buf;        // buf_ptr[threads] * nrhs partial sums
+};
+
+// Splits the rows so every thread gets the same share of rows + stored
+// nonzeros (each stored off-diagonal entry is used twice, but rows and
+// entries are what is streamed) and sizes the buffer windows.
+inline void spmv_sym_plan(const MKL_INT *rowptr, const MKL_INT *colidx, MKL_INT rows, int threads, SpmvSymPlan &plan)
+{
+    MKL_INT nnz = rowptr[rows];
+    plan.threads = threads > 0 ? threads : 1;
+    plan.row_start.resize(plan.threads + 1);
+    plan.lo.resize(plan.threads);
+    plan.buf_ptr.assign(plan.threads + 1, 0);
+    int64_t total = (int64_t)rows + nnz;
+    for (int t = 0; t <= plan.threads; t++)
+    {
+        MKL_INT nz;
+        spmv_merge_search((MKL_INT)(total * t / plan.threads), rowptr + 1, rows, nnz, plan.row_start[t], nz);
+    }
+    for (int t = 0; t < plan.threads; t++)
+    {
+        MKL_INT r0 = plan.row_start[t], lo = r0;
+        for (MKL_INT k = rowptr[r0]; k < rowptr[plan.row_start[t + 1]]; k++)
+            lo = std::min(lo, colidx[k]);
+        plan.lo[t] = lo;
+        plan.buf_ptr[t + 1] = plan.buf_ptr[t] + (r0 - lo);
+    }
+}
+
+// Runs plan on the lower triangle; the row count comes from the plan. As with
+// spmv_merge the team may be smaller than plan.threads, and plan.buf makes one
+// plan serve one call at a time.
+template <typename T>
+inline void spmm_sym(SpmvSymPlan &plan, MKL_INT nrhs, T alpha, const MKL_INT *rowptr, const MKL_INT *colidx,
+                     const T *values, const T *X, MKL_INT ldx, T beta, T *Y, MKL_INT ldy)
+{
+    if (plan.buf.size() < plan.buf_ptr[plan.threads] * (size_t)nrhs)
+        plan.buf.resize(plan.buf_ptr[plan.threads] * (size_t)nrhs);
+#pragma omp parallel num_threads(plan.threads)
+    {
+        int nthreads = omp_get_num_threads();
+        for (int t = omp_get_thread_num(); t < plan.threads; t += nthreads)
+        {
+            const MKL_INT r0 = plan.row_start[t], r1 = plan.row_start[t + 1], lo = plan.lo[t];
+            double *buf = plan.buf.data() + plan.buf_ptr[t] * nrhs;
+            std::fill(buf, buf + (size_t)(r0 - lo) * nrhs, 0.0);
+            for (MKL_INT i = r0; i < r1; i++)
+            {
+                const T *x = X + (size_t)i * ldx;
+                T *y = Y + (size_t)i * ldy;
+                if (nrhs == 1)
+                {
+                    T sum = 0;
+                    for (MKL_INT k = rowptr[i]; k < rowptr[i + 1]; k++)
+                    {
+                        MKL_INT j = colidx[k];
+                        sum += values[k] * X[(size_t)j * ldx];
+                        if (j == i)
+                            continue;
+                        if (j >= r0)
+                            Y[(size_t)j * ldy] += alpha * values[k] * x[0];
+                        else
+                            buf[j - lo] += (double)(values[k] * x[0]);
+                    }
+                    y[0] = beta == T(0) ? alpha * sum : alpha * sum + beta * y[0];
+                    continue;
+                }
+                for (MKL_INT c = 0; c < nrhs; c++)
+                    y[c] = beta == T(0) ? T(0) : beta * y[c];
+                for (MKL_INT k = rowptr[i]; k < rowptr[i + 1]; k++)
+                {
+                    MKL_INT j = colidx[k];
+                    const T v = values[k], av = alpha * v;
+                    const T *xj = X + (size_t)j * ldx;
+                    for (MKL_INT c = 0; c < nrhs; c++)
+                        y[c] += av * xj[c];
+                    if (j == i)
+                        continue;
+                    if (j >= r0)
+                    {
+                        T *yj = Y + (size_t)j * ldy;
+                        for (MKL_INT c = 0; c < nrhs; c++)
+                            yj[c] += av * x[c];
+                    }
+                    else
+                    {
+                        double *bj = buf + (size_t)(j - lo) * nrhs;
+                        for (MKL_INT c = 0; c < nrhs; c++)
+                            bj[c] += (double)(v * x[c]);
+                    }
+                }
+            }
+        }
+#pragma omp barrier
+        // rows of segment s only receive from the windows of later segments
+        for (int s = omp_get_thread_num(); s < plan.threads; s += nthreads)
+        {
+            const MKL_INT r0 = plan.row_start[s], r1 = plan.row_start[s + 1];
+            for (int t = s + 1; t < plan.threads; t++)
+            {
+                MKL_INT b = std::max(r0, plan.lo[t]), e = std::min(r1, plan.row_start[t]);
+                const double *buf = plan.buf.data() + plan.buf_ptr[t] * nrhs;
+                for (MKL_INT j = b; j < e; j++)
+                    for (MKL_INT c = 0; c < nrhs; c++)
+                        Y[(size_t)j * ldy + c] += alpha * (T)buf[(size_t)(j - plan.lo[t]) * nrhs + c];
+            }
+        }
+    }
+}
+
+template <typename T>
+inline void spmv_sym(SpmvSymPlan &plan, T alpha, const MKL_INT *rowptr, const MKL_INT *colidx, const T *values,
+                     const T *x, T beta, T *y)
+{
+    spmm_sym(plan, 1, alpha, rowptr, colidx, values, x, 1, beta, y, 1);
+}
+
+// Lower triangle (diagonal included) of a zero-based CSR matrix, the half
+// spmm_sym reads. Arrays are mkl_malloc'ed and owned by the caller.
+inline bool csr_lower_half(const MKL_INT *rowptr, const MKL_INT *colidx, const double *values, MKL_INT rows,
+                           MKL_INT *&lrowptr, MKL_INT *&lcolidx, double *&lvalues)
+{
+    lrowptr = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (rows + 1), 64);
+    if (lrowptr == NULL)
+        return false;
+    lrowptr[0] = 0;
+    for (MKL_INT i = 0; i < rows; i++)
+    {
+        MKL_INT cnt = 0;
+        for (MKL_INT k = rowptr[i]; k < rowptr[i + 1]; k++)
+            cnt += colidx[k] <= i;
+        lrowptr[i + 1] = lrowptr[i] + cnt;
+    }
+    MKL_INT nnz = lrowptr[rows];
+    lcolidx = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (nnz ? nnz : 1), 64);
+    lvalues = (double *)mkl_malloc(sizeof(double) * (nnz ? nnz : 1), 64);
+    if (lcolidx == NULL || lvalues == NULL)
+        return false;
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < rows; i++)
+    {
+        MKL_INT dst = lrowptr[i];
+        for (MKL_INT k = rowptr[i]; k < rowptr[i + 1]; k++)
+            if (colidx[k] <= i)
+            {
+                lcolidx[dst] = colidx[k];
+                lvalues[dst++] = values[k];
+            }
+    }
+    return true;
+}
+
+// Bytes one SpMV (or SpMM with nrhs columns) moves: A, x once and y written
+// (read too when beta != 0).
+inline double spmv_bytes(MKL_INT rows, MKL_INT cols, MKL_INT nnz, size_t value_size, bool read_y, MKL_INT nrhs = 1)
+{
+    return (double)nnz * (value_size + sizeof(MKL_INT)) + (double)(rows + 1) * sizeof(MKL_INT) +
+           ((double)cols * value_size + (double)rows * value_size * (read_y ? 2 : 1)) * nrhs;
+}
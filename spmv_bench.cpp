@@ -0,0 +1,369 @@
+// SpMV benchmark on Matrix Market inputs.
+//
+// Loads each matrix through its "<file>.csrbin" cache (parsing and writing
+// the cache on the first run), then times Y = A * X, X with nrhs columns
+// for every entry of --nrhs, for every kernel of --kernels and thread count
+// of --threads:
+//
+//   mkl      mkl_sparse_d_mv (mkl_sparse_d_mm for nrhs > 1) on a hinted and
+//            optimized handle of the full matrix
+//   merge    merge-path partitioned SpMV (spmv.hpp), nrhs 1 only
+//   rows     row-parallel SpMV with a static schedule, nrhs 1 only
+//   sym      half-storage symmetric SpMV/SpMM on the lower triangle (spmm_sym)
+//   mkl_sym  mkl_sparse_d_mv/mm with a symmetric descriptor on the lower triangle
+//   tiles    column-blocked SpMV: CsrView windows of SPMV_TILE_COLS columns
+//            (no copy of A) applied in turn so each x slice stays in cache, nrhs 1 only
+//   merge_tiles  merge-path SpMV per row panel of SPMV_TILE_ROWS rows, each a
+//            CsrView with its own plan writing its slice of y, nrhs 1 only
+//
+//   spmv_bench a.mtx,b.mtx --kernels mkl,merge,rows --threads 1,8,32
+//              --nrhs 1,8 --warmup 5 --iters 50 --format csv|json --out results.csv
+//
+// The sym kernels assume a symmetric input; their error column shows when
+// it is not. Records carry median/p5/p95 latency, GFLOP/s (2 * nnz * nrhs
+// of the full matrix for every kernel), GB/s from spmv_bytes over the
+// nonzeros the kernel actually stores, the longest row and the max relative
+// error against plain full-storage mkl_sparse_d_mv/mm.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_spblas.h"
+#include "mkl_types.h"
+#include "bench_stats.hpp"
+#include "csr_cache.hpp"
+#include "spmv.hpp"
+
+using namespace std;
+
+const MKL_INT SPMV_TILE_COLS = 1 << 16; // 512 KB of x per tile
+const MKL_INT SPMV_TILE_ROWS = 1 << 14; // rows per merge_tiles panel
+
+// One input plus its lower triangle, built for the sym kernels on first use.
+struct Matrix : CsrMatrix
+{
+    MmCsr lower;
+};
+
+bool build_lower(Matrix &m)
+{
+    if (m.lower.rowptr != NULL)
+        return true;
+    m.lower.rows = m.rows;
+    m.lower.cols = m.cols;
+    if (!csr_lower_half(m.rowptr, m.colidx, m.values, m.rows, m.lower.rowptr, m.lower.colidx, m.lower.values))
+        return false;
+    m.lower.nnz = m.lower.rowptr[m.rows];
+    return true;
+}
+
+// Sets up kernel name on m; run() is what gets timed. stored is the number
+// of nonzeros the kernel reads.
+bool make_kernel(const string &name, Matrix &m, const double *x, double *y, MKL_INT nrhs, int threads,
+                 function<bool()> &run, function<void()> &cleanup, MKL_INT &stored)
+{
+    cleanup = []() {};
+    stored = m.nnz;
+    // the symmetric kernels read only the lower triangle, which needs a square A
+    if ((name == "sym" || name == "mkl_sym") && m.rows != m.cols)
+        return false;
+    if (name == "mkl" || name == "mkl_sym")
+    {
+        bool sym = name == "mkl_sym";
+        if (sym && !build_lower(m))
+            return false;
+        const MmCsr &h = m.lower;
+        sparse_matrix_t A;
+        sparse_status_t st = sym ? mkl_sparse_d_create_csr(&A, SPARSE_INDEX_BASE_ZERO, h.rows, h.cols, h.rowptr, h.rowptr + 1, h.colidx, h.values)
+                                 : mkl_sparse_d_create_csr(&A, SPARSE_INDEX_BASE_ZERO, m.rows, m.cols, m.rowptr, m.rowptr + 1, m.colidx, m.values);
+        if (st != SPARSE_STATUS_SUCCESS)
+            return false;
+        matrix_descr descr;
+        descr.type = sym ? SPARSE_MATRIX_TYPE_SYMMETRIC : SPARSE_MATRIX_TYPE_GENERAL;
+        descr.mode = SPARSE_FILL_MODE_LOWER;
+        descr.diag = SPARSE_DIAG_NON_UNIT;
+        st = nrhs == 1 ? mkl_sparse_set_mv_hint(A, SPARSE_OPERATION_NON_TRANSPOSE, descr, 1000)
+                       : mkl_sparse_set_mm_hint(A, SPARSE_OPERATION_NON_TRANSPOSE, descr, SPARSE_LAYOUT_ROW_MAJOR, nrhs, 1000);
+        if (st != SPARSE_STATUS_SUCCESS || mkl_sparse_optimize(A) != SPARSE_STATUS_SUCCESS)
+        {
+            mkl_sparse_destroy(A);
+            return false;
+        }
+        if (sym)
+            stored = h.nnz;
+        run = [A, descr, x, y, nrhs]() {
+            if (nrhs == 1)
+                return mkl_sparse_d_mv(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, A, descr, x, 0.0, y) == SPARSE_STATUS_SUCCESS;
+            return mkl_sparse_d_mm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, A, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                   x, nrhs, nrhs, 0.0, y, nrhs) == SPARSE_STATUS_SUCCESS;
+        };
+        cleanup = [A]() { mkl_sparse_destroy(A); };
+        return true;
+    }
+    if (name == "sym")
+    {
+        if (!build_lower(m))
+            return false;
+        stored = m.lower.nnz;
+        SpmvSymPlan *plan = new SpmvSymPlan;
+        spmv_sym_plan(m.lower.rowptr, m.lower.colidx, m.rows, threads, *plan);
+        run = [&m, plan, x, y, nrhs]() {
+            const MmCsr &h = m.lower;
+            spmm_sym(*plan, nrhs, 1.0, h.rowptr, h.colidx, h.values, x, nrhs, 0.0, y, nrhs);
+            return true;
+        };
+        cleanup = [plan]() { delete plan; };
+        return true;
+    }
+    if (nrhs != 1)
+        return false;
+    if (name == "tiles")
+    {
+        vector<CsrView<double>> *tiles = new vector<CsrView<double>>;
+        for (MKL_INT c0 = 0; c0 < m.cols || c0 == 0; c0 += SPMV_TILE_COLS)
+        {
+            tiles->push_back(CsrView<double>());
+            if (!csr_view(m.values, m.colidx, m.rowptr, m.rows, m.cols, 0, m.rows, c0, min(m.cols, c0 + SPMV_TILE_COLS), tiles->back()))
+                break;
+        }
+        cleanup = [tiles]() {
+            for (size_t t = 0; t < tiles->size(); t++)
+                tiles->at(t).release();
+            delete tiles;
+        };
+        if (tiles->back().pointerB == NULL)
+        {
+            cleanup();
+            return false;
+        }
+        run = [tiles, x, y]() {
+            for (size_t t = 0; t < tiles->size(); t++)
+                spmv_rows(tiles->at(t), 1.0, x, t == 0 ? 0.0 : 1.0, y);
+            return true;
+        };
+        return true;
+    }
+    if (name == "merge_tiles")
+    {
+        vector<CsrView<double>> *tiles = new vector<CsrView<double>>;
+        vector<SpmvPlan> *plans = new vector<SpmvPlan>;
+        for (MKL_INT r0 = 0; r0 < m.rows || r0 == 0; r0 += SPMV_TILE_ROWS)
+        {
+            tiles->push_back(CsrView<double>());
+            if (!csr_view(m.values, m.colidx, m.rowptr, m.rows, m.cols, r0, min(m.rows, r0 + SPMV_TILE_ROWS), 0, m.cols, tiles->back()))
+                break;
+            plans->push_back(SpmvPlan());
+            spmv_merge_plan(tiles->back(), threads, plans->back());
+        }
+        cleanup = [tiles, plans]() {
+            for (size_t t = 0; t < tiles->size(); t++)
+                tiles->at(t).release();
+            delete tiles;
+            delete plans;
+        };
+        if (tiles->back().pointerB == NULL)
+        {
+            cleanup();
+            return false;
+        }
+        run = [tiles, plans, x, y]() {
+            for (size_t t = 0; t < tiles->size(); t++)
+                spmv_merge(plans->at(t), tiles->at(t), 1.0, x, 0.0, y + tiles->at(t).row_begin);
+            return true;
+        };
+        return true;
+    }
+    if (name == "merge")
+    {
+        // planned once per matrix and thread count, outside the timed region
+        SpmvPlan *plan = new SpmvPlan;
+        spmv_merge_plan(m.rowptr, m.rows, threads, *plan);
+        run = [&m, plan, x, y]() {
+            spmv_merge(*plan, m.rows, 1.0, m.rowptr, m.colidx, m.values, x, 0.0, y);
+            return true;
+        };
+        cleanup = [plan]() { delete plan; };
+        return true;
+    }
+    if (name == "rows")
+    {
+        run = [&m, x, y]() {
+            spmv_rows(m.rows, 1.0, m.rowptr, m.colidx, m.values, x, 0.0, y);
+            return true;
+        };
+        return true;
+    }
+    return false;
+}
+
+struct Options
+{
+    vector<string> matrices, kernels, threads, nrhs;
+    int warmup, iters;
+    bool json;
+    string out;
+};
+
+bool parse_options(int argc, char **argv, Options &o)
+{
+    o.kernels = split_list("mkl,merge,rows");
+    o.nrhs = split_list("1");
+    o.warmup = 5;
+    o.iters = 50;
+    o.json = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            vector<string> m = split_list(arg);
+            o.matrices.insert(o.matrices.end(), m.begin(), m.end());
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+        string val = argv[++i];
+        if (arg == "--kernels")
+            o.kernels = split_list(val);
+        else if (arg == "--threads")
+            o.threads = split_list(val);
+        else if (arg == "--nrhs")
+            o.nrhs = split_list(val);
+        else if (arg == "--warmup")
+            o.warmup = atoi(val.c_str());
+        else if (arg == "--iters")
+            o.iters = atoi(val.c_str());
+        else if (arg == "--format")
+            o.json = (val == "json");
+        else if (arg == "--out")
+            o.out = val;
+        else
+            return false;
+    }
+    if (o.threads.empty())
+        o.threads.push_back(to_string(mkl_get_max_threads()));
+    return !o.matrices.empty() && o.iters > 0 && o.warmup >= 0;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!parse_options(argc, argv, opt))
+    {
+        fprintf(stderr, "Usage: %s <matrix.mtx list> [--kernels mkl,merge,rows,sym,mkl_sym,tiles,merge_tiles] [--threads list]\n"
+                        "          [--nrhs list] [--warmup n] [--iters n] [--format csv|json] [--out file]\n",
+                argv[0]);
+        return -1;
+    }
+    FILE *out = opt.out.empty() ? stdout : fopen(opt.out.c_str(), "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Cannot open %s\n", opt.out.c_str());
+        return -1;
+    }
+    BenchWriter writer(out, opt.json);
+
+    for (size_t im = 0; im < opt.matrices.size(); im++)
+    {
+        Matrix m;
+        if (!load_csr_cached(opt.matrices[im], m))
+            return -1;
+        MKL_INT max_row = 0;
+        for (MKL_INT i = 0; i < m.rows; i++)
+            max_row = max(max_row, m.rowptr[i + 1] - m.rowptr[i]);
+        for (size_t ir = 0; ir < opt.nrhs.size(); ir++)
+        {
+            MKL_INT nrhs = atol(opt.nrhs[ir].c_str());
+            size_t nx = (size_t)m.cols * nrhs, ny = (size_t)m.rows * nrhs;
+            double *x = (double *)mkl_malloc(sizeof(double) * (nx ? nx : 1), 64);
+            double *y = (double *)mkl_malloc(sizeof(double) * (ny ? ny : 1), 64);
+            double *ref = (double *)mkl_malloc(sizeof(double) * (ny ? ny : 1), 64);
+            if (x == NULL || y == NULL || ref == NULL)
+            {
+                fprintf(stderr, "Host memory allocation failed!\n");
+                return -1;
+            }
+            for (size_t j = 0; j < nx; j++)
+                x[j] = static_cast<double>(rand()) / static_cast<double>(RAND_MAX);
+
+            // reference: plain full-storage mkl_sparse_d_mv/mm
+            sparse_matrix_t A;
+            matrix_descr descr;
+            descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+            descr.mode = SPARSE_FILL_MODE_LOWER;
+            descr.diag = SPARSE_DIAG_NON_UNIT;
+            if (mkl_sparse_d_create_csr(&A, SPARSE_INDEX_BASE_ZERO, m.rows, m.cols, m.rowptr, m.rowptr + 1, m.colidx, m.values) != SPARSE_STATUS_SUCCESS ||
+                (nrhs == 1 ? mkl_sparse_d_mv(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, A, descr, x, 0.0, ref)
+                           : mkl_sparse_d_mm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, A, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                             x, nrhs, nrhs, 0.0, ref, nrhs)) != SPARSE_STATUS_SUCCESS)
+            {
+                fprintf(stderr, "Reference mkl_sparse_d_mv failed\n");
+                return -1;
+            }
+            mkl_sparse_destroy(A);
+            double scale = 0;
+            for (size_t i = 0; i < ny; i++)
+                scale = max(scale, fabs(ref[i]));
+
+            for (size_t ik = 0; ik < opt.kernels.size(); ik++)
+            {
+                for (size_t it = 0; it < opt.threads.size(); it++)
+                {
+                    const string &name = opt.kernels[ik];
+                    int threads = atoi(opt.threads[it].c_str());
+                    mkl_set_num_threads(threads);
+                    omp_set_num_threads(threads);
+                    function<bool()> run;
+                    function<void()> cleanup;
+                    LatencyStats lat;
+                    MKL_INT stored;
+                    if (!make_kernel(name, m, x, y, nrhs, threads, run, cleanup, stored))
+                    {
+                        fprintf(stderr, "Kernel %s could not be set up for nrhs %lld\n", name.c_str(), (long long)nrhs);
+                        break;
+                    }
+                    bool ok = time_kernel(run, opt.warmup, opt.iters, lat);
+                    cleanup();
+                    if (!ok)
+                    {
+                        fprintf(stderr, "Kernel %s failed\n", name.c_str());
+                        break;
+                    }
+                    double err = 0;
+                    for (size_t i = 0; i < ny; i++)
+                        err = max(err, fabs(y[i] - ref[i]));
+                    double sec = lat.median * 1e-3;
+                    BenchRecord r;
+                    r.add("kernel", name);
+                    r.add("matrix", m.path);
+                    r.add("rows", (long long)m.rows);
+                    r.add("cols", (long long)m.cols);
+                    r.add("nnz", (long long)m.nnz);
+                    r.add("stored_nnz", (long long)stored);
+                    r.add("max_row_nnz", (long long)max_row);
+                    r.add("nrhs", (long long)nrhs);
+                    r.add("threads", (long long)threads);
+                    r.add_latency(lat);
+                    r.add("gflops", 2.0 * m.nnz * nrhs / sec * 1e-9);
+                    r.add("gbs", spmv_bytes(m.rows, m.cols, stored, sizeof(double), false, nrhs) / sec * 1e-9);
+                    r.add("max_rel_err", scale > 0 ? err / scale : err);
+                    writer.write(r);
+                }
+            }
+            mkl_free(x);
+            mkl_free(y);
+            mkl_free(ref);
+        }
+        m.release();
+        m.lower.release();
+    }
+    writer.finish();
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_types.h"
+#include "csr_view.hpp"
+
+// Level-scheduled sparse triangular solve, X = alpha * inv(T) * B, T lower
+// or upper triangular in zero-based CSR with the diagonal stored (unless
+// unit) and B/X row-major with nrhs columns. T is read in four-array form
+// with column indices offset by base, so a square minor CsrView (columns
+// base.. of the parent) is solved in place.
+//
+// Row i can be solved once every row it references is, so rows are grouped
+// into levels: level(i) = 1 + max level of the rows in its off-diagonal
+// entries. Rows of one level are independent and split across threads,
+// with a barrier between levels. The schedule depends only on the pattern;
+// TrsvSolver builds it once, keeps it next to the matrix arrays and reuses
+// it for every solve. Runs of consecutive levels narrower than
+// TRSV_SERIAL_LEVEL rows (the long tail of chain-like factors) are merged
+// into one phase solved by a single thread in level order, so they cost one
+// barrier instead of one per level.
+const MKL_INT TRSV_SERIAL_LEVEL = 64;
+
+struct TrsvPlan
+{
+    MKL_INT levels;
+    std::vector<MKL_INT> level_ptr; // levels + 1 offsets into order
+    std::vector<MKL_INT> order;     // rows grouped by level
+    std::vector<MKL_INT> diag;      // position of each row's diagonal, -1 if absent
+    std::vector<MKL_INT> phase_ptr; // phases as offsets into order
+    std::vector<char> phase_parallel;
+};
+
+// False when a row of a non-unit matrix has no diagonal entry or an entry
+// on the wrong side of it.
+inline bool trsv_analyse(const MKL_INT *pointerB, const MKL_INT *pointerE, const MKL_INT *colidx, MKL_INT base, MKL_INT rows,
+                         bool lower, bool unit, TrsvPlan &plan)
+{
+    std::vector<MKL_INT> level(rows, 0);
+    plan.diag.assign(rows, -1);
+    plan.levels = 0;
+    bool ok = true;
+    for (MKL_INT n = 0; n < rows; n++)
+    {
+        MKL_INT i = lower ? n : rows - 1 - n;
+        MKL_INT l = 0;
+        for (MKL_INT k = pointerB[i]; k < pointerE[i]; k++)
+        {
+            MKL_INT j = colidx[k] - base;
+            if (j == i)
+                plan.diag[i] = k;
+            else if ((j < i) == lower)
+                l = std::max(l, level[j] + 1);
+            else
+                ok = false;
+        }
+        level[i] = l;
+        plan.levels = std::max(plan.levels, l + 1);
+        if (!unit && plan.diag[i] < 0)
+            ok = false;
+    }
+    // counting sort of the rows by level, ascending row order within a level
+    plan.level_ptr.assign(plan.levels + 1, 0);
+    for (MKL_INT i = 0; i < rows; i++)
+        plan.level_ptr[level[i] + 1]++;
+    for (MKL_INT l = 0; l < plan.levels; l++)
+        plan.level_ptr[l + 1] += plan.level_ptr[l];
+    plan.order.resize(rows);
+    std::vector<MKL_INT> fill(plan.level_ptr.begin(), plan.level_ptr.end() - 1);
+    for (MKL_INT i = 0; i < rows; i++)
+        plan.order[fill[level[i]]++] = i;
+    plan.phase_ptr.assign(1, 0);
+    plan.phase_parallel.clear();
+    for (MKL_INT l = 0; l < plan.levels; l++)
+    {
+        bool parallel = plan.level_ptr[l + 1] - plan.level_ptr[l] >= TRSV_SERIAL_LEVEL;
+        if (parallel || plan.phase_parallel.empty() || plan.phase_parallel.back())
+        {
+            plan.phase_ptr.push_back(plan.level_ptr[l + 1]);
+            plan.phase_parallel.push_back(parallel);
+        }
+        else
+            plan.phase_ptr.back() = plan.level_ptr[l + 1];
+    }
+    return ok;
+}
+
+// Solves row i for all nrhs columns; the rows it references are already in X.
+template <typename T>
+inline void trsv_row(MKL_INT i, const MKL_INT *pointerB, const MKL_INT *pointerE, const MKL_INT *colidx, MKL_INT base, const T *values,
+                     MKL_INT diag, bool unit, T alpha, const T *B, MKL_INT ldb, T *X, MKL_INT ldx, MKL_INT nrhs)
+{
+    T *x = X + (size_t)i * ldx;
+    const T *b = B + (size_t)i * ldb;
+    if (nrhs == 1)
+    {
+        T sum = alpha * b[0];
+        for (MKL_INT k = pointerB[i]; k < pointerE[i]; k++)
+            if (k != diag)
+                sum -= values[k] * X[(size_t)(colidx[k] - base) * ldx];
+        x[0] = unit ? sum : sum / values[diag];
+        return;
+    }
+    for (MKL_INT c = 0; c < nrhs; c++)
+        x[c] = alpha * b[c];
+    for (MKL_INT k = pointerB[i]; k < pointerE[i]; k++)
+    {
+        if (k == diag)
+            continue;
+        const T v = values[k];
+        const T *xj = X + (size_t)(colidx[k] - base) * ldx;
+        for (MKL_INT c = 0; c < nrhs; c++)
+            x[c] -= v * xj[c];
+    }
+    if (!unit)
+    {
+        const T inv = T(1) / values[diag];
+        for (MKL_INT c = 0; c < nrhs; c++)
+            x[c] *= inv;
+    }
+}
+
+// A triangular matrix bound to its schedule. The CSR arrays (or the view's)
+// are referenced, not copied, and must outlive the solver; solve() only
+// reads shared state and may run concurrently on distinct B/X.
+template <typename T>
+class TrsvSolver
+{
+public:
+    TrsvSolver(const MKL_INT *rowptr, const MKL_INT *colidx, const T *values, MKL_INT rows, bool lower, bool unit = false)
+        : pointerB_(rowptr), pointerE_(rowptr + 1), colidx_(colidx), values_(values), base_(0), rows_(rows), lower_(lower), unit_(unit)
+    {
+        if (!trsv_analyse(pointerB_, pointerE_, colidx_, base_, rows_, lower_, unit_, plan_))
+            throw "Matrix is not triangular or misses a diagonal entry!";
+    }
+
+    // Solves with a square minor of the parent (rows and columns from the
+    // same offset); B and X have A.rows rows.
+    TrsvSolver(const CsrView<T> &A, bool lower, bool unit = false)
+        : pointerB_(A.pointerB), pointerE_(A.pointerE), colidx_(A.columns), values_(A.values), base_(A.col_begin), rows_(A.rows),
+          lower_(lower), unit_(unit)
+    {
+        if (!A.square_minor())
+            throw "View is not a square minor!";
+        if (!trsv_analyse(pointerB_, pointerE_, colidx_, base_, rows_, lower_, unit_, plan_))
+            throw "Matrix is not triangular or misses a diagonal entry!";
+    }
+
+    // X (rows x nrhs) = alpha * inv(T) * B. X may alias B when ldx == ldb.
+    void solve(T alpha, const T *B, MKL_INT ldb, T *X, MKL_INT ldx, MKL_INT nrhs = 1) const
+    {
+        const MKL_INT *order = plan_.order.data();
+        const MKL_INT *phase_ptr = plan_.phase_ptr.data();
+        const MKL_INT *diag = plan_.diag.data();
+        const MKL_INT phases = plan_.phase_parallel.size();
+#pragma omp parallel
+        {
+            for (MKL_INT p = 0; p < phases; p++)
+            {
+                MKL_INT b = phase_ptr[p], e = phase_ptr[p + 1];
+                if (!plan_.phase_parallel[p])
+                {
+#pragma omp single
+                    for (MKL_INT n = b; n < e; n++)
+                        trsv_row(order[n], pointerB_, pointerE_, colidx_, base_, values_, diag[order[n]], unit_, alpha, B, ldb, X, ldx, nrhs);
+                }
+                else
+                {
+#pragma omp for schedule(static)
+                    for (MKL_INT n = b; n < e; n++)
+                        trsv_row(order[n], pointerB_, pointerE_, colidx_, base_, values_, diag[order[n]], unit_, alpha, B, ldb, X, ldx, nrhs);
+                }
+            }
+        }
+    }
+
+    MKL_INT rows() const { return rows_; }
+    bool lower() const { return lower_; }
+    MKL_INT levels() const { return plan_.levels; }
+    MKL_INT phases() const { return plan_.phase_parallel.size(); }
+    const TrsvPlan &plan() const { return plan_; }
+
+private:
+    const MKL_INT *pointerB_, *pointerE_, *colidx_;
+    const T *values_;
+    MKL_INT base_, rows_;
+    bool lower_, unit_;
+    TrsvPlan plan_;
+};
@@ -0,0 +1,351 @@
+// Sparse triangular solve benchmark on Matrix Market inputs.
+//
+// Each matrix is loaded through its "<file>.csrbin" cache. Its lower (or,
+// with --uplo upper, upper) triangle including the diagonal is the factor T;
+// an input that already is a triangular factor passes through unchanged.
+// Rows whose diagonal is missing or zero get the absolute sum of their
+// off-diagonal entries plus one, so triangles of general matrices stay
+// solvable. For every --nrhs and --threads entry X = inv(T) * B is timed with
+//
+//   mkl     mkl_sparse_d_trsv (nrhs 1) / mkl_sparse_d_trsm after
+//           mkl_sparse_set_sm_hint and mkl_sparse_optimize
+//   level   the level-scheduled TrsvSolver (trsv.hpp)
+//   level_minor  TrsvSolver on a CsrView (csr_view.hpp) of T's leading (lower)
+//           or trailing (upper) half, solving those rows of the same system
+//           without a copy; compared against the same rows of the full solution
+//
+//   trsv_bench a.mtx,b.mtx --uplo lower --nrhs 1,8 --threads 1,16
+//              --warmup 3 --iters 20 --format csv|json --out results.csv
+//
+// Records carry the one-off analysis time (optimize, or building the level
+// schedule), median/p5/p95 solve latency, GFLOP/s (2 * nnz * nrhs), GB/s,
+// the number of levels and parallel/serial phases, and the max relative
+// difference to the mkl solution.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <omp.h>
+#include "mkl.h"
+#include "mkl_spblas.h"
+#include "mkl_types.h"
+#include "bench_stats.hpp"
+#include "csr_cache.hpp"
+#include "csr_view.hpp"
+#include "trsv.hpp"
+
+using namespace std;
+
+// The triangle of a square m with a usable diagonal, as new arrays in t.
+bool extract_triangle(const CsrMatrix &m, bool lower, MmCsr &t)
+{
+    t.rows = t.cols = m.rows;
+    t.rowptr = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * (m.rows + 1), 64);
+    if (t.rowptr == NULL)
+        return false;
+    t.rowptr[0] = 0;
+    for (MKL_INT i = 0; i < m.rows; i++)
+    {
+        MKL_INT cnt = 1; // diagonal, present or added
+        for (MKL_INT k = m.rowptr[i]; k < m.rowptr[i + 1]; k++)
+            cnt += m.colidx[k] != i && (m.colidx[k] < i) == lower;
+        t.rowptr[i + 1] = t.rowptr[i] + cnt;
+    }
+    t.nnz = t.rowptr[m.rows];
+    t.colidx = (MKL_INT *)mkl_malloc(sizeof(MKL_INT) * t.nnz, 64);
+    t.values = (double *)mkl_malloc(sizeof(double) * t.nnz, 64);
+    if (t.colidx == NULL || t.values == NULL)
+        return false;
+#pragma omp parallel for schedule(static)
+    for (MKL_INT i = 0; i < m.rows; i++)
+    {
+        // off-diagonal entries keep their order, the diagonal goes last (lower) or first (upper)
+        MKL_INT dst = t.rowptr[i] + (lower ? 0 : 1);
+        double diag = 0, off = 0;
+        for (MKL_INT k = m.rowptr[i]; k < m.rowptr[i + 1]; k++)
+        {
+            MKL_INT j = m.colidx[k];
+            if (j == i)
+                diag += m.values[k];
+            else if ((j < i) == lower)
+            {
+                t.colidx[dst] = j;
+                t.values[dst++] = m.values[k];
+                off += fabs(m.values[k]);
+            }
+        }
+        MKL_INT d = lower ? t.rowptr[i + 1] - 1 : t.rowptr[i];
+        t.colidx[d] = i;
+        t.values[d] = diag != 0 ? diag : off + 1;
+    }
+    return true;
+}
+
+struct Options
+{
+    vector<string> matrices, nrhs, threads, kernels;
+    int warmup, iters;
+    bool json, lower;
+    string out;
+};
+
+bool parse_options(int argc, char **argv, Options &o)
+{
+    o.kernels = split_list("mkl,level");
+    o.nrhs = split_list("1");
+    o.warmup = 3;
+    o.iters = 20;
+    o.json = false;
+    o.lower = true;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            vector<string> m = split_list(arg);
+            o.matrices.insert(o.matrices.end(), m.begin(), m.end());
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+        string val = argv[++i];
+        if (arg == "--kernels")
+            o.kernels = split_list(val);
+        else if (arg == "--nrhs")
+            o.nrhs = split_list(val);
+        else if (arg == "--threads")
+            o.threads = split_list(val);
+        else if (arg == "--uplo")
+            o.lower = val != "upper";
+        else if (arg == "--warmup")
+            o.warmup = atoi(val.c_str());
+        else if (arg == "--iters")
+            o.iters = atoi(val.c_str());
+        else if (arg == "--format")
+            o.json = (val == "json");
+        else if (arg == "--out")
+            o.out = val;
+        else
+            return false;
+    }
+    if (o.threads.empty())
+        o.threads.push_back(to_string(mkl_get_max_threads()));
+    return !o.matrices.empty() && o.iters > 0 && o.warmup >= 0;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!parse_options(argc, argv, opt))
+    {
+        fprintf(stderr, "Usage: %s <matrix.mtx list> [--uplo lower|upper] [--nrhs list] [--kernels mkl,level,level_minor]\n"
+                        "          [--threads list] [--warmup n] [--iters n] [--format csv|json] [--out file]\n",
+                argv[0]);
+        return -1;
+    }
+    FILE *out = opt.out.empty() ? stdout : fopen(opt.out.c_str(), "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Cannot open %s\n", opt.out.c_str());
+        return -1;
+    }
+    BenchWriter writer(out, opt.json);
+
+    for (size_t im = 0; im < opt.matrices.size(); im++)
+    {
+        CsrMatrix m;
+        MmCsr t;
+        if (!load_csr_cached(opt.matrices[im], m))
+            return -1;
+        if (m.rows != m.cols)
+        {
+            fprintf(stderr, "%s is not square\n", m.path.c_str());
+            m.release();
+            continue;
+        }
+        if (!extract_triangle(m, opt.lower, t))
+        {
+            fprintf(stderr, "Host memory allocation failed!\n");
+            return -1;
+        }
+        matrix_descr descr;
+        descr.type = SPARSE_MATRIX_TYPE_TRIANGULAR;
+        descr.mode = opt.lower ? SPARSE_FILL_MODE_LOWER : SPARSE_FILL_MODE_UPPER;
+        descr.diag = SPARSE_DIAG_NON_UNIT;
+
+        for (size_t ir = 0; ir < opt.nrhs.size(); ir++)
+        {
+            MKL_INT nrhs = atol(opt.nrhs[ir].c_str());
+            size_t n = (size_t)t.rows * nrhs;
+            double *B = (double *)mkl_malloc(sizeof(double) * (n ? n : 1), 64);
+            double *X = (double *)mkl_malloc(sizeof(double) * (n ? n : 1), 64);
+            double *ref = (double *)mkl_malloc(sizeof(double) * (n ? n : 1), 64);
+            if (B == NULL || X == NULL || ref == NULL)
+            {
+                fprintf(stderr, "Host memory allocation failed!\n");
+                return -1;
+            }
+            for (size_t i = 0; i < n; i++)
+                B[i] = static_cast<double>(rand()) / static_cast<double>(RAND_MAX);
+
+            // reference: unoptimized mkl_sparse_d_trsm
+            sparse_matrix_t A;
+            if (mkl_sparse_d_create_csr(&A, SPARSE_INDEX_BASE_ZERO, t.rows, t.cols, t.rowptr, t.rowptr + 1, t.colidx, t.values) != SPARSE_STATUS_SUCCESS ||
+                mkl_sparse_d_trsm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, A, descr, SPARSE_LAYOUT_ROW_MAJOR, B, nrhs, nrhs, ref, nrhs) != SPARSE_STATUS_SUCCESS)
+            {
+                fprintf(stderr, "Reference mkl_sparse_d_trsm failed\n");
+                return -1;
+            }
+            mkl_sparse_destroy(A);
+            double scale = 0;
+            for (size_t i = 0; i < n; i++)
+                scale = max(scale, fabs(ref[i]));
+
+            for (size_t ik = 0; ik < opt.kernels.size(); ik++)
+            {
+                for (size_t it = 0; it < opt.threads.size(); it++)
+                {
+                    const string &name = opt.kernels[ik];
+                    int threads = atoi(opt.threads[it].c_str());
+                    mkl_set_num_threads(threads);
+                    omp_set_num_threads(threads);
+                    function<bool()> run;
+                    function<void()> cleanup = []() {};
+                    long long levels = 0, phases = 0;
+                    // rows [r0, r0 + rows) of X are solved, nnz entries of T read
+                    MKL_INT r0 = 0, rows = t.rows, nnz = t.nnz;
+                    double analysis_start = wall_time();
+                    if (name == "mkl")
+                    {
+                        sparse_matrix_t S;
+                        if (mkl_sparse_d_create_csr(&S, SPARSE_INDEX_BASE_ZERO, t.rows, t.cols, t.rowptr, t.rowptr + 1, t.colidx, t.values) != SPARSE_STATUS_SUCCESS)
+                            break;
+                        if (mkl_sparse_set_sm_hint(S, SPARSE_OPERATION_NON_TRANSPOSE, descr, SPARSE_LAYOUT_ROW_MAJOR, nrhs, 1000) != SPARSE_STATUS_SUCCESS ||
+                            mkl_sparse_optimize(S) != SPARSE_STATUS_SUCCESS)
+                        {
+                            mkl_sparse_destroy(S);
+                            fprintf(stderr, "Analysis failed!!\n");
+                            break;
+                        }
+                        run = [S, descr, B, X, nrhs]() {
+                            if (nrhs == 1)
+                                return mkl_sparse_d_trsv(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, S, descr, B, X) == SPARSE_STATUS_SUCCESS;
+                            return mkl_sparse_d_trsm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, S, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                                     B, nrhs, nrhs, X, nrhs) == SPARSE_STATUS_SUCCESS;
+                        };
+                        cleanup = [S]() { mkl_sparse_destroy(S); };
+                    }
+                    else if (name == "level")
+                    {
+                        TrsvSolver<double> *solver;
+                        try
+                        {
+                            solver = new TrsvSolver<double>(t.rowptr, t.colidx, t.values, t.rows, opt.lower);
+                        }
+                        catch (const char *msg)
+                        {
+                            fprintf(stderr, "%s\n", msg);
+                            break;
+                        }
+                        levels = solver->levels();
+                        phases = solver->phases();
+                        run = [solver, B, X, nrhs]() {
+                            solver->solve(1.0, B, nrhs, X, nrhs, nrhs);
+                            return true;
+                        };
+                        cleanup = [solver]() { delete solver; };
+                    }
+                    else if (name == "level_minor")
+                    {
+                        // the first rows of a lower system (last of an upper one) only depend on each other
+                        MKL_INT h = t.rows / 2;
+                        r0 = opt.lower ? 0 : h;
+                        CsrView<double> *v = new CsrView<double>;
+                        TrsvSolver<double> *solver = NULL;
+                        if (!csr_view(t.values, t.colidx, t.rowptr, t.rows, t.cols, r0, opt.lower ? h : t.rows, r0,
+                                      opt.lower ? h : t.cols, *v))
+                        {
+                            delete v;
+                            fprintf(stderr, "Host memory allocation failed!\n");
+                            break;
+                        }
+                        try
+                        {
+                            solver = new TrsvSolver<double>(*v, opt.lower);
+                        }
+                        catch (const char *msg)
+                        {
+                            fprintf(stderr, "%s\n", msg);
+                            v->release();
+                            delete v;
+                            break;
+                        }
+                        rows = v->rows;
+                        nnz = v->nnz;
+                        levels = solver->levels();
+                        phases = solver->phases();
+                        const double *Bv = B + (size_t)r0 * nrhs;
+                        double *Xv = X + (size_t)r0 * nrhs;
+                        run = [solver, Bv, Xv, nrhs]() {
+                            solver->solve(1.0, Bv, nrhs, Xv, nrhs, nrhs);
+                            return true;
+                        };
+                        cleanup = [solver, v]() {
+                            delete solver;
+                            v->release();
+                            delete v;
+                        };
+                    }
+                    else
+                    {
+                        fprintf(stderr, "Unknown kernel %s\n", name.c_str());
+                        break;
+                    }
+                    double analysis_ms = (wall_time() - analysis_start) * 1000.0;
+                    LatencyStats lat;
+                    bool ok = time_kernel(run, opt.warmup, opt.iters, lat);
+                    cleanup();
+                    if (!ok)
+                    {
+                        fprintf(stderr, "Kernel %s failed\n", name.c_str());
+                        break;
+                    }
+                    double err = 0;
+                    for (size_t i = (size_t)r0 * nrhs; i < (size_t)(r0 + rows) * nrhs; i++)
+                        err = max(err, fabs(X[i] - ref[i]));
+                    double sec = lat.median * 1e-3;
+                    double bytes = (double)nnz * (sizeof(double) + sizeof(MKL_INT)) + (double)(rows + 1) * sizeof(MKL_INT) +
+                                   2.0 * rows * nrhs * sizeof(double);
+                    BenchRecord r;
+                    r.add("kernel", name);
+                    r.add("matrix", m.path);
+                    r.add("uplo", string(opt.lower ? "lower" : "upper"));
+                    r.add("rows", (long long)rows);
+                    r.add("nnz", (long long)nnz);
+                    r.add("nrhs", (long long)nrhs);
+                    r.add("threads", (long long)threads);
+                    r.add("levels", levels);
+                    r.add("phases", phases);
+                    r.add("analysis_ms", analysis_ms);
+                    r.add_latency(lat);
+                    r.add("gflops", 2.0 * nnz * nrhs / sec * 1e-9);
+                    r.add("gbs", bytes / sec * 1e-9);
+                    r.add("max_rel_err", scale > 0 ? err / scale : err);
+                    writer.write(r);
+                }
+            }
+            mkl_free(B);
+            mkl_free(X);
+            mkl_free(ref);
+        }
+        t.release();
+        m.release();
+    }
+    writer.finish();
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}